@@ -0,0 +1 @@
+/* see ../../../kshim.h */
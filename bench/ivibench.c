@@ -0,0 +1,273 @@
+/*************************************************************************
+ *
+ * ivibench.c :
+ *
+ * Userspace microbenchmark of the MAP-T/MAP-E mapping core. The session
+ * tables (ivi_map.c, ivi_map_tcp.c, ivi_port.c) and the rule tables
+ * (ivi_rule.c, ivi_rule6.c) are built from the module sources against
+ * kshim.h and timed for table sizes from 1k to 1M entries.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ *
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MAP-T/MAP-E Kernel Module. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#include <unistd.h>
+
+#include "ivi_rule.h"
+#include "ivi_rule6.h"
+#include "ivi_map.h"
+#include "ivi_map_tcp.h"
+
+unsigned long jiffies;
+u8 ivi_lat_enabled;  // latency histograms of ivi_trace.c, left off
+
+static u32 *lat;  // latency of each operation of a run, in ns
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(const char *table, int entries, const char *op, int n, int failed, u64 total)
+{
+	qsort(lat, n, sizeof(u32), cmp_u32);
+	printf("%-6s %8d  %-7s %12.0f %8u %8u %8d\n", table, entries, op, n * 1e9 / total,
+	       lat[n / 2], lat[(int)(n * 0.99)], failed);
+}
+
+// a private source and a public destination for every session, spread like real traffic
+static inline void flow(int i, u32 *oldaddr, u16 *oldp, u32 *dstaddr)
+{
+	*oldaddr = 0xc0a80000 + (i / 60000) + 1;        // 192.168.x.x
+	*oldp = 1024 + i % 60000;
+	*dstaddr = 0x08000000 + ((u32)i * 2654435761U >> 8);  // spread over 8.0.0.0/8
+}
+
+#define TIME(n, failed, stmt) do {                          \
+	u64 _start = now_ns(), _t0, _t1;                        \
+	int _i;                                                 \
+	total = 0;                                              \
+	for (_i = 0; _i < (n); _i++) {                          \
+		int i = order[_i];                                  \
+		_t0 = now_ns();                                     \
+		if ((stmt) < 0)                                     \
+			(failed)++;                                     \
+		_t1 = now_ns();                                     \
+		lat[_i] = (u32)(_t1 - _t0);                         \
+	}                                                       \
+	total = now_ns() - _start;                              \
+} while (0)
+
+static void shuffle(int *order, int n)
+{
+	int i, j, t;
+
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		t = order[i]; order[i] = order[j]; order[j] = t;
+	}
+}
+
+static void bench_udp(int n, int *order)
+{
+	u32 oldaddr, dstaddr;
+	u16 oldp, newp;
+	int failed = 0;
+	u64 total;
+
+	ivi_map_init();
+	ivi_map_set_htable_size(n);
+	ivi_map_port_setup(hgw_ratio, hgw_adjacent, hgw_offset);
+
+	shuffle(order, n);
+	TIME(n, failed, (flow(i, &oldaddr, &oldp, &dstaddr), get_outflow_map_port(&udp_list, oldaddr, oldp, dstaddr, hgw_ratio, hgw_adjacent, hgw_offset, &newp, NULL)));
+	report("udp", n, "insert", n, failed, total);
+
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, (flow(i, &oldaddr, &oldp, &dstaddr), get_outflow_map_port(&udp_list, oldaddr, oldp, dstaddr, hgw_ratio, hgw_adjacent, hgw_offset, &newp, NULL)));
+	report("udp", n, "lookup", n, failed, total);
+
+	ivi_map_exit();
+}
+
+static void bench_tcp(int n, int *order, const char *name)
+{
+	struct tcphdr th;
+	u32 oldaddr, dstaddr;
+	u16 oldp, newp;
+	int failed = 0;
+	u64 total;
+
+	memset(&th, 0, sizeof(th));
+	th.doff = 5;
+	th.syn = 1;
+	th.window = htons(65535);
+
+	ivi_map_tcp_init();
+	ivi_map_tcp_set_htable_size(n);
+	ivi_map_tcp_port_setup(hgw_ratio, hgw_adjacent, hgw_offset);
+
+	shuffle(order, n);
+	TIME(n, failed, (flow(i, &oldaddr, &oldp, &dstaddr), th.seq = htonl(i), get_outflow_tcp_map_port(oldaddr, oldp, dstaddr, 80, hgw_ratio, hgw_adjacent, hgw_offset, &th, sizeof(th), &newp)));
+	report(name, n, "insert", n, failed, total);
+
+	// retransmitted SYNs, the lookup and the state machine without changing the state
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, (flow(i, &oldaddr, &oldp, &dstaddr), th.seq = htonl(i), get_outflow_tcp_map_port(oldaddr, oldp, dstaddr, 80, hgw_ratio, hgw_adjacent, hgw_offset, &th, sizeof(th), &newp)));
+	report(name, n, "lookup", n, failed, total);
+
+	ivi_map_tcp_exit();
+}
+
+// one /24 rule per entry, mapped to its own /56 so that both tries hold n rules
+static inline void rule(int i, struct rule_info *r)
+{
+	memset(r, 0, sizeof(struct rule_info));
+	r->prefix4 = 0x01000000 + ((u32)i << 8);
+	r->plen4 = 24;
+	r->prefix6.s6_addr32[0] = htonl(0x20010db8);
+	r->prefix6.s6_addr32[1] = htonl((u32)i << 8);
+	r->plen6 = 56;
+	r->ratio = hgw_ratio;
+	r->adjacent = hgw_adjacent;
+	r->format = ADDR_FMT_MAPT;
+	r->transport = MAP_T;
+}
+
+static void bench_rule(int n, int *order)
+{
+	struct rule_info r;
+	struct in6_addr prefix6, addr6;
+	int plen4, plen6, failed = 0;
+	u32 prefix4;
+	u16 ratio, adjacent;
+	u8 fmt, transpt;
+	u64 total;
+
+	ivi_rule_init();
+	ivi_rule6_init();
+
+	shuffle(order, n);
+	TIME(n, failed, (rule(i, &r), ivi_rule_insert(&r) | ivi_rule6_insert(&r)));
+	report("rule", n, "insert", n, failed, total);
+
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, ivi_rule_lookup(0x01000000 + ((u32)i << 8) + (i & 0xff), &prefix6, &plen4, &plen6, &ratio, &adjacent, &fmt, &transpt));
+	report("rule", n, "lookup", n, failed, total);
+
+	// the same lookups in the DIR-24-8 table compiled from the trie, up to 32767 rules
+	rule_dir24 = 1;
+	total = now_ns();
+	failed = ivi_rule_rebuild() < 0;
+	lat[0] = (u32)(total = now_ns() - total);
+	report("rule", n, "build", 1, failed, total);
+
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, ivi_rule_lookup(0x01000000 + ((u32)i << 8) + (i & 0xff), &prefix6, &plen4, &plen6, &ratio, &adjacent, &fmt, &transpt));
+	report("rule24", n, "lookup", n, failed, total);
+
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, (rule(i, &r), addr6 = r.prefix6, addr6.s6_addr32[3] = htonl(i), ivi_rule6_lookup(&addr6, &plen6, &prefix4, &plen4, &ratio, &adjacent, &fmt)));
+	report("rule6", n, "lookup", n, failed, total);
+
+	// the same lookups in the multibit table compiled from the radix tree
+	total = now_ns();
+	failed = ivi_rule6_rebuild() < 0;
+	lat[0] = (u32)(total = now_ns() - total);
+	report("rule6", n, "build", 1, failed, total);
+
+	failed = 0;
+	shuffle(order, n);
+	TIME(n, failed, (rule(i, &r), addr6 = r.prefix6, addr6.s6_addr32[3] = htonl(i), ivi_rule6_lookup(&addr6, &plen6, &prefix4, &plen4, &ratio, &adjacent, &fmt)));
+	report("rule6m", n, "lookup", n, failed, total);
+
+	ivi_rule6_exit();
+	ivi_rule_exit();
+	rule_dir24 = 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-r ratio] [-a adjacent] [-o offset] [-m max_entries]\n", name);
+	printf("\tratio, adjacent and offset set up the port pool as for ivictl -H, default 1:1 mapping\n");
+	printf("\tmax_entries is the largest table size to run, 1048576 by default\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int max = 1 << 20, n, opt, *order;
+
+	while ((opt = getopt(argc, argv, "r:a:o:m:h")) != -1) {
+		switch (opt) {
+			case 'r':
+				hgw_ratio = atoi(optarg);
+				break;
+			case 'a':
+				hgw_adjacent = atoi(optarg);
+				break;
+			case 'o':
+				hgw_offset = atoi(optarg);
+				break;
+			case 'm':
+				max = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	order = (int *)malloc(max * sizeof(int));
+	lat = (u32 *)malloc(max * sizeof(u32));
+	if (!order || !lat) {
+		printf("Error: out of memory.\n");
+		return 1;
+	}
+
+	srand(1);
+	printf("%-6s %8s  %-7s %12s %8s %8s %8s\n", "table", "entries", "op", "ops/s", "p50(ns)", "p99(ns)", "failed");
+	for (n = 1024; n <= max; n <<= 2) {
+		bench_udp(n, order);
+		bench_tcp(n, order, "tcp");
+		tcp_light = 1;
+		bench_tcp(n, order, "tcpl");
+		tcp_light = 0;
+		bench_rule(n, order);
+	}
+
+	free(order);
+	free(lat);
+	return 0;
+}
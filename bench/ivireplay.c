@@ -0,0 +1,578 @@
+/*************************************************************************
+ *
+ * ivireplay.c :
+ *
+ * Replays a pcap capture through ivi_v4v6_xmit() and ivi_v6v4_xmit(),
+ * built from the module sources against kshim.h, as if every IPv4 frame
+ * arrived on the IPv4 device and every IPv6 frame on the IPv6 device of a
+ * MAP CE. Reports packets/s and ns/packet by direction, MAP-T or MAP-E and
+ * protocol, and writes the translated frames to a pcap for diffing.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ *
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MAP-T/MAP-E Kernel Module. If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#include <unistd.h>
+
+#include "ivi_xmit.h"
+
+unsigned long jiffies;
+u8 ivi_lat_enabled;  // latency histograms of ivi_trace.c, left off
+bool nat_conntrack;  // sessions in the tables of ivi_map.c, there is no conntrack here
+struct net init_net;
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+
+struct pcap_file_hdr {
+	u32 magic;
+	u16 version_major, version_minor;
+	s32 thiszone;
+	u32 sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_hdr {
+	u32 ts_sec, ts_frac, caplen, len;
+};
+
+// one captured frame, kept in memory so that the timed loop does no I/O
+struct frame {
+	struct pcap_rec_hdr hdr;
+	unsigned char *data;
+};
+
+// headroom of a freshly received skb, NET_SKB_PAD + NET_IP_ALIGN on most drivers
+#define RX_HEADROOM 66
+
+enum { DIR_4TO6, DIR_6TO4, DIR_MAX };
+enum { XPT_MAPT, XPT_MAPE, XPT_MAX };
+enum { CLS_TCP, CLS_UDP, CLS_ICMP, CLS_OTHER, CLS_MAX };
+
+static const char *dir_name[DIR_MAX] = { "4to6", "6to4" };
+static const char *xpt_name[XPT_MAX] = { "map-t", "map-e" };
+static const char *cls_name[CLS_MAX] = { "tcp", "udp", "icmp", "other" };
+
+struct counter {
+	u64 packets;
+	u64 ns;
+};
+
+static struct counter xlated[DIR_MAX][XPT_MAX][CLS_MAX];
+static struct counter accepted[DIR_MAX], dropped[DIR_MAX];
+static u64 skipped;
+
+static struct net_device replay_dev = { "replay0", 1, 1500, 0 };
+
+// translated frames handed back to the stack by the packet being timed
+static struct sk_buff_head out;
+
+static FILE *wfile;
+static int nsec;
+
+int netif_rx(struct sk_buff *skb)
+{
+	__skb_queue_tail(&out, skb);
+	return 0;
+}
+
+int netif_receive_skb(struct sk_buff *skb)
+{
+	return netif_rx(skb);
+}
+
+int dst_output(struct sk_buff *skb)
+{
+	return netif_rx(skb);
+}
+
+int ivi_nf_nat_out(struct sk_buff *skb)
+{
+	return -1;
+}
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline u32 swab32(u32 x)
+{
+	return __builtin_bswap32(x);
+}
+
+static struct frame *pcap_load(const char *name, int *count, u32 *linktype)
+{
+	struct pcap_file_hdr fh;
+	struct pcap_rec_hdr rh;
+	struct frame *frames = NULL;
+	int n = 0, size = 0, swapped;
+	FILE *f;
+
+	if (!(f = fopen(name, "rb"))) {
+		printf("Error: cannot open %s.\n", name);
+		return NULL;
+	}
+	if (fread(&fh, sizeof(fh), 1, f) != 1) {
+		printf("Error: %s is not a pcap file.\n", name);
+		goto out;
+	}
+	swapped = (fh.magic == swab32(PCAP_MAGIC) || fh.magic == swab32(PCAP_MAGIC_NSEC));
+	if (swapped) {
+		fh.magic = swab32(fh.magic);
+		fh.linktype = swab32(fh.linktype);
+	}
+	if (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NSEC) {
+		printf("Error: %s is not a pcap file.\n", name);
+		goto out;
+	}
+	if (fh.linktype != LINKTYPE_ETHERNET && fh.linktype != LINKTYPE_RAW) {
+		printf("Error: link type %u is not supported, only ethernet and raw IP are.\n", fh.linktype);
+		goto out;
+	}
+	nsec = (fh.magic == PCAP_MAGIC_NSEC);
+	*linktype = fh.linktype;
+
+	while (fread(&rh, sizeof(rh), 1, f) == 1) {
+		if (swapped) {
+			rh.ts_sec = swab32(rh.ts_sec);
+			rh.ts_frac = swab32(rh.ts_frac);
+			rh.caplen = swab32(rh.caplen);
+			rh.len = swab32(rh.len);
+		}
+		if (n == size) {
+			size = size ? size * 2 : 1024;
+			frames = (struct frame *)realloc(frames, size * sizeof(struct frame));
+		}
+		frames[n].hdr = rh;
+		frames[n].data = (unsigned char *)malloc(rh.caplen);
+		if (fread(frames[n].data, 1, rh.caplen, f) != rh.caplen) {
+			free(frames[n].data);
+			break;
+		}
+		n++;
+	}
+	*count = n;
+out:
+	fclose(f);
+	return frames;
+}
+
+static void pcap_write_hdr(FILE *f)
+{
+	struct pcap_file_hdr fh = { nsec ? PCAP_MAGIC_NSEC : PCAP_MAGIC, 2, 4, 0, 0, 65535, LINKTYPE_ETHERNET };
+
+	fwrite(&fh, sizeof(fh), 1, f);
+}
+
+static void pcap_write(FILE *f, const struct pcap_rec_hdr *in, struct sk_buff *skb)
+{
+	struct pcap_rec_hdr rh = *in;
+	unsigned char *mac = skb_mac_header(skb);
+
+	rh.caplen = rh.len = skb->len + (skb->data - mac);
+	fwrite(&rh, sizeof(rh), 1, f);
+	fwrite(mac, 1, rh.caplen, f);
+}
+
+/*
+ * Build the skb the netfilter hook would see for a frame: past the ethernet header,
+ * trimmed to the IP length and with the transport header set, as ip_rcv() and
+ * ipv6_rcv() leave it. Returns NULL for frames we do not replay.
+ */
+static struct sk_buff *frame_skb(const struct frame *fr, u32 linktype)
+{
+	struct sk_buff *skb;
+	struct ethhdr *eth;
+	struct iphdr *ip4h;
+	struct ipv6hdr *ip6h;
+	unsigned int len = fr->hdr.caplen;
+
+	if (fr->hdr.caplen < fr->hdr.len)
+		return NULL;  // truncated by the capture
+
+	if (!(skb = alloc_skb(RX_HEADROOM + ETH_HLEN + len, GFP_ATOMIC)))
+		return NULL;
+	skb_reserve(skb, RX_HEADROOM);
+	skb->dev = &replay_dev;
+
+	if (linktype == LINKTYPE_RAW) {
+		if (len < 1) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		eth = (struct ethhdr *)skb_put(skb, ETH_HLEN);
+		memset(eth, 0, 12);
+		eth->h_proto = htons((fr->data[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP);
+	} else if (len < ETH_HLEN) {
+		kfree_skb(skb);
+		return NULL;
+	}
+	memcpy(skb_put(skb, len), fr->data, len);
+
+	skb->protocol = eth_type_trans(skb, skb->dev);
+	skb_reset_network_header(skb);
+	skb->ip_summed = CHECKSUM_NONE;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		ip4h = ip_hdr(skb);
+		if (skb->len < sizeof(struct iphdr) || ip4h->ihl < 5 || ip4h->version != 4 || \
+		    ntohs(ip4h->tot_len) > skb->len || ntohs(ip4h->tot_len) < ip4h->ihl * 4)
+			goto drop;
+		pskb_trim_rcsum(skb, ntohs(ip4h->tot_len));
+		skb_set_transport_header(skb, ip4h->ihl * 4);
+	} else if (skb->protocol == htons(ETH_P_IPV6)) {
+		ip6h = ipv6_hdr(skb);
+		if (skb->len < sizeof(struct ipv6hdr) || ip6h->version != 6 || \
+		    ntohs(ip6h->payload_len) + sizeof(struct ipv6hdr) > skb->len)
+			goto drop;
+		pskb_trim_rcsum(skb, ntohs(ip6h->payload_len) + sizeof(struct ipv6hdr));
+		skb_set_transport_header(skb, sizeof(struct ipv6hdr));
+	} else {
+		goto drop;
+	}
+	return skb;
+
+drop:
+	kfree_skb(skb);
+	return NULL;
+}
+
+static inline int proto_class(u8 protocol)
+{
+	switch (protocol) {
+		case IPPROTO_TCP:
+			return CLS_TCP;
+		case IPPROTO_UDP:
+			return CLS_UDP;
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			return CLS_ICMP;
+		default:
+			return CLS_OTHER;
+	}
+}
+
+// protocol of the IPv4 packet, inside the IPv6 one for 6to4, and whether it was encapsulated
+static void classify(const struct sk_buff *skb, int *xpt, int *cls)
+{
+	const struct ipv6hdr *ip6h;
+	const struct frag_hdr *fragh;
+	const struct iphdr *ip4h;
+	u8 nexthdr;
+
+	*xpt = XPT_MAPT;
+	if (skb->protocol == htons(ETH_P_IP)) {
+		*cls = proto_class(ip_hdr(skb)->protocol);
+		return;
+	}
+
+	ip6h = ipv6_hdr(skb);
+	nexthdr = ip6h->nexthdr;
+	if (nexthdr == IPPROTO_FRAGMENT && skb->len >= sizeof(struct ipv6hdr) + sizeof(struct frag_hdr)) {
+		fragh = (const struct frag_hdr *)(ip6h + 1);
+		nexthdr = fragh->nexthdr;
+	}
+	if (nexthdr == IPPROTO_IPIP && skb->len >= sizeof(struct ipv6hdr) + sizeof(struct iphdr)) {
+		ip4h = (const struct iphdr *)(ip6h + 1);
+		*xpt = XPT_MAPE;
+		*cls = proto_class(ip4h->protocol);
+		return;
+	}
+	*cls = proto_class(nexthdr);
+}
+
+static void replay(struct frame *frames, int count, u32 linktype, int write)
+{
+	struct sk_buff *skb, *xskb;
+	struct counter *c;
+	u64 t0, t1;
+	int i, ret, dir, xpt, cls, ign;
+	unsigned long base = jiffies;
+
+	for (i = 0; i < count; i++) {
+		if (!(skb = frame_skb(&frames[i], linktype))) {
+			skipped++;
+			continue;
+		}
+		jiffies = base + (frames[i].hdr.ts_sec - frames[0].hdr.ts_sec) * HZ + \
+			frames[i].hdr.ts_frac / ((nsec ? 1000000000 : 1000000) / HZ);
+
+		dir = (skb->protocol == htons(ETH_P_IP)) ? DIR_4TO6 : DIR_6TO4;
+		classify(skb, &xpt, &cls);
+
+		t0 = now_ns();
+		if (dir == DIR_4TO6)
+			ret = ivi_v4v6_xmit(skb);
+		else
+			ret = ivi_v6v4_xmit(skb);
+		t1 = now_ns();
+
+		if (ret != IVI_XMIT_STOLEN)
+			kfree_skb(skb);  // netfilter would NF_DROP or NF_ACCEPT it
+
+		if (!(xskb = out.first)) {
+			c = (ret == 0) ? &dropped[dir] : &accepted[dir];
+		} else {
+			// 4to6 only learns MAP-E or MAP-T from the rule that matched
+			if (dir == DIR_4TO6)
+				classify(xskb, &xpt, &ign);
+			c = &xlated[dir][xpt][cls];
+		}
+		c->packets++;
+		c->ns += t1 - t0;
+
+		while ((xskb = __skb_dequeue(&out)) != NULL) {
+			if (write)
+				pcap_write(wfile, &frames[i].hdr, xskb);
+			kfree_skb(xskb);
+		}
+	}
+	jiffies += HZ;  // the next pass comes a second after the last packet
+}
+
+static void report_line(const char *dir, const char *xpt, const char *cls, const struct counter *c)
+{
+	if (!c->packets)
+		return;
+	printf("%-5s %-7s %-6s %10llu %12.0f %8.1f\n", dir, xpt, cls, (unsigned long long)c->packets,
+	       c->ns ? c->packets * 1e9 / c->ns : 0.0, (double)c->ns / c->packets);
+}
+
+static void report(void)
+{
+	struct counter total = { 0, 0 };
+	int d, x, p;
+
+	printf("%-5s %-7s %-6s %10s %12s %8s\n", "dir", "xport", "proto", "packets", "pps", "ns/pkt");
+	for (d = 0; d < DIR_MAX; d++) {
+		for (x = 0; x < XPT_MAX; x++) {
+			for (p = 0; p < CLS_MAX; p++) {
+				report_line(dir_name[d], xpt_name[x], cls_name[p], &xlated[d][x][p]);
+				total.packets += xlated[d][x][p].packets;
+				total.ns += xlated[d][x][p].ns;
+			}
+		}
+		report_line(dir_name[d], "-", "accept", &accepted[d]);
+		report_line(dir_name[d], "-", "drop", &dropped[d]);
+		total.packets += accepted[d].packets + dropped[d].packets;
+		total.ns += accepted[d].ns + dropped[d].ns;
+	}
+	report_line("all", "-", "-", &total);
+	if (skipped)
+		printf("%llu frames were not IP or were truncated and skipped.\n", (unsigned long long)skipped);
+}
+
+static int parse_prefix4(char *arg, u32 *addr, int *plen)
+{
+	char *token = strtok(arg, "/");
+
+	if (!token || inet_pton(AF_INET, token, addr) != 1)
+		return -1;
+	*addr = ntohl(*addr);  // host byte order, as ivictl passes it
+	if (!(token = strtok(NULL, "/")))
+		return -1;
+	*plen = atoi(token);
+	return (*plen < 0 || *plen > 32) ? -1 : 0;
+}
+
+static int parse_prefix6(char *arg, struct in6_addr *addr, int *plen)
+{
+	char *token = strtok(arg, "/");
+
+	if (!token || inet_pton(AF_INET6, token, addr) != 1)
+		return -1;
+	if (!(token = strtok(NULL, "/")))
+		return -1;
+	*plen = atoi(token);
+	return (*plen < 0 || *plen > 128) ? -1 : 0;
+}
+
+static inline u32 plen_mask(int plen)
+{
+	return (plen == 0) ? 0 : 0xffffffff << (32 - plen);
+}
+
+// PREFIX4/PLEN4,PREFIX6/PLEN6[,RATIO[,PSIDOFFSET]] or default,PREFIX6/PLEN6 as for ivictl -r
+static int parse_rule(char *arg, struct rule_info *rule)
+{
+	char *p4 = strtok(arg, ","), *p6 = strtok(NULL, ","), *ratio = strtok(NULL, ","), *psidoff = strtok(NULL, ",");
+	int off = psidoff ? atoi(psidoff) : 6;
+
+	memset(rule, 0, sizeof(struct rule_info));
+	rule->ratio = ratio ? atoi(ratio) : 1;
+	rule->format = ADDR_FMT_MAPT;
+	rule->transport = hgw_transport;
+
+	if (!p4 || !p6 || parse_prefix6(p6, &rule->prefix6, &rule->plen6) < 0)
+		return -1;
+	if (strcmp(p4, "default") == 0)
+		rule->format = ADDR_FMT_NONE;
+	else if (parse_prefix4(p4, &rule->prefix4, &rule->plen4) < 0)
+		return -1;
+	if (fls(rule->ratio) != ffs(rule->ratio) || off < 0 || off + fls(rule->ratio) - 1 > 16)
+		return -1;
+	rule->adjacent = 1 << (16 - off - (fls(rule->ratio) - 1));
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -i INPUT [-w OUTPUT] [-l LOOPS] [-a ADDRESS/PLEN] [-P PREFIX6/PLEN6] [-N] [-A PUBLICADDR/PLEN]\n", name);
+	printf("\t[-R RATIO] [-z PSIDOFFSET] [-o PSID] [-X] [-E|-T] [-r RULE]...\n");
+	printf("\tINPUT is an ethernet or raw IP pcap: IPv4 frames are translated to IPv6 and IPv6 frames to IPv4\n");
+	printf("\tOUTPUT receives the translated frames, written on the first of the LOOPS passes only\n");
+	printf("\t-a -P -N -A -R -z -o -X -E -T set up the HGW as for ivictl -s -H\n");
+	printf("\tRULE is PREFIX4/PLEN4,PREFIX6/PLEN6[,RATIO[,PSIDOFFSET]] or default,PREFIX6/PLEN6 as for ivictl -r\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct rule_info rule;
+	struct frame *frames;
+	char *input = NULL, *output = NULL, *rules[64];
+	int loops = 1, nrules = 0, psidoff = 6, count = 0, opt, plen, i;
+	u32 linktype = LINKTYPE_ETHERNET;
+	struct in6_addr prefix6;
+
+	ivi_mode = IVI_MODE_HGW;
+	hgw_ratio = 1;
+	hgw_offset = 0;
+
+	while ((opt = getopt(argc, argv, "i:w:l:a:P:NA:R:z:o:XETr:h")) != -1) {
+		switch (opt) {
+			case 'i':
+				input = optarg;
+				break;
+			case 'w':
+				output = optarg;
+				break;
+			case 'l':
+				loops = atoi(optarg);
+				break;
+			case 'a':
+				if (parse_prefix4(optarg, &v4address, &plen) < 0)
+					goto bad;
+				v4mask = plen_mask(plen);
+				break;
+			case 'P':
+				if (parse_prefix6(optarg, &prefix6, &plen) < 0)
+					goto bad;
+				memcpy(v6prefix, &prefix6, 16);
+				v6prefixlen = plen;
+				break;
+			case 'N':
+				ivi_mode = IVI_MODE_HGW_NAT44;
+				break;
+			case 'A':
+				if (parse_prefix4(optarg, &v4publicaddr, &plen) < 0)
+					goto bad;
+				v4publicmask = plen_mask(plen);
+				ivi_mode = IVI_MODE_HGW_NAT44;
+				break;
+			case 'R':
+				hgw_ratio = atoi(optarg);
+				if (fls(hgw_ratio) != ffs(hgw_ratio))
+					goto bad;
+				break;
+			case 'z':
+				psidoff = atoi(optarg);
+				break;
+			case 'o':
+				hgw_offset = atoi(optarg);
+				break;
+			case 'X':
+				hgw_fmt = ADDR_FMT_MAPX_CPE;
+				break;
+			case 'E':
+				hgw_transport = MAP_E;
+				break;
+			case 'T':
+				hgw_transport = MAP_T;
+				break;
+			case 'r':
+				if (nrules == sizeof(rules) / sizeof(rules[0]))
+					goto bad;
+				rules[nrules++] = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!input || loops < 1 || psidoff < 0 || psidoff + fls(hgw_ratio) - 1 > 16 || hgw_offset >= hgw_ratio)
+		goto bad;
+	hgw_adjacent = 1 << (16 - psidoff - (fls(hgw_ratio) - 1));
+	hgw_suffix = hgw_offset;
+
+	if (!(frames = pcap_load(input, &count, &linktype)))
+		return 1;
+	if (output) {
+		if (!(wfile = fopen(output, "wb"))) {
+			printf("Error: cannot create %s.\n", output);
+			return 1;
+		}
+		pcap_write_hdr(wfile);
+	}
+
+	ivi_rule_init();
+	ivi_rule6_init();
+	ivi_map_init();
+	ivi_map_tcp_init();
+	ivi_xmit_init();
+	skb_queue_head_init(&out);
+
+	for (i = 0; i < nrules; i++) {
+		if (parse_rule(rules[i], &rule) < 0 || ivi_rule_insert(&rule) != 0 || ivi_rule6_insert(&rule) != 0) {
+			printf("Error: failed to insert rule %d.\n", i + 1);
+			return 1;
+		}
+	}
+	// no delayed work runs here to compile the rule tables
+	ivi_rule_rebuild();
+	ivi_rule6_rebuild();
+	if (ivi_map_port_setup(hgw_ratio, hgw_adjacent, hgw_offset) < 0 || \
+	    ivi_map_tcp_port_setup(hgw_ratio, hgw_adjacent, hgw_offset) < 0) {
+		printf("Error: failed to set up the port pools.\n");
+		return 1;
+	}
+
+	for (i = 0; i < loops; i++)
+		replay(frames, count, linktype, wfile && i == 0);
+	report();
+
+	if (wfile)
+		fclose(wfile);
+	ivi_xmit_exit();
+	ivi_map_tcp_exit();
+	ivi_map_exit();
+	ivi_rule6_exit();
+	ivi_rule_exit();
+	for (i = 0; i < count; i++)
+		free(frames[i].data);
+	free(frames);
+	return 0;
+
+bad:
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,648 @@
+/*
+ * kshim.h : just enough of the kernel API for the mapping core (ivi_map.c,
+ * ivi_map_tcp.c, ivi_port.c, ivi_rule.c and ivi_rule6.c) to build as a
+ * userspace program. It is force-included before every source; the headers
+ * under include/ are empty so that the kernel #includes resolve.
+ *
+ * The benchmark is single threaded: spinlocks are plain mutexes, RCU grace
+ * periods are immediate and timers and delayed work never fire on their own.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+typedef uint8_t u8, __u8, u_int8_t;
+typedef uint16_t u16, __u16, __be16, __sum16;
+typedef uint32_t u32, __u32, __be32, __wsum, u_int32_t;
+typedef uint64_t u64, __u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define __read_mostly
+#define __force
+#define __inline__ inline
+#define __init
+#define __exit
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __constant_htons(x) htons(x)
+#define __constant_ntohs(x) ntohs(x)
+#define __constant_htonl(x) htonl(x)
+
+#define KERN_ERR ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define KERN_WARNING ""
+static inline __attribute__((format(printf, 1, 2))) int printk(const char *fmt, ...) { return 0; }
+
+#define EXPORT_SYMBOL(x)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define THIS_MODULE NULL
+
+/* hlist, pre-3.9 style with explicit node cursor */
+struct hlist_head { struct hlist_node *first; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+#define INIT_HLIST_HEAD(ptr) ((ptr)->first = NULL)
+static inline void INIT_HLIST_NODE(struct hlist_node *h) { h->next = NULL; h->pprev = NULL; }
+static inline int hlist_empty(const struct hlist_head *h) { return !h->first; }
+static inline void hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next, **pprev = n->pprev;
+	*pprev = next;
+	if (next)
+		next->pprev = pprev;
+}
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+static inline void hlist_add_before(struct hlist_node *n, struct hlist_node *next)
+{
+	n->pprev = next->pprev;
+	n->next = next;
+	next->pprev = &n->next;
+	*(n->pprev) = n;
+}
+static inline void hlist_add_after(struct hlist_node *n, struct hlist_node *next)
+{
+	next->next = n->next;
+	n->next = next;
+	next->pprev = &n->next;
+	if (next->next)
+		next->next->pprev = &next->next;
+}
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_for_each_entry(tpos, pos, head, member) \
+	for (pos = (head)->first; pos && ({ tpos = hlist_entry(pos, typeof(*tpos), member); 1; }); pos = pos->next)
+#define hlist_for_each_entry_safe(tpos, pos, n, head, member) \
+	for (pos = (head)->first; pos && ({ n = pos->next; 1; }) && ({ tpos = hlist_entry(pos, typeof(*tpos), member); 1; }); pos = n)
+
+/* locking */
+typedef struct { pthread_mutex_t m; } spinlock_t;
+#define spin_lock_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock_bh(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock_bh(l) pthread_mutex_unlock(&(l)->m)
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+/* memory */
+#define GFP_ATOMIC 0
+#define GFP_KERNEL 0
+#define kmalloc(s, f) malloc(s)
+#define kzalloc(s, f) calloc(1, s)
+#define kfree(p) free(p)
+
+/* time */
+static inline void do_gettimeofday(struct timeval *tv) { gettimeofday(tv, NULL); }
+static inline unsigned long get_seconds(void) { return time(NULL); }
+static inline void get_random_bytes(void *buf, int n) { unsigned char *p = buf; while (n--) *p++ = rand(); }
+static inline u64 local_clock(void) { struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts); return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec; }
+
+/* bitops */
+static inline int fls(int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+#define hweight64(x) __builtin_popcountll(x)
+#define ffs(x) __builtin_ffs(x)
+
+static inline u32 get_unaligned_be32(const void *p) { u32 v; memcpy(&v, p, 4); return ntohl(v); }
+
+static inline bool before(__u32 seq1, __u32 seq2) { return (s32)(seq1 - seq2) < 0; }
+#define after(seq2, seq1) before(seq1, seq2)
+
+static inline __be32 inet_make_mask(int logmask)
+{
+	if (logmask)
+		return htonl(~((1U << (32 - logmask)) - 1));
+	return 0;
+}
+
+/* tcp */
+struct tcphdr {
+	__be16 source;
+	__be16 dest;
+	__be32 seq;
+	__be32 ack_seq;
+	__u16 res1:4, doff:4, fin:1, syn:1, rst:1, psh:1, ack:1, urg:1, ece:1, cwr:1;
+	__be16 window;
+	__sum16 check;
+	__be16 urg_ptr;
+};
+union tcp_word_hdr { struct tcphdr hdr; __be32 words[5]; };
+#define tcp_flag_word(tp) (((union tcp_word_hdr *)(tp))->words[3])
+#define TCP_FLAG_ACK htonl(0x00100000)
+#define TCP_FLAG_RST htonl(0x00040000)
+#define TCPOPT_NOP 1
+#define TCPOPT_EOL 0
+#define TCPOPT_WINDOW 3
+#define TCPOPT_SACK_PERM 4
+#define TCPOPT_SACK 5
+#define TCPOLEN_WINDOW 3
+#define TCPOLEN_SACK_PERM 2
+#define TCPOLEN_SACK_BASE 2
+#define TCPOLEN_SACK_PERBLOCK 8
+
+/* ipv6 addr helpers */
+static inline int ipv6_addr_cmp(const struct in6_addr *a1, const struct in6_addr *a2) { return memcmp(a1, a2, sizeof(struct in6_addr)); }
+static inline bool ipv6_prefix_equal(const struct in6_addr *a1, const struct in6_addr *a2, unsigned int prefixlen)
+{
+	const __be32 *p1 = a1->s6_addr32, *p2 = a2->s6_addr32;
+	unsigned int pdw = prefixlen >> 5, pbi = prefixlen & 0x1f;
+	if (pdw && memcmp(p1, p2, pdw << 2))
+		return false;
+	if (pbi && ((p1[pdw] ^ p2[pdw]) & htonl((0xffffffff) << (32 - pbi))))
+		return false;
+	return true;
+}
+static inline int ipv6_addr_diff(const struct in6_addr *a1, const struct in6_addr *a2)
+{
+	int i;
+	for (i = 0; i < 4; i++) {
+		__be32 xb = a1->s6_addr32[i] ^ a2->s6_addr32[i];
+		if (xb)
+			return i * 32 + 31 - (fls(ntohl(xb)) - 1);
+	}
+	return 128;
+}
+
+
+/* timers: never fire */
+#define HZ 100
+extern unsigned long jiffies;
+struct timer_list {
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+};
+static inline void setup_timer(struct timer_list *t, void (*fn)(unsigned long), unsigned long data) { t->function = fn; t->data = data; t->expires = 0; }
+static inline int mod_timer(struct timer_list *t, unsigned long expires) { t->expires = expires; return 0; }
+static inline int del_timer_sync(struct timer_list *t) { t->expires = 0; return 0; }
+
+
+/* jhash (not bit-exact, only needs to spread) */
+static inline u32 jhash_2words(u32 a, u32 b, u32 initval)
+{
+	u64 h = ((u64)a << 32 | b) ^ ((u64)initval * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL; h ^= h >> 33;
+	return (u32)h;
+}
+static inline u32 jhash_1word(u32 a, u32 initval) { return jhash_2words(a, 0, initval); }
+
+/* vmalloc */
+#define PAGE_SIZE 4096UL
+#define vmalloc(s) malloc(s)
+#define vzalloc(s) calloc(1, s)
+#define vfree(p) free(p)
+
+/* module params */
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+/* workqueue: delayed work never runs */
+struct work_struct { void (*func)(struct work_struct *); };
+struct delayed_work { struct work_struct work; unsigned long expires; int pending; };
+#define INIT_WORK(w, f) ((w)->func = (f))
+#define INIT_DELAYED_WORK(dw, f) do { (dw)->work.func = (f); (dw)->pending = 0; } while (0)
+static inline int schedule_delayed_work(struct delayed_work *dw, unsigned long delay) { dw->expires = jiffies + delay; dw->pending = 1; return 1; }
+static inline int cancel_delayed_work_sync(struct delayed_work *dw) { int p = dw->pending; dw->pending = 0; return p; }
+static inline int schedule_work(struct work_struct *w) { return 1; }
+
+
+/* rcu: single threaded, grace periods are immediate */
+struct rcu_head { struct rcu_head *next; void (*func)(struct rcu_head *); };
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define synchronize_rcu() do { } while (0)
+#define rcu_barrier() do { } while (0)
+#define kfree_rcu(ptr, field) free(ptr)
+#define call_rcu(head, fn) (fn)(head)
+#define rcu_dereference(p) (p)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define hlist_add_head_rcu hlist_add_head
+#define hlist_del_rcu hlist_del
+#define hlist_for_each_entry_rcu hlist_for_each_entry
+#define hlist_add_before_rcu hlist_add_before
+#define hlist_add_after_rcu hlist_add_after
+static inline void hlist_replace_rcu(struct hlist_node *old, struct hlist_node *n)
+{
+	n->next = old->next;
+	n->pprev = old->pprev;
+	*n->pprev = n;
+	if (n->next)
+		n->next->pprev = &n->next;
+}
+#define smp_wmb() do { } while (0)
+
+/* seqcount */
+typedef struct { unsigned sequence; } seqcount_t;
+#define seqcount_init(s) ((s)->sequence = 0)
+static inline unsigned read_seqcount_begin(const seqcount_t *s) { return s->sequence; }
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned start) { return s->sequence != start; }
+static inline void write_seqcount_begin(seqcount_t *s) { s->sequence++; }
+static inline void write_seqcount_end(seqcount_t *s) { s->sequence++; }
+
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+#define time_before(a, b) time_after(b, a)
+
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval) { return jhash_2words(a, jhash_2words(b, c, initval), initval); }
+
+/* bitmap */
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+static inline int test_bit(int nr, const unsigned long *a) { return (a[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1; }
+static inline void set_bit(int nr, unsigned long *a) { a[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG); }
+static inline void clear_bit(int nr, unsigned long *a) { a[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG)); }
+#define __set_bit set_bit
+#define __clear_bit clear_bit
+
+
+/* slab caches and mempools */
+struct kmem_cache { size_t size; };
+#define SLAB_HWCACHE_ALIGN 0
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags, void (*ctor)(void *))
+{ struct kmem_cache *c = malloc(sizeof(*c)); c->size = size; return c; }
+static inline void kmem_cache_destroy(struct kmem_cache *c) { free(c); }
+static inline void *kmem_cache_alloc(struct kmem_cache *c, int flags) { return malloc(c->size); }
+static inline void kmem_cache_free(struct kmem_cache *c, void *p) { free(p); }
+typedef struct { struct kmem_cache *cache; } mempool_t;
+static inline mempool_t *mempool_create_slab_pool(int min_nr, struct kmem_cache *c) { mempool_t *m = malloc(sizeof(*m)); m->cache = c; return m; }
+static inline void mempool_destroy(mempool_t *m) { free(m); }
+static inline void *mempool_alloc(mempool_t *m, int flags) { return malloc(m->cache->size); }
+static inline void mempool_free(void *p, mempool_t *m) { free(p); }
+
+/* atomics and cpus */
+typedef struct { int counter; } atomic_t;
+static inline int atomic_read(const atomic_t *v) { return v->counter; }
+static inline void atomic_set(atomic_t *v, int i) { v->counter = i; }
+static inline void atomic_inc(atomic_t *v) { v->counter++; }
+static inline void atomic_dec(atomic_t *v) { v->counter--; }
+static inline int atomic_inc_return(atomic_t *v) { return ++v->counter; }
+static inline int atomic_dec_return(atomic_t *v) { return --v->counter; }
+static inline int atomic_cmpxchg(atomic_t *v, int o, int n) { int r = v->counter; if (r == o) v->counter = n; return r; }
+static inline int test_and_set_bit(int nr, unsigned long *a) { int r = test_bit(nr, a); set_bit(nr, a); return r; }
+#define raw_smp_processor_id() 0
+#define smp_processor_id() 0
+#define num_possible_cpus() 1
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ____cacheline_aligned_in_smp
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+
+/*
+ * networking, for ivi_xmit.c: linear skbs only. Translated packets come out
+ * through netif_rx(), netif_receive_skb() or dst_output(), which the program
+ * linking ivi_xmit.c provides. Routes always fail so that direct output falls
+ * back to netif_rx().
+ */
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define ETH_ALEN 6
+#define ETH_HLEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86DD
+struct ethhdr { unsigned char h_dest[ETH_ALEN], h_source[ETH_ALEN]; __be16 h_proto; } __attribute__((packed));
+
+struct net_device { char name[16]; int ifindex; unsigned int mtu; unsigned int flags; };
+struct net { int unused; };
+extern struct net init_net;
+static inline struct net *dev_net(const struct net_device *dev) { return &init_net; }
+static inline void dev_put(struct net_device *dev) { }
+static inline void dev_hold(struct net_device *dev) { }
+
+#define CHECKSUM_NONE 0
+#define CHECKSUM_UNNECESSARY 1
+#define CHECKSUM_COMPLETE 2
+#define CHECKSUM_PARTIAL 3
+
+struct skb_shared_info { unsigned short gso_size, gso_segs; unsigned int gso_type; };
+struct sk_buff {
+	struct sk_buff *next;
+	struct net_device *dev;
+	__be16 protocol;
+	u8 ip_summed;
+	u8 pkt_type;
+	unsigned int len, data_len;
+	unsigned char *head, *data, *tail, *end;
+	u16 mac_header, network_header, transport_header;
+	__wsum csum;
+	u16 csum_start, csum_offset;
+	char cb[48];
+	struct skb_shared_info shinfo;
+};
+#define skb_shinfo(skb) (&(skb)->shinfo)
+#define SKB_GSO_TCPV4 (1 << 0)
+#define SKB_GSO_UDP (1 << 1)
+#define SKB_GSO_DODGY (1 << 2)
+#define SKB_GSO_TCP_ECN (1 << 3)
+#define SKB_GSO_TCPV6 (1 << 4)
+static inline bool skb_is_gso(const struct sk_buff *skb) { return skb->shinfo.gso_size != 0; }
+static inline struct sk_buff *skb_gso_segment(struct sk_buff *skb, int features) { return NULL; }
+
+static inline unsigned char *skb_mac_header(const struct sk_buff *skb) { return skb->head + skb->mac_header; }
+static inline unsigned char *skb_network_header(const struct sk_buff *skb) { return skb->head + skb->network_header; }
+static inline unsigned char *skb_transport_header(const struct sk_buff *skb) { return skb->head + skb->transport_header; }
+static inline void skb_reset_mac_header(struct sk_buff *skb) { skb->mac_header = skb->data - skb->head; }
+static inline void skb_reset_network_header(struct sk_buff *skb) { skb->network_header = skb->data - skb->head; }
+static inline void skb_reset_transport_header(struct sk_buff *skb) { skb->transport_header = skb->data - skb->head; }
+static inline void skb_set_network_header(struct sk_buff *skb, int off) { skb->network_header = skb->data - skb->head + off; }
+static inline void skb_set_transport_header(struct sk_buff *skb, int off) { skb->transport_header = skb->data - skb->head + off; }
+static inline int skb_network_offset(const struct sk_buff *skb) { return skb_network_header(skb) - skb->data; }
+static inline int skb_transport_offset(const struct sk_buff *skb) { return skb_transport_header(skb) - skb->data; }
+static inline unsigned int skb_headroom(const struct sk_buff *skb) { return skb->data - skb->head; }
+static inline unsigned int skb_headlen(const struct sk_buff *skb) { return skb->len - skb->data_len; }
+
+static inline struct sk_buff *alloc_skb(unsigned int size, int flags)
+{
+	struct sk_buff *skb = calloc(1, sizeof(*skb));
+
+	if (!skb)
+		return NULL;
+	if (!(skb->head = malloc(size))) {
+		free(skb);
+		return NULL;
+	}
+	skb->data = skb->tail = skb->head;
+	skb->end = skb->head + size;
+	return skb;
+}
+#define dev_alloc_skb(size) alloc_skb(size, GFP_ATOMIC)
+static inline void kfree_skb(struct sk_buff *skb) { if (skb) { free(skb->head); free(skb); } }
+#define consume_skb kfree_skb
+static inline void skb_reserve(struct sk_buff *skb, int len) { skb->data += len; skb->tail += len; }
+static inline unsigned char *skb_put(struct sk_buff *skb, unsigned int len) { unsigned char *t = skb->tail; skb->tail += len; skb->len += len; return t; }
+static inline unsigned char *skb_push(struct sk_buff *skb, unsigned int len) { skb->data -= len; skb->len += len; return skb->data; }
+static inline unsigned char *skb_pull(struct sk_buff *skb, unsigned int len) { skb->len -= len; return skb->data += len; }
+#define __skb_pull skb_pull
+#define __skb_push skb_push
+static inline int pskb_may_pull(struct sk_buff *skb, unsigned int len) { return len <= skb->len; }
+static inline int pskb_trim_rcsum(struct sk_buff *skb, unsigned int len) { if (skb->len > len) { skb->len = len; skb->tail = skb->data + len; } return 0; }
+static inline int skb_cow_head(struct sk_buff *skb, unsigned int headroom) { return skb_headroom(skb) < headroom ? -ENOMEM : 0; }
+static inline int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len) { memcpy(to, skb->data + offset, len); return 0; }
+static inline struct sk_buff *skb_share_check(struct sk_buff *skb, int flags) { return skb; }
+static inline void skb_dst_drop(struct sk_buff *skb) { }
+static inline void nf_reset(struct sk_buff *skb) { }
+static inline __be16 eth_type_trans(struct sk_buff *skb, struct net_device *dev)
+{
+	skb_reset_mac_header(skb);
+	skb_pull(skb, ETH_HLEN);
+	return ((struct ethhdr *)skb_mac_header(skb))->h_proto;
+}
+static inline struct ethhdr *eth_hdr(const struct sk_buff *skb) { return (struct ethhdr *)skb_mac_header(skb); }
+extern int netif_rx(struct sk_buff *skb);
+extern int netif_receive_skb(struct sk_buff *skb);
+
+/* headers */
+struct iphdr {
+	__u8 ihl:4, version:4;
+	__u8 tos;
+	__be16 tot_len;
+	__be16 id;
+	__be16 frag_off;
+	__u8 ttl;
+	__u8 protocol;
+	__sum16 check;
+	__be32 saddr;
+	__be32 daddr;
+};
+struct ipv6hdr {
+	__u8 priority:4, version:4;
+	__u8 flow_lbl[3];
+	__be16 payload_len;
+	__u8 nexthdr;
+	__u8 hop_limit;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+struct frag_hdr { __u8 nexthdr; __u8 reserved; __be16 frag_off; __be32 identification; };
+#define IP6_MF 0x0001
+#define IP6_OFFSET 0xfff8
+struct udphdr { __be16 source, dest, len; __sum16 check; };
+struct icmphdr {
+	__u8 type, code;
+	__sum16 checksum;
+	union { struct { __be16 id, sequence; } echo; __be32 gateway; } un;
+};
+struct icmp6hdr {
+	__u8 icmp6_type, icmp6_code;
+	__sum16 icmp6_cksum;
+	union { __be32 un_data32[1]; __be16 un_data16[2]; } icmp6_dataun;
+};
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb) { return (struct iphdr *)skb_network_header(skb); }
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb) { return (struct ipv6hdr *)skb_network_header(skb); }
+static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb) { return (struct tcphdr *)skb_transport_header(skb); }
+static inline struct udphdr *udp_hdr(const struct sk_buff *skb) { return (struct udphdr *)skb_transport_header(skb); }
+static inline struct icmphdr *icmp_hdr(const struct sk_buff *skb) { return (struct icmphdr *)skb_transport_header(skb); }
+static inline struct icmp6hdr *icmp6_hdr(const struct sk_buff *skb) { return (struct icmp6hdr *)skb_transport_header(skb); }
+static inline bool ipv6_addr_equal(const struct in6_addr *a1, const struct in6_addr *a2) { return !ipv6_addr_cmp(a1, a2); }
+
+#define IP_MF 0x2000
+#define IP_DF 0x4000
+#define IP_OFFSET 0x1FFF
+static inline bool ip_is_fragment(const struct iphdr *iph) { return (iph->frag_off & htons(IP_MF | IP_OFFSET)) != 0; }
+static inline bool ipv4_is_multicast(__be32 addr) { return (addr & htonl(0xf0000000)) == htonl(0xe0000000); }
+static inline bool ipv4_is_lbcast(__be32 addr) { return addr == htonl(0xffffffff); }
+static inline bool ipv4_is_loopback(__be32 addr) { return (addr & htonl(0xff000000)) == htonl(0x7f000000); }
+
+#define ICMP_ECHOREPLY 0
+#define ICMP_DEST_UNREACH 3
+#define ICMP_ECHO 8
+#define ICMP_TIME_EXCEEDED 11
+#define ICMP_HOST_UNREACH 1
+#define ICMP_PORT_UNREACH 3
+#define ICMP_FRAG_NEEDED 4
+#define ICMPV6_DEST_UNREACH 1
+#define ICMPV6_PKT_TOOBIG 2
+#define ICMPV6_TIME_EXCEED 3
+#define ICMPV6_ECHO_REQUEST 128
+#define ICMPV6_ECHO_REPLY 129
+#define ICMPV6_NOROUTE 0
+#define ICMPV6_PORT_UNREACH 4
+
+/* checksums, computed for real so that the output can be checked */
+static inline __wsum csum_partial(const void *buff, int len, __wsum sum)
+{
+	const u8 *p = buff;
+	u64 s = sum;
+
+	for (; len > 1; len -= 2, p += 2)
+		s += (u16)(p[0] | p[1] << 8);
+	if (len)
+		s += p[0];
+	while (s >> 32)
+		s = (s & 0xffffffff) + (s >> 32);
+	return (__wsum)s;
+}
+static inline __sum16 csum_fold(__wsum csum)
+{
+	u32 s = csum;
+
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	return (__sum16)~s;
+}
+static inline __wsum csum_unfold(__sum16 n) { return (__wsum)n; }
+#define CSUM_MANGLED_0 ((__sum16)0xffff)
+static inline __wsum csum_add(__wsum a, __wsum b) { u64 s = (u64)a + b; return (__wsum)((s & 0xffffffff) + (s >> 32)); }
+static inline __wsum csum_sub(__wsum a, __wsum b) { return csum_add(a, ~b); }
+static inline __sum16 ip_fast_csum(const void *iph, unsigned int ihl) { return csum_fold(csum_partial(iph, ihl * 4, 0)); }
+static inline __sum16 ip_compute_csum(const void *buff, int len) { return csum_fold(csum_partial(buff, len, 0)); }
+static inline __wsum csum_tcpudp_nofold(__be32 saddr, __be32 daddr, unsigned short len, unsigned short proto, __wsum sum)
+{
+	u64 s = sum;
+
+	s += saddr;
+	s += daddr;
+	s += htons(len);
+	s += htons(proto);
+	while (s >> 32)
+		s = (s & 0xffffffff) + (s >> 32);
+	return (__wsum)s;
+}
+static inline __sum16 csum_tcpudp_magic(__be32 saddr, __be32 daddr, unsigned short len, unsigned short proto, __wsum sum)
+{
+	return csum_fold(csum_tcpudp_nofold(saddr, daddr, len, proto, sum));
+}
+static inline __sum16 csum_ipv6_magic(const struct in6_addr *saddr, const struct in6_addr *daddr, __u32 len, unsigned short proto, __wsum sum)
+{
+	sum = csum_partial(saddr, 16, sum);
+	sum = csum_partial(daddr, 16, sum);
+	sum = csum_add(sum, htonl(len));
+	sum = csum_add(sum, htonl(proto));
+	return csum_fold(sum);
+}
+static inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+	__wsum s = csum_sub(~csum_unfold(*sum), from);
+
+	*sum = csum_fold(csum_add(s, to));
+}
+static inline void csum_replace2(__sum16 *sum, __be16 from, __be16 to) { csum_replace4(sum, from, to); }
+static inline __wsum skb_checksum(const struct sk_buff *skb, int offset, int len, __wsum csum) { return csum_partial(skb->data + offset, len, csum); }
+
+/* netfilter and rx_handler, declared only */
+#define NF_DROP 0
+#define NF_ACCEPT 1
+#define NF_STOLEN 2
+struct list_head { struct list_head *next, *prev; };
+#define PACKET_OTHERHOST 3
+static inline void rtnl_lock(void) { }
+static inline void rtnl_unlock(void) { }
+
+/* routing */
+#define IFF_LOOPBACK 0x8
+struct dst_entry { struct net_device *dev; int error; unsigned int mtu; };
+struct rtable { struct dst_entry dst; };
+struct flowi4 { int flowi4_oif; u32 flowi4_mark; u8 flowi4_tos, flowi4_scope, flowi4_proto, flowi4_flags; __be32 saddr, daddr; };
+struct flowi6 { int flowi6_oif; u32 flowi6_mark; u8 flowi6_proto; struct in6_addr daddr, saddr; __be32 flowlabel; };
+#define RT_TOS(tos) ((tos) & 0x1E)
+#define IS_ERR(p) ((unsigned long)(p) > (unsigned long)-4096)
+#define ERR_PTR(e) ((void *)(long)(e))
+#define PTR_ERR(p) ((long)(p))
+#define IS_ERR_OR_NULL(p) (!(p) || IS_ERR(p))
+static struct dst_entry kshim_no_route = { NULL, -ENETUNREACH, 0 };
+static inline struct dst_entry *ip6_route_output(struct net *net, void *sk, struct flowi6 *fl6) { return &kshim_no_route; }
+static inline struct rtable *ip_route_output_key(struct net *net, struct flowi4 *fl4) { return ERR_PTR(-ENETUNREACH); }
+static inline struct dst_entry *dst_clone(struct dst_entry *dst) { return dst; }
+static inline void dst_release(struct dst_entry *dst) { }
+static inline unsigned int dst_mtu(const struct dst_entry *dst) { return dst->mtu; }
+static inline void skb_dst_set(struct sk_buff *skb, struct dst_entry *dst) { }
+extern int dst_output(struct sk_buff *skb);
+static inline int ip_decrease_ttl(struct iphdr *iph)
+{
+	u32 check = (u32)iph->check;
+
+	check += (u32)htons(0x0100);
+	iph->check = (__sum16)(check + (check >= 0xFFFF));
+	return --iph->ttl;
+}
+
+/* skb queues, tasklets run by hand and per-cpu data for the single cpu */
+struct sk_buff_head { struct sk_buff *first, *last; unsigned int qlen; spinlock_t lock; };
+static inline void __skb_queue_head_init(struct sk_buff_head *q) { q->first = q->last = NULL; q->qlen = 0; }
+static inline void skb_queue_head_init(struct sk_buff_head *q) { spin_lock_init(&q->lock); __skb_queue_head_init(q); }
+static inline unsigned int skb_queue_len(const struct sk_buff_head *q) { return q->qlen; }
+static inline void __skb_queue_tail(struct sk_buff_head *q, struct sk_buff *skb)
+{
+	skb->next = NULL;
+	if (q->last)
+		q->last->next = skb;
+	else
+		q->first = skb;
+	q->last = skb;
+	q->qlen++;
+}
+#define skb_queue_tail __skb_queue_tail
+static inline struct sk_buff *__skb_dequeue(struct sk_buff_head *q)
+{
+	struct sk_buff *skb = q->first;
+
+	if (skb) {
+		if (!(q->first = skb->next))
+			q->last = NULL;
+		q->qlen--;
+		skb->next = NULL;
+	}
+	return skb;
+}
+#define skb_dequeue __skb_dequeue
+static inline void skb_queue_splice_init(struct sk_buff_head *list, struct sk_buff_head *head)
+{
+	if (list->first) {
+		if (head->last)
+			head->last->next = list->first;
+		else
+			head->first = list->first;
+		head->last = list->last;
+		head->qlen += list->qlen;
+	}
+	__skb_queue_head_init(list);
+}
+static inline void skb_queue_purge(struct sk_buff_head *q) { struct sk_buff *skb; while ((skb = __skb_dequeue(q))) kfree_skb(skb); }
+#define spin_lock_irq(l) do { } while (0)
+#define spin_unlock_irq(l) do { } while (0)
+struct tasklet_struct { void (*func)(unsigned long); unsigned long data; int scheduled; };
+static inline void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long), unsigned long data) { t->func = func; t->data = data; t->scheduled = 0; }
+static inline void tasklet_schedule(struct tasklet_struct *t) { t->scheduled = 1; }
+static inline void tasklet_kill(struct tasklet_struct *t) { t->scheduled = 0; }
+#define DEFINE_PER_CPU(type, name) type name[1]
+#define DECLARE_PER_CPU(type, name) extern type name[1]
+// ivi_stats.c and ivi_trace.c are not built here, the statistics counters and latency histograms are not kept
+#define this_cpu_inc(pcp) do { } while (0)
+#define per_cpu(name, cpu) (name[cpu])
+#define this_cpu_ptr(p) (&(*(p))[0])
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/* tracepoints, compiled out */
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) static inline void trace_##name(proto) { }
+
+#endif /* KSHIM_H */
@@ -38,6 +38,7 @@
 
 #include <linux/types.h>
 #ifdef __KERNEL__
+#include <linux/jhash.h>
 #include <net/ipv6.h>
 #endif
 
@@ -131,23 +132,63 @@ enum {
 	IVI_MODE_HGW_NAT44,	    // Home gateway with NAT44
 };
 
-#define IVI_HTABLE_SIZE		32
-#define GOLDEN_RATIO_16		0x9e37
-#define GOLDEN_RATIO_32		0x9e370001
+// Session hash tables are sized at load time (module parameter 'htable_size' or
+// IVI_IOC_HTABLE_SIZE) and then grow or shrink on line to keep chains short.
+#define IVI_HTABLE_BITS_MIN	5
+#define IVI_HTABLE_BITS_MAX	20
+#define IVI_HTABLE_SIZE_DEFAULT	1024
+
+// Resize when the average chain length leaves [1/IVI_HTABLE_SHRINK, IVI_HTABLE_GROW]
+#define IVI_HTABLE_GROW		2
+#define IVI_HTABLE_SHRINK	8
+
+// Max number of dest_chain buckets probed when looking for a port to multiplex
+#define IVI_MULTIPLEX_PROBES	31
+
+// Max number of ports of the local PSID tried for a new flow when nf_nat maps the ports
+#define IVI_NAT_PROBES		256
+
+// Timed-out mappings are collected by a delayed work instead of the packet path:
+// every IVI_GC_INTERVAL jiffies one of IVI_GC_SLICES slices of out_chain is swept,
+// so the whole table is scanned once per (IVI_GC_INTERVAL * IVI_GC_SLICES) jiffies.
+#define IVI_GC_INTERVAL		(HZ / 10)
+#define IVI_GC_SLICES		10
+
+// Later fragments of an IPv6 datagram are translated as its first one for IVI_FRAG_TIMEOUT
+// jiffies, and at most IVI_FRAG_PER_BUCKET datagrams per bucket of the table are followed.
+#define IVI_FRAG_TIMEOUT	(HZ * 5)
+#define IVI_FRAG_PER_BUCKET	4
+
+// Rule lookups use multibit tables compiled from the rule tries. A rule change drops the
+// table, lookups fall back to the trie and the table is rebuilt IVI_RULE_BUILD_DELAY
+// jiffies later, so that a bulk load of rules costs one rebuild.
+#define IVI_RULE_BUILD_DELAY	(HZ / 10)
+
+/*
+ * IPv6 side of the translation of a session, computed by the first packet that goes through
+ * ivi_v4v6_xmit() and reused by the next ones instead of looking up the rules again. It is
+ * only valid while gen matches ivi_xlate_gen, which any configuration change bumps, and for
+ * the IPv4 destination port it was computed from.
+ */
+struct ivi_xlate_tmpl {
+	struct in6_addr saddr;	// Source of the translated or encapsulating IPv6 header
+	struct in6_addr daddr;	// Destination of the translated or encapsulating IPv6 header
+	__wsum csum6;		// Sum of saddr and daddr, the part of the pseudo-header that changes
+	u32 gen;		// ivi_xlate_gen at the time of the computation, 0 if never computed
+	__be16 dstport;		// IPv4 destination port daddr was computed from
+	u8 transport;		// MAP_T or MAP_E
+};
 
-// Generic hash function for a 16 bit value, see 'Introduction to Algorithms, 2nd Edition' Section 11.3.2
-static inline int port_hashfn(__be16 port)
+// Seeded hash function for a (32 bit address, 16 bit port) pair, result is in [0, 2^bits)
+static inline u32 v4addr_port_hashfn(__be32 addr, __be16 port, u32 seed, unsigned int bits)
 {
-	unsigned int m = port * GOLDEN_RATIO_16;
-	return ((m & 0xf800) >> 11);  // extract highest 6 bits as hash result
+	return jhash_2words(addr, port, seed) & ((1U << bits) - 1);
 }
 
-// Generic hash function for a 32 bit value, see 'Introduction to Algorithms, 2nd Edition' Section 11.3.2
-static inline int v4addr_port_hashfn(__be32 addr, __be16 port)
+// Seeded hash function for a (32 bit address, 16 bit port, 16 bit port) tuple, result is in [0, 2^bits)
+static inline u32 v4addr_ports_hashfn(__be32 addr, __be16 port1, __be16 port2, u32 seed, unsigned int bits)
 {
-	__be32 m = addr + port;
-	m *= GOLDEN_RATIO_32;
-	return ((m & 0xf8000000) >> 27);
+	return jhash_3words(addr, port1, port2, seed) & ((1U << bits) - 1);
 }
 
 #endif /* __KERNEL__ */
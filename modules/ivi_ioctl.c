@@ -52,6 +52,7 @@ static long ivi_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 	struct net_device *dev;
 	char temp[IVI_IOCTL_LEN];
 	struct rule_info rule;
+	unsigned int size;
 	
 	switch (cmd) {
 		case IVI_IOC_V4DEV:
@@ -81,6 +82,13 @@ static long ivi_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 			break;
 		
 		case IVI_IOC_START:
+			// The MAP port pools follow the ratio, offset and adjacent set before starting.
+			if ((retval = ivi_map_port_setup(hgw_ratio, hgw_adjacent, hgw_offset)) < 0) {
+				return retval;
+			}
+			if ((retval = ivi_map_tcp_port_setup(hgw_ratio, hgw_adjacent, hgw_offset)) < 0) {
+				return retval;
+			}
 			retval = nf_running(1);
 			break;
 		
@@ -199,10 +207,29 @@ static long ivi_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
 			}
 			printk(KERN_INFO "ivi_ioctl: transport set to %d.\n", hgw_transport);
 			break;
+
+		case IVI_IOC_HTABLE_SIZE:
+			if (copy_from_user(&size, (unsigned int *)arg, sizeof(unsigned int)) > 0) {
+				return -EACCES;
+			}
+			if ((retval = ivi_map_set_htable_size(size)) < 0) {
+				return retval;
+			}
+			if ((retval = ivi_map_tcp_set_htable_size(size)) < 0) {
+				return retval;
+			}
+			printk(KERN_INFO "ivi_ioctl: session hash table size set to %u.\n", htable_size);
+			break;
 				
 		default:
 			retval = -ENOTTY;
 	}
+
+	// Cached flows and session templates hold translated addresses, compute them again
+	if (retval == 0) {
+		ivi_xlate_invalidate();
+		ivi_map_tcp_flow_flush();
+	}
 	return retval;
 }
 
@@ -70,6 +70,8 @@
 
 #define IVI_IOC_TRANSPT	_IOW(IVI_IOCTL, 0x23, int)
 
+#define IVI_IOC_HTABLE_SIZE	_IOW(IVI_IOCTL, 0x24, int)
+
 #define IVI_IOCTL_LEN	32
 
 #ifdef __KERNEL__
@@ -51,49 +51,229 @@ u16 hgw_suffix = 0;
 
 u16 hgw_adjacent = 1024; // draft-ietf-softwire-map-05 specifies the default PSID offset is 6.
 
-/* list operations */
+/* initial number of buckets in each session hash table */
+unsigned int htable_size = IVI_HTABLE_SIZE_DEFAULT;
+module_param(htable_size, uint, 0444);
+MODULE_PARM_DESC(htable_size, "Initial number of buckets in each session hash table");
+
+/* number of sessions of each protocol kept in reserve for allocation bursts */
+unsigned int session_reserve = 0;
+module_param(session_reserve, uint, 0444);
+MODULE_PARM_DESC(session_reserve, "Number of sessions of each protocol pre-allocated for allocation bursts, 0 to disable");
+
+/* generation of the translation templates, see struct ivi_xlate_tmpl; 0 is never valid */
+u32 ivi_xlate_gen = 1;
+
+static struct kmem_cache *map_tuple_cache;
+static mempool_t *map_tuple_pool;  // NULL if session_reserve is 0
+
+/* session cache operations */
+
+// Create a slab cache for sessions of 'size' bytes, with a mempool of session_reserve objects if it is set
+int ivi_session_cache_create(const char *name, size_t size, struct kmem_cache **cache, mempool_t **pool)
+{
+	*cache = kmem_cache_create(name, size, 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (*cache == NULL) {
+		printk(KERN_ERR "ivi_session_cache_create: failed to create %s cache.\n", name);
+		return -ENOMEM;
+	}
+
+	*pool = NULL;
+	if (session_reserve > 0) {
+		*pool = mempool_create_slab_pool(session_reserve, *cache);
+		if (*pool == NULL) {
+			kmem_cache_destroy(*cache);
+			*cache = NULL;
+			printk(KERN_ERR "ivi_session_cache_create: failed to reserve %u sessions for %s.\n", session_reserve, name);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+// Destroy a session cache, all the sessions must have been freed and their RCU callbacks run
+void ivi_session_cache_destroy(struct kmem_cache *cache, mempool_t *pool)
+{
+	if (pool)
+		mempool_destroy(pool);
+	if (cache)
+		kmem_cache_destroy(cache);
+}
+
+static void map_tuple_free_rcu(struct rcu_head *head)
+{
+	struct map_tuple *map = container_of(head, struct map_tuple, rcu);
+
+	if (map_tuple_pool)
+		mempool_free(map, map_tuple_pool);
+	else
+		kmem_cache_free(map_tuple_cache, map);
+}
+
+/* hash table operations */
+
+// Allocate a table with (1 << bits) empty buckets, must be called in process context
+struct hlist_head *ivi_htable_alloc(unsigned int bits)
+{
+	struct hlist_head *table;
+	size_t size = sizeof(struct hlist_head) << bits;
+	unsigned int i;
+
+	if (size <= PAGE_SIZE)
+		table = (struct hlist_head *)kmalloc(size, GFP_KERNEL);
+	else
+		table = (struct hlist_head *)vmalloc(size);
+	if (table == NULL)
+		return NULL;
+
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&table[i]);
+	return table;
+}
+
+void ivi_htable_free(struct hlist_head *table, unsigned int bits)
+{
+	if (table == NULL)
+		return;
+
+	if ((sizeof(struct hlist_head) << bits) <= PAGE_SIZE)
+		kfree(table);
+	else
+		vfree(table);
+}
+
+// Get the table bits holding 'size' buckets, rounded up to a power of 2
+unsigned int ivi_htable_bits(unsigned int size)
+{
+	unsigned int bits = (size > 1) ? fls(size - 1) : 0;
+
+	if (bits < IVI_HTABLE_BITS_MIN)
+		bits = IVI_HTABLE_BITS_MIN;
+	if (bits > IVI_HTABLE_BITS_MAX)
+		bits = IVI_HTABLE_BITS_MAX;
+	return bits;
+}
+
+// Get the table bits wanted for 'entries' mappings, 'bits' is returned if no resize is needed
+unsigned int ivi_htable_want_bits(int entries, unsigned int bits, unsigned int min_bits)
+{
+	unsigned int want;
+
+	if (entries > (IVI_HTABLE_GROW << bits) && bits < IVI_HTABLE_BITS_MAX)
+		return ivi_htable_bits(entries);
+
+	if (bits > min_bits && entries < (1 << bits) / IVI_HTABLE_SHRINK) {
+		want = ivi_htable_bits(entries);
+		return (want > min_bits) ? want : min_bits;
+	}
+
+	return bits;
+}
+
+static inline u32 out_hash(struct map_list *list, __be32 addr, __be16 port)
+{
+	return v4addr_port_hashfn(addr, port, list->hash_seed, list->htable_bits);
+}
 
-// Get current size of the list, must be protected by spin lock when calling this function
-static inline int get_list_port_num(struct map_list *list)
+static inline u32 in_hash(struct map_list *list, __be16 port, __be32 dstaddr)
 {
-	return list->port_num;
+	return v4addr_port_hashfn(dstaddr, port, list->hash_seed, list->htable_bits);
 }
 
+static inline u32 dest_hash(struct map_list *list, __be32 addr)
+{
+	return v4addr_port_hashfn(addr, 0, list->hash_seed, list->htable_bits);
+}
+
+/* list operations */
+
+static void map_list_gc(struct work_struct *work);
+
 // Init list
-static void init_map_list(struct map_list *list, time_t timeout)
+static int init_map_list(struct map_list *list, time_t timeout)
 {
-	int i;
 	spin_lock_init(&list->lock);
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
-		INIT_HLIST_HEAD(&list->out_chain[i]);
-		INIT_HLIST_HEAD(&list->in_chain[i]);
-		INIT_HLIST_HEAD(&list->dest_chain[i]);
+	seqcount_init(&list->htable_seq);
+	list->htable_bits = list->htable_min_bits = ivi_htable_bits(htable_size);
+	list->out_chain = ivi_htable_alloc(list->htable_bits);
+	list->in_chain = ivi_htable_alloc(list->htable_bits);
+	list->dest_chain = ivi_htable_alloc(list->htable_bits);
+	list->ports = (struct ivi_port_pool *)kzalloc(sizeof(struct ivi_port_pool), GFP_KERNEL); // empty until port setup
+	if (!list->out_chain || !list->in_chain || !list->dest_chain || !list->ports) {
+		ivi_htable_free(list->out_chain, list->htable_bits);
+		ivi_htable_free(list->in_chain, list->htable_bits);
+		ivi_htable_free(list->dest_chain, list->htable_bits);
+		kfree(list->ports);
+		printk(KERN_ERR "init_map_list: failed to allocate hash tables.\n");
+		return -ENOMEM;
 	}
+	get_random_bytes(&list->hash_seed, sizeof(u32));
 	list->size = 0;
-	list->port_num = 0;
-	list->last_alloc_port = 0;
 	list->timeout = timeout;
+	list->gc_bucket = 0;
+	INIT_DELAYED_WORK(&list->gc_work, map_list_gc);
+	schedule_delayed_work(&list->gc_work, IVI_GC_INTERVAL);
+	return 0;
 }
 
-// Check whether a newport is in use now, must be protected by spin lock when calling this function
-static int port_in_use(__be16 port, struct map_list *list)
+// Rebuild all the chains with (1 << bits) buckets and a new hash seed, must NOT acquire spin lock when calling this function
+static int rehash_map_list(struct map_list *list, unsigned int bits)
 {
-	int ret = 0;
-	int hash;
+	struct hlist_head *out, *in, *dest;
+	struct hlist_head *old_out, *old_in, *old_dest;
 	struct map_tuple *iter;
+	struct hlist_node *loop;
 	struct hlist_node *temp;
+	unsigned int i, old_bits;
+	u32 seed;
 
-	hash = port_hashfn(port);
-	if (!hlist_empty(&list->in_chain[hash])) {
-		hlist_for_each_entry(iter, temp, &list->in_chain[hash], in_node) {
-			if (iter->newport == port) {
-				ret = 1;
-				break;
-			}
+	out = ivi_htable_alloc(bits);
+	in = ivi_htable_alloc(bits);
+	dest = ivi_htable_alloc(bits);
+	if (!out || !in || !dest) {
+		ivi_htable_free(out, bits);
+		ivi_htable_free(in, bits);
+		ivi_htable_free(dest, bits);
+		printk(KERN_ERR "rehash_map_list: failed to allocate hash tables with %u buckets.\n", 1U << bits);
+		return -ENOMEM;
+	}
+	get_random_bytes(&seed, sizeof(u32));
+
+	spin_lock_bh(&list->lock);
+	write_seqcount_begin(&list->htable_seq);
+	old_out = list->out_chain;
+	old_in = list->in_chain;
+	old_dest = list->dest_chain;
+	old_bits = list->htable_bits;
+
+	list->out_chain = out;
+	list->in_chain = in;
+	list->dest_chain = dest;
+	list->htable_bits = bits;
+	list->hash_seed = seed;
+	list->gc_bucket = 0;
+
+	// Every map_tuple is linked on out_chain, so walking it once moves all three nodes.
+	// A lockless lookup racing with this may miss and then retries under the lock.
+	for (i = 0; i < (1U << old_bits); i++) {
+		hlist_for_each_entry_safe(iter, loop, temp, &old_out[i], out_node) {
+			hlist_add_head_rcu(&iter->out_node, &out[out_hash(list, iter->oldaddr, iter->oldport)]);
+			hlist_add_head_rcu(&iter->in_node, &in[in_hash(list, iter->newport, iter->dstaddr)]);
+			hlist_add_head_rcu(&iter->dest_node, &dest[dest_hash(list, iter->dstaddr)]);
 		}
 	}
+	write_seqcount_end(&list->htable_seq);
+	spin_unlock_bh(&list->lock);
 
-	return ret;
+	synchronize_rcu();
+	ivi_htable_free(old_out, old_bits);
+	ivi_htable_free(old_in, old_bits);
+	ivi_htable_free(old_dest, old_bits);
+
+#ifdef IVI_DEBUG_MAP
+	printk(KERN_INFO "rehash_map_list: %d map_tuple rehashed from %u to %u buckets.\n", list->size, 1U << old_bits, 1U << bits);
+#endif
+	return 0;
 }
 
 // Add a new map, the pointer to the new map_tuple is returned on success, must be protected by spin lock when calling this function
@@ -101,9 +281,13 @@ static struct map_tuple* add_new_map(__be32 oldaddr, __be16 oldp, __be32 dstaddr
 {
 	struct map_tuple *map;
 	int hash;
-	map = (struct map_tuple*)kmalloc(sizeof(struct map_tuple), GFP_ATOMIC);
+	if (map_tuple_pool)
+		map = (struct map_tuple*)mempool_alloc(map_tuple_pool, GFP_ATOMIC);
+	else
+		map = (struct map_tuple*)kmem_cache_alloc(map_tuple_cache, GFP_ATOMIC);
 	if (map == NULL) {
-		printk(KERN_ERR "add_new_map: kmalloc failed for map_tuple.\n");
+		IVI_STATS_INC(IVI_STAT_ALLOC_FAIL);
+		printk(KERN_ERR "add_new_map: failed to allocate map_tuple.\n");
 		return NULL;
 	}
 
@@ -111,70 +295,86 @@ static struct map_tuple* add_new_map(__be32 oldaddr, __be16 oldp, __be32 dstaddr
 	map->oldport = oldp;
 	map->dstaddr = dstaddr;
 	map->newport = newp;
-	do_gettimeofday(&map->timer);
+	map->timer = jiffies;
+	map->tmpl.gen = 0;
+	seqcount_init(&map->tmpl_seq);
 	
-	hash = v4addr_port_hashfn(oldaddr, oldp);
-	hlist_add_head(&map->out_node, &list->out_chain[hash]);
-	hash = port_hashfn(newp);
-	hlist_add_head(&map->in_node, &list->in_chain[hash]);
-	hash = v4addr_port_hashfn(dstaddr, 0);
-	hlist_add_head(&map->dest_node, &list->dest_chain[hash]);
+	hash = out_hash(list, oldaddr, oldp);
+	hlist_add_head_rcu(&map->out_node, &list->out_chain[hash]);
+	hash = in_hash(list, newp, dstaddr);
+	hlist_add_head_rcu(&map->in_node, &list->in_chain[hash]);
+	hash = dest_hash(list, dstaddr);
+	hlist_add_head_rcu(&map->dest_node, &list->dest_chain[hash]);
 	
 	list->size++;
 	
 	return map;
 }
 
-// Refresh the timer for each map_tuple, must NOT acquire spin lock when calling this function
-void refresh_map_list(struct map_list *list)
+// Remove the timed-out map_tuple on out_chain[start, end), must be protected by spin lock when calling this function
+static void expire_map_chains(struct map_list *list, int start, int end)
 {
-	struct map_tuple *iter, *i0;
-	struct hlist_node *loop, *l0;
-	struct hlist_node *temp, *t0;
-	struct timeval now;
-	time_t delta;
-	int i, flag;	
-	do_gettimeofday(&now);
+	struct map_tuple *iter;
+	struct hlist_node *loop;
+	struct hlist_node *temp;
+	int i;	
 	
-	spin_lock_bh(&list->lock);
 	// Iterate all the map_tuple through out_chain only, in_chain contains the same info.
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
+	for (i = start; i < end; i++) {
 		hlist_for_each_entry_safe(iter, loop, temp, &list->out_chain[i], out_node) {
-			delta = now.tv_sec - iter->timer.tv_sec;
-			if (delta >= list->timeout) {
+			if (time_after_eq(jiffies, iter->timer + list->timeout * HZ)) {
 #ifdef IVI_DEBUG_MAP
-				printk(KERN_INFO "refresh_map_list: time out map " NIP4_FMT ":%d -> " NIP4_FMT " ------> %d on out_chain[%d]\n", NIP4(iter->oldaddr), iter->oldport, NIP4(iter->dstaddr), iter->newport, i);
+				printk(KERN_INFO "expire_map_chains: time out map " NIP4_FMT ":%d -> " NIP4_FMT " ------> %d on out_chain[%d]\n", NIP4(iter->oldaddr), iter->oldport, NIP4(iter->dstaddr), iter->newport, i);
 #endif
 
-				hlist_del(&iter->out_node);
-				hlist_del(&iter->in_node);
-				hlist_del(&iter->dest_node);
+				hlist_del_rcu(&iter->out_node);
+				hlist_del_rcu(&iter->in_node);
+				hlist_del_rcu(&iter->dest_node);
 				list->size--;
 
-				flag = 0; // indicating whether list->port_num needs to be substracted by 1.
- 				hlist_for_each_entry_safe(i0, l0, t0, &list->in_chain[port_hashfn(iter->newport)], in_node) {
- 					if (i0->newport == iter->newport) {
-#ifdef IVI_DEBUG_MAP
- 						printk(KERN_INFO "refresh_map_list: newport %d is still used by someone(" NIP4_FMT ":%d -> " NIP4_FMT "). port_num is still %d\n", iter->newport, NIP4(i0->oldaddr), i0->oldport, NIP4(i0->dstaddr), list->port_num);
-#endif
- 						flag = 1;
- 						break;
- 					}
- 				}
- 				if (!flag) {
- 					list->port_num--;
+				if (ivi_port_put(list->ports, iter->newport) == 0) {
 #ifdef IVI_DEBUG_MAP
- 					printk(KERN_INFO "refresh_map_list: port_num is decreased by 1 to %d(%d)\n", list->port_num, iter->newport);
+					printk(KERN_INFO "expire_map_chains: port_num is decreased to %d(%d)\n", ivi_port_in_use(list->ports), iter->newport);
 #endif
- 				}
+				}
 				
-				kfree(iter);
+				call_rcu(&iter->rcu, map_tuple_free_rcu);
 			}
 		}
 	}
+}
+
+// Refresh the timer for each map_tuple, must NOT acquire spin lock when calling this function
+void refresh_map_list(struct map_list *list)
+{
+	spin_lock_bh(&list->lock);
+	expire_map_chains(list, 0, 1 << list->htable_bits);
 	spin_unlock_bh(&list->lock);
 }
 
+// Delayed work, sweep one slice of out_chain, resize the tables if needed and re-arm itself
+static void map_list_gc(struct work_struct *work)
+{
+	struct map_list *list = container_of(work, struct map_list, gc_work.work);
+	unsigned int bits;
+	int size, end;
+
+	spin_lock_bh(&list->lock);
+	size = 1 << list->htable_bits;
+	end = list->gc_bucket + (size + IVI_GC_SLICES - 1) / IVI_GC_SLICES;
+	if (end > size)
+		end = size;
+	expire_map_chains(list, list->gc_bucket, end);
+	list->gc_bucket = (end == size) ? 0 : end;
+	bits = ivi_htable_want_bits(list->size, list->htable_bits, list->htable_min_bits);
+	spin_unlock_bh(&list->lock);
+
+	if (bits != list->htable_bits)
+		rehash_map_list(list, bits);
+
+	schedule_delayed_work(&list->gc_work, IVI_GC_INTERVAL);
+}
+
 // Clear the entire list, must NOT acquire spin lock when calling this function
 void free_map_list(struct map_list *list)
 {
@@ -185,28 +385,78 @@ void free_map_list(struct map_list *list)
 	
 	spin_lock_bh(&list->lock);
 	// Iterate all the map_tuple through out_chain only, in_chain contains the same info.
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
+	for (i = 0; i < (1 << list->htable_bits); i++) {
 		hlist_for_each_entry_safe(iter, loop, temp, &list->out_chain[i], out_node) {		
-			hlist_del(&iter->out_node);
-			hlist_del(&iter->in_node);
-			hlist_del(&iter->dest_node);
+			hlist_del_rcu(&iter->out_node);
+			hlist_del_rcu(&iter->in_node);
+			hlist_del_rcu(&iter->dest_node);
 			list->size--;
+			ivi_port_put(list->ports, iter->newport);
 			
 			printk(KERN_INFO "free_map_list: delete map " NIP4_FMT ":%d -> " NIP4_FMT " ------> %d on out_chain[%d]\n", NIP4(iter->oldaddr), iter->oldport, NIP4(iter->dstaddr), iter->newport, i);
 			
-			kfree(iter);
+			call_rcu(&iter->rcu, map_tuple_free_rcu);
 		}
 	}
-	list->port_num = 0;
 	spin_unlock_bh(&list->lock);
 }
 
 /* mapping operations */
 
-// Get mapped port for outflow packet, input and output are in host byte order, return -1 if failed
-int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, u16 ratio, u16 adjacent, u16 offset, __be16 *newp)
+// Find the map_tuple of an outflow session, must be called under rcu_read_lock or with spin lock held
+static struct map_tuple* map_out_lookup(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr)
 {
-	int hash, reusing, status, start_port;
+	struct map_tuple *iter;
+	struct hlist_node *loop;
+	struct hlist_head *chain;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&list->htable_seq);
+		chain = &list->out_chain[out_hash(list, oldaddr, oldp)];
+	} while (read_seqcount_retry(&list->htable_seq, seq));
+
+	hlist_for_each_entry_rcu(iter, loop, chain, out_node) {
+		if (iter->oldport == oldp && iter->oldaddr == oldaddr && iter->dstaddr == dstaddr)
+			return iter;
+	}
+	return NULL;
+}
+
+// Copy the translation template of a session, must be called under rcu_read_lock or with spin lock held
+static inline void map_tmpl_read(struct map_tuple *map, struct ivi_xlate_tmpl *tmpl)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&map->tmpl_seq);
+		*tmpl = map->tmpl;
+	} while (read_seqcount_retry(&map->tmpl_seq, seq));
+}
+
+// Find the map_tuple of an inflow session, must be called under rcu_read_lock or with spin lock held
+static struct map_tuple* map_in_lookup(struct map_list *list, __be16 newp, __be32 dstaddr)
+{
+	struct map_tuple *iter;
+	struct hlist_node *loop;
+	struct hlist_head *chain;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&list->htable_seq);
+		chain = &list->in_chain[in_hash(list, newp, dstaddr)];
+	} while (read_seqcount_retry(&list->htable_seq, seq));
+
+	hlist_for_each_entry_rcu(iter, loop, chain, in_node) {
+		if (iter->newport == newp && iter->dstaddr == dstaddr)
+			return iter;
+	}
+	return NULL;
+}
+
+static int __get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, u16 ratio, u16 adjacent, u16 offset, __be16 *newp, struct ivi_xlate_tmpl *tmpl)
+{
+	int hash, reusing, status, allocated;
 	__be16 retport;
 	struct map_tuple *multiplex_state;
 	struct map_tuple *iter;
@@ -214,23 +464,38 @@ int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __b
 	struct hlist_node *temp;
 		
 	*newp = 0;
+	if (tmpl)
+		tmpl->gen = 0;
 	reusing = 0;
 	status = 0;
+	allocated = 0;
 	retport = 0;
 	ratio = fls(ratio) - 1;
-	adjacent = fls(adjacent) - 1;
-	start_port = ((1 << (ratio + adjacent)) > 1024) ? 1 << (ratio + adjacent) : 1024; // the ports below start_port are reserved for system ports.
 	
-	refresh_map_list(list);
+	// Established sessions are looked up without taking the list lock.
+	rcu_read_lock();
+	iter = map_out_lookup(list, oldaddr, oldp, dstaddr);
+	if (iter != NULL) {
+		iter->timer = jiffies;
+		*newp = iter->newport;
+		if (tmpl)
+			map_tmpl_read(iter, tmpl);
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+	
 	spin_lock_bh(&list->lock);
 	
-	hash = v4addr_port_hashfn(oldaddr, oldp);
+	hash = out_hash(list, oldaddr, oldp);
 	if (!hlist_empty(&list->out_chain[hash])) {
 		hlist_for_each_entry(iter, temp, &list->out_chain[hash], out_node) {
 			if (iter->oldport == oldp && iter->oldaddr == oldaddr) {
 				if (iter->dstaddr == dstaddr) {	
 					retport = iter->newport;
-					do_gettimeofday(&iter->timer);
+					iter->timer = jiffies;
+					if (tmpl)
+						*tmpl = iter->tmpl;
 #ifdef IVI_DEBUG_MAP
 					//printk(KERN_INFO "get_outflow_map_port: find map " NIP4_FMT ":%d -> " NIP4_FMT " ------> %d on out_chain[%d]\n", NIP4(iter->oldaddr), iter->oldport, NIP4(iter->dstaddr), iter->newport, hash);
 #endif
@@ -249,27 +514,26 @@ int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __b
 	}
 	
 	if (retport == 0 && reusing == 0) {		
-		__be16 rover_j, rover_k;	
-		int dsthash, i, rand_j, chance;
+		int dsthash, i, rand_j, chance, size;
 		struct hlist_node *loop0, *temp0;
 		
 		status = 0;
 		chance = UDP_MAX_LOOP_NUM;
 			
 		// Now we have to find a mapping whose src & dest are both different to multiplex:
-		dsthash = v4addr_port_hashfn(dstaddr, 0);
-		while (1) { // we want to generate an integer between [1, 31]
+		size = 1 << list->htable_bits;
+		dsthash = dest_hash(list, dstaddr);
+		while (1) { // we want to generate an integer between [1, size - 1]
 			get_random_bytes(&rand_j, sizeof(int));
-			rand_j = (rand_j >= 0) ? rand_j : -rand_j;
-			rand_j -= (rand_j >> 5) << 5;
+			rand_j &= size - 1;
 			if (rand_j) break;
 		}
 			
-		/* hash is a random number between [0,31] except dsthash, so MAYBE its newport can be multiplexed because 
+		/* hash is a random number between [0, size - 1] except dsthash, so MAYBE its newport can be multiplexed because 
 		   dest_chain[hash] is impossible to have the same destination with this packet.*/
-		hash = (dsthash + rand_j >= 32) ? (dsthash + rand_j - 32) : (dsthash + rand_j); 
+		hash = (dsthash + rand_j) & (size - 1);
 		
-		for (i = 0; i < 31 && chance > 0; i++) {		
+		for (i = 0; i < IVI_MULTIPLEX_PROBES && chance > 0; i++) {		
 			if (!hlist_empty(&list->dest_chain[hash])) {
 				hlist_for_each_entry_safe(multiplex_state, loop0, temp0, &list->dest_chain[hash], dest_node) {
 					retport = multiplex_state->newport;
@@ -289,7 +553,7 @@ int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __b
 #ifdef IVI_DEBUG_MAP		
 						printk(KERN_INFO "get_outflow_map_port: multiplex port %d on dest_chain[%d], round %d\n", retport, hash, i + 1);
 #endif
-						i = 31; // go directly to create a new mapping
+						i = IVI_MULTIPLEX_PROBES; // go directly to create a new mapping
 						break;
 					}
 				}				
@@ -299,87 +563,42 @@ int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __b
 				}
 			}
 			else {
-				if (++hash >= 32)      
-					hash = 0;
-				if (hash == dsthash) {
-					if (++hash >= 32)
-						hash = 0;
-				}
+				hash = (hash + 1) & (size - 1);
+				if (hash == dsthash)
+					hash = (hash + 1) & (size - 1);
 			}
 		}
 		
 		if (status == 0) {
 			// If it's so lucky to reach here, we have to generate a new port	
-			if (get_list_port_num(list) >= ((65536 - start_port)>>ratio)) {
-				spin_unlock_bh(&list->lock);
-				printk(KERN_INFO "get_outflow_map_port: map list full.\n");
-				return -1;
-			}
-
 			if (ratio == 0)
 				retport = oldp; // In 1:1 mapping mode, use old port directly.
 				
 			else {
-				int remaining;
-				__be16 low, high;
+				int port = ivi_port_alloc(list->ports);
 				
-				low = (__u16)((start_port - 1) >> (ratio + adjacent)) + 1;
-				high = (__u16)(65536 >> (ratio + adjacent)) - 1;
-				remaining = (high - low) + 1;
-			
-				if (list->last_alloc_port != 0) {
-					rover_j = list->last_alloc_port >> (ratio + adjacent);
-					rover_k = list->last_alloc_port - ((list->last_alloc_port >> adjacent) << adjacent) + 1;
-					if (rover_k == (1 << adjacent)) {
-						rover_j++;
-						rover_k = 0;
-						if (rover_j > high)
-							rover_j = low;
-					}
-				} else {
-					rover_j = low;
-					rover_k = 0;
-				}
-			
-				do { 
-					retport = (rover_j << (ratio + adjacent)) + (offset << adjacent) + rover_k;
-					
-					if (!port_in_use(retport, list))
-						break;
-					
-					rover_k++;
-					if (rover_k == (1 << adjacent)) {
-						rover_j++;
-						remaining--;
-						rover_k = 0;
-						if (rover_j > high)
-							rover_j = low;
-					}
-				} while (remaining > 0);
-				
-				if (remaining <= 0) {
+				if (port < 0) {
 					spin_unlock_bh(&list->lock);
-#ifdef IVI_DEBUG_MAP
-					printk(KERN_INFO "get_outflow_map_port: failed to assign a new map port for " NIP4_FMT ":%d -> " NIP4_FMT "\n", NIP4(oldaddr), oldp, NIP4(dstaddr));
-#endif
+					printk(KERN_INFO "get_outflow_map_port: map list full.\n");
 					return -1;
 				}
+				retport = port;
+				allocated = 1; // ivi_port_alloc has taken the reference for this mapping
 			}
 		}
 	}
 	
+	if (!allocated)
+		ivi_port_get(list->ports, retport);
+	
 	if (add_new_map(oldaddr, oldp, dstaddr, retport, list) == NULL) {
+		ivi_port_put(list->ports, retport);
 		spin_unlock_bh(&list->lock);
 		return -1;
 	}
 	
-	if (status == 0 && reusing == 0) { // we generated a new mapping port
-		list->last_alloc_port = retport;
-		list->port_num++;
-	}
-	
 #ifdef IVI_DEBUG_MAP
-	printk(KERN_INFO "add_new_map: add new map (" NIP4_FMT ":%d -> " NIP4_FMT " -------> %d), list_len = %d, port_num = %d\n", NIP4(oldaddr), oldp, NIP4(dstaddr), retport, list->size, list->port_num);
+	printk(KERN_INFO "add_new_map: add new map (" NIP4_FMT ":%d -> " NIP4_FMT " -------> %d), list_len = %d, port_num = %d\n", NIP4(oldaddr), oldp, NIP4(dstaddr), retport, list->size, ivi_port_in_use(list->ports));
 #endif
 		
 out:
@@ -388,52 +607,326 @@ out:
 	return (retport == 0 ? -1 : 0);
 }
 
+/*
+ * Get mapped port for outflow packet, input and output are in host byte order, return -1 if failed.
+ * If tmpl is not NULL it receives the translation template of the session, gen is 0 if it has none.
+ */
+int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, u16 ratio, u16 adjacent, u16 offset, __be16 *newp, struct ivi_xlate_tmpl *tmpl)
+{
+	u8 proto = (list == &udp_list) ? IPPROTO_UDP : IPPROTO_ICMP;
+	u64 start;
+	int ret;
+
+	trace_ivi_session_lookup_enter(proto, 0, oldaddr, oldp);
+	start = ivi_lat_begin();
+	ret = __get_outflow_map_port(list, oldaddr, oldp, dstaddr, ratio, adjacent, offset, newp, tmpl);
+	ivi_lat_end(proto == IPPROTO_UDP ? IVI_LAT_SESSION_UDP : IVI_LAT_SESSION_ICMP, start);
+	trace_ivi_session_lookup_exit(proto, 0, oldaddr, oldp, ret);
+	return ret;
+}
+
+// Store the translation template of an outflow session, if it still exists; input is in host byte order
+void ivi_map_set_tmpl(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, const struct ivi_xlate_tmpl *tmpl)
+{
+	struct map_tuple *iter;
+
+	spin_lock_bh(&list->lock);
+	iter = map_out_lookup(list, oldaddr, oldp, dstaddr);
+	if (iter != NULL) {
+		write_seqcount_begin(&iter->tmpl_seq);
+		iter->tmpl = *tmpl;
+		write_seqcount_end(&iter->tmpl_seq);
+	}
+	spin_unlock_bh(&list->lock);
+}
+
+// Tell whether an outflow session is already mapped, without creating anything; input is in host byte order
+int ivi_map_established(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = (map_out_lookup(list, oldaddr, oldp, dstaddr) != NULL);
+	rcu_read_unlock();
+
+	return ret;
+}
+
 // Get mapped port and address for inflow packet, input and output are in host bypt order, return -1 if failed
 int get_inflow_map_port(struct map_list *list, __be16 newp, __be32 dstaddr, __be32* oldaddr, __be16 *oldp)
 {
 	struct map_tuple *iter;
-	struct hlist_node *temp;
-	int ret, hash;
+	u8 proto = (list == &udp_list) ? IPPROTO_UDP : IPPROTO_ICMP;
+	u64 start;
+	int ret;
 		
-	refresh_map_list(list);
-	spin_lock_bh(&list->lock);
-	
-	ret = 1;
+	ret = -1;
 	*oldp = 0;
 	*oldaddr = 0;
 	
-	hash = port_hashfn(newp);
-	hlist_for_each_entry(iter, temp, &list->in_chain[hash], in_node) {
-		if (iter->newport == newp && iter->dstaddr == dstaddr) {
-			*oldaddr = iter->oldaddr;
-			*oldp = iter->oldport;
-			do_gettimeofday(&iter->timer);
+	trace_ivi_session_lookup_enter(proto, 1, dstaddr, newp);
+	start = ivi_lat_begin();
+
+	rcu_read_lock();
+	iter = map_in_lookup(list, newp, dstaddr);
+	if (iter == NULL) {
+		// Missed by the lockless lookup, either no mapping or the tables were being rehashed.
+		spin_lock_bh(&list->lock);
+		iter = map_in_lookup(list, newp, dstaddr);
+		spin_unlock_bh(&list->lock);
+	}
+	
+	if (iter != NULL) {
+		*oldaddr = iter->oldaddr;
+		*oldp = iter->oldport;
+		iter->timer = jiffies;
 #ifdef IVI_DEBUG_MAP
-			//printk(KERN_INFO "get_inflow_map_port: find map " NIP4_FMT ":%d -> " NIP4_FMT 
-			//                 " ------> %d on in_chain[%d]\n", NIP4(iter->oldaddr), 
-			//                 iter->oldport, NIP4(iter->dstaddr), iter->newport, hash);
+		//printk(KERN_INFO "get_inflow_map_port: find map " NIP4_FMT ":%d -> " NIP4_FMT 
+		//                 " ------> %d\n", NIP4(iter->oldaddr), 
+		//                 iter->oldport, NIP4(iter->dstaddr), iter->newport);
 #endif
-			ret = 0;
-			break;
-		}		
+		ret = 0;
 	}
-	
-	if (ret == 1) {	// fail to find a mapping either in list.
+	else { // fail to find a mapping either in list.
 #ifdef IVI_DEBUG_MAP_TCP
-		printk(KERN_INFO "get_inflow_map_port: in_chain[%d] empty.\n", hash);
+		printk(KERN_INFO "get_inflow_map_port: no mapping for port %d.\n", newp);
 #endif
-		
-		ret = -1;
 	}
+	rcu_read_unlock();
 	
-	spin_unlock_bh(&list->lock);
+	ivi_lat_end(proto == IPPROTO_UDP ? IVI_LAT_SESSION_UDP : IVI_LAT_SESSION_ICMP, start);
+	trace_ivi_session_lookup_exit(proto, 1, dstaddr, newp, ret);
+	return ret;
+}
+
+
+/* fragment flow table, sized once at load time from htable_size, written under frag_lock */
+static spinlock_t frag_lock;
+static struct hlist_head *frag_chain;
+static unsigned int frag_bits;
+static u32 frag_seed;
+static int frag_num;
+static struct delayed_work frag_gc_work;
+
+static inline u32 frag_hash(const struct in6_addr *saddr6, const struct in6_addr *daddr6, __be32 id)
+{
+	return jhash_3words(saddr6->s6_addr32[2] ^ saddr6->s6_addr32[3], daddr6->s6_addr32[2] ^ daddr6->s6_addr32[3], \
+	                    id, frag_seed) & ((1U << frag_bits) - 1);
+}
+
+static void frag_tuple_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct frag_tuple, rcu));
+}
+
+// Find the fragment flow of a datagram, must be called under rcu_read_lock or with frag_lock held
+static struct frag_tuple *frag_find(const struct in6_addr *saddr6, const struct in6_addr *daddr6, __be32 id)
+{
+	struct frag_tuple *iter;
+	struct hlist_node *loop;
+
+	hlist_for_each_entry_rcu(iter, loop, &frag_chain[frag_hash(saddr6, daddr6, id)], node) {
+		if (iter->id == id && ipv6_addr_equal(&iter->saddr6, saddr6) && ipv6_addr_equal(&iter->daddr6, daddr6))
+			return iter;
+	}
+	return NULL;
+}
+
+// Remove the fragment flows older than IVI_FRAG_TIMEOUT, or all of them; must be protected by frag_lock
+static void expire_frag_chains(int all)
+{
+	struct frag_tuple *iter;
+	struct hlist_node *loop;
+	struct hlist_node *temp;
+	int i;
+
+	for (i = 0; i < (1 << frag_bits); i++) {
+		hlist_for_each_entry_safe(iter, loop, temp, &frag_chain[i], node) {
+			if (all || time_after_eq(jiffies, iter->timer + IVI_FRAG_TIMEOUT)) {
+				hlist_del_rcu(&iter->node);
+				frag_num--;
+				call_rcu(&iter->rcu, frag_tuple_free_rcu);
+			}
+		}
+	}
+}
+
+// Delayed work, the whole table is swept once per IVI_FRAG_TIMEOUT
+static void frag_gc(struct work_struct *work)
+{
+	spin_lock_bh(&frag_lock);
+	expire_frag_chains(0);
+	spin_unlock_bh(&frag_lock);
+
+	schedule_delayed_work(&frag_gc_work, IVI_FRAG_TIMEOUT);
+}
+
+// Remember how the first fragment of a datagram was translated, for the later ones
+void ivi_frag_learn(const struct frag_tuple *frag)
+{
+	struct frag_tuple *iter;
+	struct hlist_head *chain;
+	struct hlist_node *loop;
+	struct hlist_node *temp;
+	int count;
+
+	if (!frag_chain)
+		return;
+
+	spin_lock_bh(&frag_lock);
+	if ((iter = frag_find(&frag->saddr6, &frag->daddr6, frag->id)) != NULL) {
+		// The first fragment was sent again, the later ones are on their way again too
+		if (iter->saddr == frag->saddr && iter->daddr == frag->daddr && iter->protocol == frag->protocol) {
+			iter->timer = jiffies;
+			spin_unlock_bh(&frag_lock);
+			return;
+		}
+		hlist_del_rcu(&iter->node);
+		frag_num--;
+		call_rcu(&iter->rcu, frag_tuple_free_rcu);
+	}
+
+	// At most IVI_FRAG_PER_BUCKET datagrams per chain, which bounds the walk of frag_find()
+	chain = &frag_chain[frag_hash(&frag->saddr6, &frag->daddr6, frag->id)];
+	count = 0;
+	hlist_for_each_entry_safe(iter, loop, temp, chain, node) {
+		if (time_after_eq(jiffies, iter->timer + IVI_FRAG_TIMEOUT)) {
+			hlist_del_rcu(&iter->node);
+			frag_num--;
+			call_rcu(&iter->rcu, frag_tuple_free_rcu);
+		} else
+			count++;
+	}
+	if (count >= IVI_FRAG_PER_BUCKET) {
+		// Chain full: the later fragments of this datagram will not be translated
+		spin_unlock_bh(&frag_lock);
+		IVI_STATS_INC(IVI_STAT_DROP_FRAG);
+		return;
+	}
+	if (!(iter = kmalloc(sizeof(struct frag_tuple), GFP_ATOMIC))) {
+		spin_unlock_bh(&frag_lock);
+		IVI_STATS_INC(IVI_STAT_ALLOC_FAIL);
+		return;
+	}
+	memcpy(iter, frag, sizeof(struct frag_tuple));
+	iter->timer = jiffies;
+	hlist_add_head_rcu(&iter->node, chain);
+	frag_num++;
+	spin_unlock_bh(&frag_lock);
+}
+
+// Get how the fragments of a datagram are translated, return -1 if its first fragment was not seen
+int ivi_frag_lookup(const struct in6_addr *saddr6, const struct in6_addr *daddr6, __be32 id, struct frag_tuple *frag)
+{
+	struct frag_tuple *iter;
+	int ret = -1;
+
+	if (!frag_chain)
+		return -1;
+
+	rcu_read_lock();
+	iter = frag_find(saddr6, daddr6, id);
+	if (iter != NULL && time_before(jiffies, iter->timer + IVI_FRAG_TIMEOUT)) {
+		frag->saddr = iter->saddr;
+		frag->daddr = iter->daddr;
+		frag->protocol = iter->protocol;
+		ret = 0;
+	}
+	rcu_read_unlock();
+
 	return ret;
 }
 
+// Number of datagrams whose fragments are being followed
+int ivi_frag_count(void)
+{
+	return frag_num;
+}
+
+// Set the number of buckets of UDP and ICMP tables, the tables may still grow beyond it under load
+int ivi_map_set_htable_size(unsigned int size)
+{
+	unsigned int bits = ivi_htable_bits(size);
+	int retval;
+
+	htable_size = 1U << bits;
+	udp_list.htable_min_bits = bits;
+	icmp_list.htable_min_bits = bits;
+	if ((retval = rehash_map_list(&udp_list, bits)) < 0)
+		return retval;
+	return rehash_map_list(&icmp_list, bits);
+}
+
+// Rebuild the port pool of a list for the local PSID, the ports of existing mappings stay referenced
+static int map_list_port_setup(struct map_list *list, u16 ratio, u16 adjacent, u16 offset)
+{
+	struct ivi_port_pool *pool, *old;
+	struct map_tuple *iter;
+	struct hlist_node *loop;
+	int i, retval;
+
+	if ((pool = (struct ivi_port_pool *)kmalloc(sizeof(struct ivi_port_pool), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if ((retval = ivi_port_pool_init(pool, ratio, adjacent, offset)) < 0) {
+		kfree(pool);
+		return retval;
+	}
+
+	spin_lock_bh(&list->lock);
+	for (i = 0; i < (1 << list->htable_bits); i++) {
+		hlist_for_each_entry(iter, loop, &list->out_chain[i], out_node) {
+			ivi_port_get(pool, iter->newport);
+		}
+	}
+	ivi_port_pool_fill(pool);
+	old = list->ports;
+	list->ports = pool;
+	spin_unlock_bh(&list->lock);
+
+	ivi_port_pool_release(old);
+	kfree(old);
+	return 0;
+}
+
+// Set up the port pools of UDP and ICMP lists, ratio and adjacent are given as powers of 2
+int ivi_map_port_setup(u16 ratio, u16 adjacent, u16 offset)
+{
+	int retval;
+
+	if ((retval = map_list_port_setup(&udp_list, ratio, adjacent, offset)) < 0)
+		return retval;
+	return map_list_port_setup(&icmp_list, ratio, adjacent, offset);
+}
 
 int ivi_map_init(void) {
-	init_map_list(&udp_list, 15);
-	init_map_list(&icmp_list, 15);
+	int retval;
+
+	if ((retval = ivi_session_cache_create("ivi_map_tuple", sizeof(struct map_tuple), &map_tuple_cache, &map_tuple_pool)) < 0)
+		return retval;
+	if ((retval = init_map_list(&udp_list, 15)) < 0) {
+		ivi_session_cache_destroy(map_tuple_cache, map_tuple_pool);
+		return retval;
+	}
+	if ((retval = init_map_list(&icmp_list, 15)) < 0) {
+		cancel_delayed_work_sync(&udp_list.gc_work);
+		ivi_htable_free(udp_list.out_chain, udp_list.htable_bits);
+		ivi_htable_free(udp_list.in_chain, udp_list.htable_bits);
+		ivi_htable_free(udp_list.dest_chain, udp_list.htable_bits);
+		ivi_session_cache_destroy(map_tuple_cache, map_tuple_pool);
+		return retval;
+	}
+	spin_lock_init(&frag_lock);
+	frag_bits = ivi_htable_bits(htable_size);
+	if (!(frag_chain = ivi_htable_alloc(frag_bits))) {
+		// Not fatal, later fragments are dropped as if their first fragment was lost
+		printk(KERN_WARNING "IVI: failed to allocate the fragment table, later fragments will be dropped.\n");
+		frag_bits = 0;
+	}
+	get_random_bytes(&frag_seed, sizeof(u32));
+	frag_num = 0;
+	INIT_DELAYED_WORK(&frag_gc_work, frag_gc);
+	if (frag_chain)
+		schedule_delayed_work(&frag_gc_work, IVI_FRAG_TIMEOUT);
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_map loaded.\n");
 #endif 
@@ -441,8 +934,30 @@ int ivi_map_init(void) {
 }
 
 void ivi_map_exit(void) {
+	cancel_delayed_work_sync(&udp_list.gc_work);
+	cancel_delayed_work_sync(&icmp_list.gc_work);
 	free_map_list(&udp_list);
 	free_map_list(&icmp_list);
+	ivi_htable_free(udp_list.out_chain, udp_list.htable_bits);
+	ivi_htable_free(udp_list.in_chain, udp_list.htable_bits);
+	ivi_htable_free(udp_list.dest_chain, udp_list.htable_bits);
+	ivi_htable_free(icmp_list.out_chain, icmp_list.htable_bits);
+	ivi_htable_free(icmp_list.in_chain, icmp_list.htable_bits);
+	ivi_htable_free(icmp_list.dest_chain, icmp_list.htable_bits);
+	ivi_port_pool_release(udp_list.ports);
+	ivi_port_pool_release(icmp_list.ports);
+	kfree(udp_list.ports);
+	kfree(icmp_list.ports);
+	if (frag_chain) {
+		cancel_delayed_work_sync(&frag_gc_work);
+		spin_lock_bh(&frag_lock);
+		expire_frag_chains(1);
+		spin_unlock_bh(&frag_lock);
+	}
+	rcu_barrier(); // wait for map_tuple_free_rcu before destroying the cache
+	ivi_session_cache_destroy(map_tuple_cache, map_tuple_pool);
+	ivi_htable_free(frag_chain, frag_bits);
+	frag_chain = NULL;
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_map unloaded.\n");
 #endif
@@ -42,9 +42,15 @@
 #include <linux/time.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 
 #include "ivi_config.h"
+#include "ivi_port.h"
 #include "ivi_map_tcp.h"
 
 /* map entry structure */
@@ -54,21 +60,44 @@ struct map_tuple {
 	struct hlist_node dest_node;   // Inserted to dest_chain
 	__be32 oldaddr;
 	__be16 oldport;
-	__be32 dstaddr;
 	__be16 newport;
-	struct timeval timer;
+	__be32 dstaddr;
+	seqcount_t tmpl_seq;  // Readers of tmpl retry against writers, which hold the list lock
+	unsigned long timer;  // jiffies of the last packet, refreshed without the list lock
+	struct rcu_head rcu;
+	struct ivi_xlate_tmpl tmpl;
 };
 
 /* map list structure */
 struct map_list {
-	spinlock_t lock;
-	struct hlist_head out_chain[IVI_HTABLE_SIZE];  // Map table from oldport to newport
-	struct hlist_head in_chain[IVI_HTABLE_SIZE];   // Map table from newport to oldport
-	struct hlist_head dest_chain[IVI_HTABLE_SIZE]; // Map table with destination and newport
+	spinlock_t lock;               // Writer lock, lookups of existing mappings run under RCU
+	seqcount_t htable_seq;         // Bumped while the tables are being rehashed
+	struct hlist_head *out_chain;  // Map table from oldport to newport
+	struct hlist_head *in_chain;   // Map table from newport to oldport
+	struct hlist_head *dest_chain; // Map table with destination and newport
+	unsigned int htable_bits;      // Each table above has (1 << htable_bits) buckets
+	unsigned int htable_min_bits;  // The tables never shrink below this size
+	u32 hash_seed;                 // Random seed of the hash functions
 	int size;
-	int port_num;            // Number of MAP ports allocated in the map list
-	__be16 last_alloc_port;  // Save the last allocate port number
+	struct ivi_port_pool *ports;  // MAP ports of the local PSID, ivi_port_in_use() is the number of ports allocated
 	time_t timeout;
+	struct delayed_work gc_work;  // Collect timed-out map_tuple and resize the tables off the packet path
+	int gc_bucket;                // Next out_chain bucket to be swept by gc_work
+};
+
+/* fragment flow entry: how the fragments of an IPv6 datagram are translated, learnt from
+ * the first one since the later ones carry no transport header. Keys and values are kept
+ * in network byte order, as they are in the headers. */
+struct frag_tuple {
+	struct hlist_node node;
+	struct in6_addr saddr6;  // Keys: IPv6 addresses and fragment identification
+	struct in6_addr daddr6;
+	__be32 id;
+	__be32 saddr;            // IPv4 addresses of the translated fragments, daddr after NAT44
+	__be32 daddr;
+	u8 protocol;
+	unsigned long timer;     // jiffies of the first fragment
+	struct rcu_head rcu;
 };
 
 /* global map list variables */
@@ -80,14 +109,49 @@ extern u16 hgw_adjacent;
 extern struct map_list udp_list;
 extern struct map_list icmp_list;
 
+extern unsigned int htable_size;
+extern unsigned int session_reserve;
+extern u32 ivi_xlate_gen;
+
+// Throw away the translation templates of all sessions, after a configuration change
+static inline void ivi_xlate_invalidate(void)
+{
+	if (++ivi_xlate_gen == 0)
+		ivi_xlate_gen = 1;
+}
+
+// Tell whether a translation template can be used for a packet to the given destination port
+static inline int ivi_xlate_tmpl_valid(const struct ivi_xlate_tmpl *tmpl, __be16 dstport)
+{
+	return tmpl->gen == ivi_xlate_gen && tmpl->dstport == dstport;
+}
+
+/* session cache operations */
+extern int ivi_session_cache_create(const char *name, size_t size, struct kmem_cache **cache, mempool_t **pool);
+extern void ivi_session_cache_destroy(struct kmem_cache *cache, mempool_t *pool);
+
+/* hash table operations */
+extern struct hlist_head *ivi_htable_alloc(unsigned int bits);
+extern void ivi_htable_free(struct hlist_head *table, unsigned int bits);
+extern unsigned int ivi_htable_bits(unsigned int size);
+extern unsigned int ivi_htable_want_bits(int entries, unsigned int bits, unsigned int min_bits);
+extern int ivi_map_set_htable_size(unsigned int size);
+extern int ivi_map_port_setup(u16 ratio, u16 adjacent, u16 offset);
 
 /* list operations */
 extern void refresh_map_list(struct map_list *list);
 extern void free_map_list(struct map_list *list);
 
 /* mapping operations */
-extern int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, u16 ratio, u16 adjacent, u16 offset, __be16 *newp);
+extern int get_outflow_map_port(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, u16 ratio, u16 adjacent, u16 offset, __be16 *newp, struct ivi_xlate_tmpl *tmpl);
+extern void ivi_map_set_tmpl(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr, const struct ivi_xlate_tmpl *tmpl);
 extern int get_inflow_map_port(struct map_list *list, __be16 newp, __be32 dstaddr, __be32* oldaddr, __be16 *oldp);
+extern int ivi_map_established(struct map_list *list, __be32 oldaddr, __be16 oldp, __be32 dstaddr);
+
+/* fragment flow operations */
+extern void ivi_frag_learn(const struct frag_tuple *frag);
+extern int ivi_frag_lookup(const struct in6_addr *saddr6, const struct in6_addr *daddr6, __be32 id, struct frag_tuple *frag);
+extern int ivi_frag_count(void);
 
 extern int ivi_map_init(void);
 extern void ivi_map_exit(void);
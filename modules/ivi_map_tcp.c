@@ -75,6 +75,17 @@ static unsigned int TcpTimeOutUnack  __read_mostly     = 5 MINS;
 
 static int TcpMaxRetrans __read_mostly = 3;
 
+/* light tracking: state transitions only, no sequence or window checks */
+bool tcp_light = 0;
+module_param(tcp_light, bool, 0444);
+MODULE_PARM_DESC(tcp_light, "Track TCP state transitions only, without sequence and window checks, in smaller sessions");
+
+/* flow cache: segments of established outflow connections bypass the state machine, which
+ * would leave the window tracking behind, so it is only available with light tracking */
+bool flow_cache = 0;
+module_param(flow_cache, bool, 0444);
+MODULE_PARM_DESC(flow_cache, "Translate established TCP flows from a cache of their headers, requires tcp_light");
+
 // Short name for TCP_STATUS
 #define sNO TCP_STATUS_NONE
 #define sSS TCP_STATUS_SYN_SENT
@@ -626,7 +637,7 @@ FILTER_STATUS CreateTcpStateContext(struct tcphdr *th, __u32 len, PTCP_STATE_CON
 	receiver->Scale = 0;
 
 	StateContext->Status = TCP_STATUS_SYN_SENT;
-	do_gettimeofday(&(StateContext->StateSetTime));
+	StateContext->StateSetTime = get_seconds();
 	StateContext->StateTimeOut = tcp_timeouts[TCP_STATUS_SYN_SENT];
 	StateContext->LastDir = PACKET_DIR_LOCAL;
 	StateContext->RetransCount = 0;
@@ -647,7 +658,6 @@ FILTER_STATUS UpdateTcpStateContext(struct tcphdr *th, __u32 len, PACKET_DIR dir
 	TCP_STATUS  OldStatus = StateContext->Status;
 	unsigned int index = get_bits_index(th);
 	TCP_STATUS  NewStatus = tcp_state_table[dir][index][OldStatus];
-	TCP_STATE_CONTEXT iter;
 
 	switch (NewStatus) {
 		case TCP_STATUS_SYN_SENT:
@@ -672,20 +682,14 @@ FILTER_STATUS UpdateTcpStateContext(struct tcphdr *th, __u32 len, PACKET_DIR dir
 				if (((sender->Options | receiver->Options) & STATE_OPTION_CLOSE_INIT)
 					|| (StateContext->LastDir == dir && StateContext->LastControlBits == TCP_RST_SET))
 				{
-					/* Attempt to reopen a closed/aborted connection. */
-					iter = *StateContext;
-					
-					memset(StateContext, 0, sizeof(TCP_STATE_CONTEXT));
-					
-					/* Port Mapping list information MUST NOT be dropped */
-					StateContext->out_node = iter.out_node;
-					StateContext->in_node = iter.in_node;
-					StateContext->dest_node = iter.dest_node;
-					StateContext->oldaddr = iter.oldaddr;
-					StateContext->oldport = iter.oldport;
-					StateContext->dstaddr = iter.dstaddr;
-					StateContext->dstport = iter.dstport;
-					StateContext->newport = iter.newport;
+					/* Attempt to reopen a closed/aborted connection. Reset the
+					 * tracking state in place: the lock, the chain nodes, the port
+					 * mapping and the cached flow MUST NOT be dropped. */
+					StateContext->Status = TCP_STATUS_NONE;
+					StateContext->StateSetTime = 0;
+					StateContext->StateTimeOut = 0;
+					memset((u8 *)StateContext + offsetof(TCP_STATE_CONTEXT, Seen), 0,
+					       sizeof(TCP_STATE_CONTEXT) - offsetof(TCP_STATE_CONTEXT, Seen));
 					tcp_list.state_seq = (tcp_list.state_seq >= 2147483647) ? 0 : (tcp_list.state_seq + 1);
 					StateContext->state_seq = tcp_list.state_seq;
 					
@@ -765,94 +769,304 @@ FILTER_STATUS UpdateTcpStateContext(struct tcphdr *th, __u32 len, PACKET_DIR dir
 	}
 
 	// Update state set time.
-	do_gettimeofday(&(StateContext->StateSetTime));
+	StateContext->StateSetTime = get_seconds();
+
+	return FILTER_ACCEPT;
+}
+
+
+/*
+ * Light tracking, only the state transitions of tcp_state_table and the state timer.
+ * The context has no Seen[] or LastXXX fields: segments are never checked against the
+ * windows, a RST is always accepted and a closed connection is reopened by any SYN.
+ */
+FILTER_STATUS CreateTcpStateLight(struct tcphdr *th, PTCP_STATE_CONTEXT StateContext)
+{
+	unsigned int index = get_bits_index(th);
+
+	if (tcp_state_table[0][index][TCP_STATUS_NONE] != TCP_STATUS_SYN_SENT)
+		return FILTER_DROP_CLEAN;
+
+	StateContext->Status = TCP_STATUS_SYN_SENT;
+	StateContext->StateTimeOut = tcp_timeouts[TCP_STATUS_SYN_SENT];
+	StateContext->StateSetTime = get_seconds();
+	return FILTER_ACCEPT;
+}
+
+FILTER_STATUS UpdateTcpStateLight(struct tcphdr *th, PACKET_DIR dir, PTCP_STATE_CONTEXT StateContext)
+{
+	TCP_STATUS  OldStatus = StateContext->Status;
+	TCP_STATUS  NewStatus = tcp_state_table[dir][get_bits_index(th)][OldStatus];
+	u32 now = get_seconds();
+
+	if (NewStatus == TCP_STATUS_IGNORE)
+		return FILTER_ACCEPT;
+	if (NewStatus == TCP_STATUS_MAX)
+		return FILTER_DROP_CLEAN;
+
+	// Fast path of established flows: the context is written at most once a second
+	if (NewStatus == OldStatus) {
+		if (StateContext->StateSetTime != now)
+			StateContext->StateSetTime = now;
+		return FILTER_ACCEPT;
+	}
 
+#ifdef IVI_DEBUG_TCP
+	printk(KERN_DEBUG "UpdateTcpStateLight: syn=%d ack=%d fin=%d rst=%d old_state=%d new_state=%d\n",
+		th->syn, th->ack, th->fin, th->rst, OldStatus, NewStatus);
+#endif
+	StateContext->Status = NewStatus;
+	StateContext->StateTimeOut = tcp_timeouts[NewStatus];
+	StateContext->StateSetTime = now;
 	return FILTER_ACCEPT;
 }
 
 struct tcp_map_list tcp_list;
 
-void init_tcp_map_list(void)
+static struct kmem_cache *tcp_state_cache;
+static mempool_t *tcp_state_pool;  // NULL if session_reserve is 0
+
+static void tcp_state_free_rcu(struct rcu_head *head)
+{
+	PTCP_STATE_CONTEXT StateContext = container_of(head, TCP_STATE_CONTEXT, rcu);
+
+	if (tcp_state_pool)
+		mempool_free(StateContext, tcp_state_pool);
+	else
+		kmem_cache_free(tcp_state_cache, StateContext);
+}
+
+static inline u32 tcp_out_hash(__be32 addr, __be16 port)
+{
+	return v4addr_port_hashfn(addr, port, tcp_list.hash_seed, tcp_list.htable_bits);
+}
+
+static inline u32 tcp_in_hash(__be16 newport, __be32 dstaddr, __be16 dstport)
+{
+	return v4addr_ports_hashfn(dstaddr, dstport, newport, tcp_list.hash_seed, tcp_list.htable_bits);
+}
+
+static inline u32 tcp_dest_hash(__be32 addr, __be16 port)
+{
+	return v4addr_port_hashfn(addr, port, tcp_list.hash_seed, tcp_list.htable_bits);
+}
+
+/* flow table, sized once at load time from htable_size, written under tcp_list.lock */
+static struct hlist_head *tcp_flow_chain;
+static unsigned int tcp_flow_bits;
+static u32 tcp_flow_seed;
+static int tcp_flow_num;
+
+static inline u32 tcp_flow_hash(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp)
+{
+	return jhash_3words(oldaddr, dstaddr, ((u32)oldp << 16) | dstp, tcp_flow_seed) & ((1U << tcp_flow_bits) - 1);
+}
+
+static void tcp_flow_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tcp_flow, rcu));
+}
+
+// Find the cached translation of an outflow connection, must be called under rcu_read_lock
+static struct tcp_flow *tcp_flow_lookup(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp)
+{
+	struct tcp_flow *flow;
+	struct hlist_node *loop;
+
+	hlist_for_each_entry_rcu(flow, loop, &tcp_flow_chain[tcp_flow_hash(oldaddr, oldp, dstaddr, dstp)], node) {
+		if (flow->oldport == oldp && flow->oldaddr == oldaddr && flow->dstaddr == dstaddr && flow->dstport == dstp)
+			return flow;
+	}
+	return NULL;
+}
+
+// Drop the cached translation of a mapping, must be protected by spin lock when calling this function
+static void remove_tcp_flow(PTCP_STATE_CONTEXT StateContext)
+{
+	struct tcp_flow *flow = StateContext->flow;
+
+	if (!flow)
+		return;
+	hlist_del_rcu(&flow->node);
+	StateContext->flow = NULL;
+	tcp_flow_num--;
+	call_rcu(&flow->rcu, tcp_flow_free_rcu);
+}
+
+static void tcp_map_list_gc(struct work_struct *work);
+
+int init_tcp_map_list(void)
 {
-	int i;
 	spin_lock_init(&tcp_list.lock);
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
-		INIT_HLIST_HEAD(&tcp_list.out_chain[i]);
-		INIT_HLIST_HEAD(&tcp_list.in_chain[i]);
-		INIT_HLIST_HEAD(&tcp_list.dest_chain[i]);
+	seqcount_init(&tcp_list.htable_seq);
+	tcp_list.htable_bits = tcp_list.htable_min_bits = ivi_htable_bits(htable_size);
+	tcp_list.out_chain = ivi_htable_alloc(tcp_list.htable_bits);
+	tcp_list.in_chain = ivi_htable_alloc(tcp_list.htable_bits);
+	tcp_list.dest_chain = ivi_htable_alloc(tcp_list.htable_bits);
+	tcp_list.ports = (struct ivi_port_pool *)kzalloc(sizeof(struct ivi_port_pool), GFP_KERNEL); // empty until port setup
+	if (!tcp_list.out_chain || !tcp_list.in_chain || !tcp_list.dest_chain || !tcp_list.ports) {
+		ivi_htable_free(tcp_list.out_chain, tcp_list.htable_bits);
+		ivi_htable_free(tcp_list.in_chain, tcp_list.htable_bits);
+		ivi_htable_free(tcp_list.dest_chain, tcp_list.htable_bits);
+		kfree(tcp_list.ports);
+		printk(KERN_ERR "init_tcp_map_list: failed to allocate hash tables.\n");
+		return -ENOMEM;
 	}
+	get_random_bytes(&tcp_list.hash_seed, sizeof(u32));
 	tcp_list.size = 0;
-	tcp_list.port_num = 0;
 	tcp_list.state_seq = 0;
-	tcp_list.last_alloc_port = 0;
+	tcp_list.gc_bucket = 0;
+	INIT_DELAYED_WORK(&tcp_list.gc_work, tcp_map_list_gc);
+	schedule_delayed_work(&tcp_list.gc_work, IVI_GC_INTERVAL);
+	return 0;
 }
 
-// Refresh the timer for each map_tuple, must NOT acquire spin lock when calling this function
-void refresh_tcp_map_list(int threshold)
+// Rebuild all the chains with (1 << bits) buckets and a new hash seed, must NOT acquire spin lock when calling this function
+static int rehash_tcp_map_list(unsigned int bits)
 {
-	PTCP_STATE_CONTEXT iter, i0;
-	struct hlist_node *loop, *l0;
+	struct hlist_head *out, *in, *dest;
+	struct hlist_head *old_out, *old_in, *old_dest;
+	PTCP_STATE_CONTEXT iter;
+	struct hlist_node *loop;
 	struct hlist_node *temp;
-	struct timeval now;
-	time_t delta;
-	int i, flag;
-	do_gettimeofday(&now);
-	
+	unsigned int i, old_bits;
+	u32 seed;
+
+	out = ivi_htable_alloc(bits);
+	in = ivi_htable_alloc(bits);
+	dest = ivi_htable_alloc(bits);
+	if (!out || !in || !dest) {
+		ivi_htable_free(out, bits);
+		ivi_htable_free(in, bits);
+		ivi_htable_free(dest, bits);
+		printk(KERN_ERR "rehash_tcp_map_list: failed to allocate hash tables with %u buckets.\n", 1U << bits);
+		return -ENOMEM;
+	}
+	get_random_bytes(&seed, sizeof(u32));
+
 	spin_lock_bh(&tcp_list.lock);
+	write_seqcount_begin(&tcp_list.htable_seq);
+	old_out = tcp_list.out_chain;
+	old_in = tcp_list.in_chain;
+	old_dest = tcp_list.dest_chain;
+	old_bits = tcp_list.htable_bits;
+
+	tcp_list.out_chain = out;
+	tcp_list.in_chain = in;
+	tcp_list.dest_chain = dest;
+	tcp_list.htable_bits = bits;
+	tcp_list.hash_seed = seed;
+	tcp_list.gc_bucket = 0;
+
+	// Every mapping is linked on out_chain, so walking it once moves all three nodes.
+	// A lockless lookup racing with this may miss and then retries under the lock.
+	for (i = 0; i < (1U << old_bits); i++) {
+		hlist_for_each_entry_safe(iter, loop, temp, &old_out[i], out_node) {
+			hlist_add_head_rcu(&iter->out_node, &out[tcp_out_hash(iter->oldaddr, iter->oldport)]);
+			hlist_add_head_rcu(&iter->in_node, &in[tcp_in_hash(iter->newport, iter->dstaddr, iter->dstport)]);
+			hlist_add_head_rcu(&iter->dest_node, &dest[tcp_dest_hash(iter->dstaddr, iter->dstport)]);
+		}
+	}
+	write_seqcount_end(&tcp_list.htable_seq);
+	spin_unlock_bh(&tcp_list.lock);
+
+	synchronize_rcu();
+	ivi_htable_free(old_out, old_bits);
+	ivi_htable_free(old_in, old_bits);
+	ivi_htable_free(old_dest, old_bits);
+
+#ifdef IVI_DEBUG_MAP_TCP
+	printk(KERN_INFO "rehash_tcp_map_list: %d mappings rehashed from %u to %u buckets.\n", tcp_list.size, 1U << old_bits, 1U << bits);
+#endif
+	return 0;
+}
+
+// Unlink a mapping and release its port if no one else uses it, must be protected by spin lock when calling this function
+static void remove_tcp_mapping(PTCP_STATE_CONTEXT StateContext)
+{
+	hlist_del_rcu(&StateContext->out_node);
+	hlist_del_rcu(&StateContext->in_node);
+	hlist_del_rcu(&StateContext->dest_node);
+	StateContext->removed = 1;
+	tcp_list.size--;
+	remove_tcp_flow(StateContext);
+
+	if (ivi_port_put(tcp_list.ports, StateContext->newport) == 0) {
+#ifdef IVI_DEBUG_MAP_TCP
+		printk(KERN_INFO "remove_tcp_mapping: port_num is decreased to %d(%d)\n", 
+		                 ivi_port_in_use(tcp_list.ports), StateContext->newport);
+#endif
+	}
+
+	call_rcu(&StateContext->rcu, tcp_state_free_rcu);
+}
+
+// Remove the timed-out mappings on out_chain[start, end), must be protected by spin lock when calling this function
+static void expire_tcp_chains(int start, int end)
+{
+	PTCP_STATE_CONTEXT iter;
+	struct hlist_node *loop;
+	struct hlist_node *temp;
+	u32 now, delta;
+	int i;
+	now = get_seconds();
+	
 	// Iterate all the map_tuple through out_chain only, in_chain contains the same info.
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
+	for (i = start; i < end; i++) {
 		hlist_for_each_entry_safe(iter, loop, temp, &tcp_list.out_chain[i], out_node) {
-			delta = now.tv_sec - iter->StateSetTime.tv_sec;
+			delta = now - iter->StateSetTime;
 			//if (delta >= iter->StateTimeOut || iter->Status == TCP_STATUS_TIME_WAIT || iter->state_seq <= threshold) {
 			if (delta >= iter->StateTimeOut) {				
-				hlist_del(&iter->out_node);
-				hlist_del(&iter->in_node);
-				hlist_del(&iter->dest_node);
-				tcp_list.size--;
-				
 #ifdef IVI_DEBUG_MAP_TCP
-				printk(KERN_INFO "refresh_tcp_map_list: time out map " NIP4_FMT ":%d -> %d (dst " NIP4_FMT ":%d) "
+				printk(KERN_INFO "expire_tcp_chains: time out map " NIP4_FMT ":%d -> %d (dst " NIP4_FMT ":%d) "
 				                 "on out_chain[%d], TCP state %d\n", NIP4(iter->oldaddr), iter->oldport, iter->newport, 
 				                 NIP4(iter->dstaddr), iter->dstport, i, iter->Status);
 				                 
 				//if (iter->Status == TCP_STATUS_TIME_WAIT)
-				//	printk(KERN_INFO "refresh_tcp_map_list: clean time-wait mappings\n");
+				//	printk(KERN_INFO "expire_tcp_chains: clean time-wait mappings\n");
  				//else if (iter->state_seq <= threshold)
- 				//	printk(KERN_INFO "refresh_tcp_map_list: recycle ports: threshold = %d, state_seq = %d\n", threshold, iter->state_seq);
+ 				//	printk(KERN_INFO "expire_tcp_chains: recycle ports: threshold = %d, state_seq = %d\n", threshold, iter->state_seq);
 				//else
-				//	printk(KERN_INFO "refresh_tcp_map_list: time out map " NIP4_FMT ":%d -> %d (dst " NIP4_FMT ":%d) on out_chain[%d], TCP state %d\n", 
+				//	printk(KERN_INFO "expire_tcp_chains: time out map " NIP4_FMT ":%d -> %d (dst " NIP4_FMT ":%d) on out_chain[%d], TCP state %d\n", 
 				//		NIP4(iter->oldaddr), iter->oldport, iter->newport, NIP4(iter->dstaddr), iter->dstport, i, iter->Status);
 #endif
 
-				flag = 0; // indicating whether tcp_list.port_num needs to be substracted by 1.
- 				hlist_for_each_entry(i0, l0, &tcp_list.in_chain[port_hashfn(iter->newport)], in_node) {
- 					if (i0->newport == iter->newport) {
- 						flag = 1;
- 											
-#ifdef IVI_DEBUG_MAP_TCP
- 						printk(KERN_INFO "refresh_tcp_map_list: newport %d is still used by someone(" 
- 						                 NIP4_FMT ":%d -> " NIP4_FMT ":%d). port_num is still %d\n", 
- 						                 iter->newport, NIP4(i0->oldaddr), i0->oldport, 
- 						                 NIP4(i0->dstaddr), i0->dstport, tcp_list.port_num);
-#endif
- 						break;
- 					}
- 				}
- 				if (!flag) {
- 					tcp_list.port_num--;
-#ifdef IVI_DEBUG_MAP_TCP
- 					printk(KERN_INFO "refresh_tcp_map_list: port_num is decreased by 1 to %d(%d)\n", 
- 					                 tcp_list.port_num, iter->newport);
-#endif
- 				}				
-				
-				kfree(iter);
+				remove_tcp_mapping(iter);
 			}
 		}
 	}
+}
+
+// Refresh the timer for each map_tuple, must NOT acquire spin lock when calling this function
+void refresh_tcp_map_list(int threshold)
+{
+	spin_lock_bh(&tcp_list.lock);
+	expire_tcp_chains(0, 1 << tcp_list.htable_bits);
 	spin_unlock_bh(&tcp_list.lock);
 }
 
+// Delayed work, sweep one slice of out_chain, resize the tables if needed and re-arm itself
+static void tcp_map_list_gc(struct work_struct *work)
+{
+	unsigned int bits;
+	int size, end;
+
+	spin_lock_bh(&tcp_list.lock);
+	size = 1 << tcp_list.htable_bits;
+	end = tcp_list.gc_bucket + (size + IVI_GC_SLICES - 1) / IVI_GC_SLICES;
+	if (end > size)
+		end = size;
+	expire_tcp_chains(tcp_list.gc_bucket, end);
+	tcp_list.gc_bucket = (end == size) ? 0 : end;
+	bits = ivi_htable_want_bits(tcp_list.size, tcp_list.htable_bits, tcp_list.htable_min_bits);
+	spin_unlock_bh(&tcp_list.lock);
+
+	if (bits != tcp_list.htable_bits)
+		rehash_tcp_map_list(bits);
+
+	schedule_delayed_work(&tcp_list.gc_work, IVI_GC_INTERVAL);
+}
+
 // Clear the entire list, must NOT acquire spin lock when calling this function
 void free_tcp_map_list(void)
 {
@@ -863,116 +1077,62 @@ void free_tcp_map_list(void)
 	
 	spin_lock_bh(&tcp_list.lock);
 	// Iterate all the map_tuple through out_chain only, in_chain contains the same info.
-	for (i = 0; i < IVI_HTABLE_SIZE; i++) {
+	for (i = 0; i < (1 << tcp_list.htable_bits); i++) {
 		if (!hlist_empty(&tcp_list.out_chain[i])) {
 			hlist_for_each_entry_safe(iter, loop, temp, &tcp_list.out_chain[i], out_node) {
-				hlist_del(&iter->out_node);
-				hlist_del(&iter->in_node);
-				hlist_del(&iter->dest_node);
+				hlist_del_rcu(&iter->out_node);
+				hlist_del_rcu(&iter->in_node);
+				hlist_del_rcu(&iter->dest_node);
+				iter->removed = 1;
 				tcp_list.size--;
+				remove_tcp_flow(iter);
+				ivi_port_put(tcp_list.ports, iter->newport);
 
 				printk(KERN_INFO "free_tcp_map_list: delete map " NIP4_FMT ":%d -> %d (dst " NIP4_FMT ":%d) on out_chain[%d], TCP state %d\n", 
 					NIP4(iter->oldaddr), iter->oldport, iter->newport, NIP4(iter->dstaddr), iter->dstport, i, iter->Status);
 
-				kfree(iter);
+				call_rcu(&iter->rcu, tcp_state_free_rcu);
 			}
 
 		}
 	}
-	tcp_list.port_num = tcp_list.state_seq = 0;
+	tcp_list.state_seq = 0;
 	spin_unlock_bh(&tcp_list.lock);
 }
 
-// Check whether a port is in use now, must be protected by spin lock when calling this function
-static inline int tcp_port_in_use(__be16 port)
-{
-	int ret = 0;
-	int hash;
-	PTCP_STATE_CONTEXT iter;
-	struct hlist_node *temp;
-
-	hash = port_hashfn(port);
-	if (!hlist_empty(&tcp_list.in_chain[hash])) {
-		hlist_for_each_entry(iter, temp, &tcp_list.in_chain[hash], in_node) {
-			if (iter->newport == port) {
-				ret = 1;
-				break;
-			}
-		}
-	}
-
-	return ret;
-}
-
-// generate a new MAP port, must be protected by spin lock when calling this function
-static inline int new_tcp_map_port(u16 ratio, u16 adjacent, u16 offset, int start_port) {
-	int retport, rover_j, rover_k, remaining; 
-	__be16 low, high;
-			
-	low = (__u16)((start_port - 1) >> (ratio + adjacent)) + 1;
-	high = (__u16)(65536 >> (ratio + adjacent)) - 1;
-	remaining = (high - low) + 1;
-
-	if (tcp_list.last_alloc_port != 0) {
-		rover_j = tcp_list.last_alloc_port >> (ratio + adjacent);
-		rover_k = (tcp_list.last_alloc_port - ((tcp_list.last_alloc_port >> adjacent) << adjacent)) + 1;
-		if (rover_k == (1 << adjacent)) {
-			rover_j++;
-			rover_k = 0;
-			if (rover_j > high)
-				rover_j = low;
-		}
-	}	
-	else {
-		rover_j = low;
-		rover_k = 0;
-	}
-				
-	do { 
-		retport = (rover_j << (ratio + adjacent)) + (offset << adjacent) + rover_k;
-					
-		if (!tcp_port_in_use(retport))
-			break;
-					
-		rover_k++;
-		if (rover_k == (1 << adjacent)) {
-			rover_j++;
-			remaining--;
-			rover_k = 0;
-			if (rover_j > high)
-				rover_j = low;
-		}
-	} while (remaining > 0);
-			
-	if (remaining <= 0)
-		return -1;
-	
-	return retport;
-}
-
 // Create packet state and add mapping info to state list
 // MUST NOT acquire spin lock when calling this function
-// multiplexflag: 0 -> no multiplex (generate a new unused port)
-//                1 -> multiplex
+// multiplexflag: 0 -> no multiplex (newport comes from ivi_port_alloc on pool, which holds the reference for this mapping)
+//                1 -> multiplex (a new reference is taken on newport, pool is not used)
 static inline int create_tcp_mapping(u32 oldaddr, u16 oldp, u32 dstaddr, u16 dstp, u16 newport, 
-                                     struct tcphdr *th, unsigned int len, int multiplexflag) 
+                                     struct tcphdr *th, unsigned int len, int multiplexflag, struct ivi_port_pool *pool) 
 {
 	PTCP_STATE_CONTEXT StateContext;
 	FILTER_STATUS ftState;
 	int hash;
 	
 	spin_lock_bh(&tcp_list.lock);
-	StateContext = (PTCP_STATE_CONTEXT)kmalloc(sizeof(TCP_STATE_CONTEXT), GFP_ATOMIC);
+	if (tcp_state_pool)
+		StateContext = (PTCP_STATE_CONTEXT)mempool_alloc(tcp_state_pool, GFP_ATOMIC);
+	else
+		StateContext = (PTCP_STATE_CONTEXT)kmem_cache_alloc(tcp_state_cache, GFP_ATOMIC);
 	if (StateContext == NULL) // No memory for state info. Fail this map.
 	{	
+		if (!multiplexflag)
+			ivi_port_put(pool, newport);
 		spin_unlock_bh(&tcp_list.lock);
-		printk(KERN_ERR "create_tcp_mapping: kmalloc failed.\n");
+		IVI_STATS_INC(IVI_STAT_ALLOC_FAIL);
+		printk(KERN_ERR "create_tcp_mapping: failed to allocate TCP state.\n");
 		return -1;
 	}
-	memset(StateContext, 0, sizeof(TCP_STATE_CONTEXT));
+	memset(StateContext, 0, tcp_light ? TCP_LIGHT_STATE_SIZE : sizeof(TCP_STATE_CONTEXT));
+	spin_lock_init(&StateContext->lock);
 	
 	// Check packet state for new mapping.
-	ftState = CreateTcpStateContext(th, len, StateContext);
+	if (tcp_light)
+		ftState = CreateTcpStateLight(th, StateContext);
+	else
+		ftState = CreateTcpStateContext(th, len, StateContext);
 
 	if (ftState == FILTER_DROP_CLEAN) {
 #ifdef IVI_DEBUG_MAP_TCP
@@ -980,7 +1140,12 @@ static inline int create_tcp_mapping(u32 oldaddr, u16 oldp, u32 dstaddr, u16 dst
 		                ":%d, TCP state %d, fail to add new map.\n", NIP4(oldaddr), oldp, 
 		                NIP4(dstaddr), dstp, StateContext->Status);
 #endif
-		kfree(StateContext);			
+		if (tcp_state_pool)
+			mempool_free(StateContext, tcp_state_pool);
+		else
+			kmem_cache_free(tcp_state_cache, StateContext);
+		if (!multiplexflag)
+			ivi_port_put(pool, newport);
 		spin_unlock_bh(&tcp_list.lock);
 		return -1;
 	}
@@ -991,19 +1156,18 @@ static inline int create_tcp_mapping(u32 oldaddr, u16 oldp, u32 dstaddr, u16 dst
 	StateContext->dstaddr = dstaddr;
 	StateContext->dstport = dstp;
 	StateContext->newport = newport;
-	hash = v4addr_port_hashfn(oldaddr, oldp);
-	hlist_add_head(&StateContext->out_node, &tcp_list.out_chain[hash]);
-	hash = port_hashfn(newport);
-	hlist_add_head(&StateContext->in_node, &tcp_list.in_chain[hash]);
-	hash = v4addr_port_hashfn(dstaddr, dstp);
-	hlist_add_head(&StateContext->dest_node, &tcp_list.dest_chain[hash]);
+	hash = tcp_out_hash(oldaddr, oldp);
+	hlist_add_head_rcu(&StateContext->out_node, &tcp_list.out_chain[hash]);
+	hash = tcp_in_hash(newport, dstaddr, dstp);
+	hlist_add_head_rcu(&StateContext->in_node, &tcp_list.in_chain[hash]);
+	hash = tcp_dest_hash(dstaddr, dstp);
+	hlist_add_head_rcu(&StateContext->dest_node, &tcp_list.dest_chain[hash]);
 	
 	tcp_list.size++;
 	tcp_list.state_seq = (tcp_list.state_seq >= 2147483647) ? 0 : (tcp_list.state_seq + 1);	
-	if (!multiplexflag) {
-		tcp_list.port_num++;
-		tcp_list.last_alloc_port = newport;
-	}
+	// A port allocated just before ivi_map_tcp_port_setup swapped pools is referenced in the new one
+	if (multiplexflag || pool != tcp_list.ports)
+		ivi_port_get(tcp_list.ports, newport);
 	
 	StateContext->state_seq = tcp_list.state_seq;
 	
@@ -1011,7 +1175,7 @@ static inline int create_tcp_mapping(u32 oldaddr, u16 oldp, u32 dstaddr, u16 dst
 	printk(KERN_INFO "create_tcp_mapping: Add new mapping (" NIP4_FMT \
 		             ":%d -> " NIP4_FMT ":%d -------> %d), list_len = %d, port_num = %d\n", \
 	                 NIP4(oldaddr), oldp, NIP4(dstaddr), dstp, newport, \
-	                 tcp_list.size, tcp_list.port_num);
+	                 tcp_list.size, ivi_port_in_use(tcp_list.ports));
 #endif
 				   
 	spin_unlock_bh(&tcp_list.lock);
@@ -1022,26 +1186,26 @@ static inline int create_tcp_mapping(u32 oldaddr, u16 oldp, u32 dstaddr, u16 dst
 // must be protected by spin lock when calling this function
 static inline int tcp_dest_multiplex_port(u32 dstaddr, u16 dstp)
 {
-	int status, chance, i, rand_j, dsthash, hash, retport;
+	int status, chance, i, rand_j, dsthash, hash, retport, size;
 	PTCP_STATE_CONTEXT iter, multiplex_state;
 	struct hlist_node *loop0, *loop;
 	
 	status = 0;
 	chance = TCP_MAX_LOOP_NUM;
+	size = 1 << tcp_list.htable_bits;
 			
-	dsthash = v4addr_port_hashfn(dstaddr, dstp);		
-	while (1) { // generate an integer between [1, 31]
+	dsthash = tcp_dest_hash(dstaddr, dstp);		
+	while (1) { // generate an integer between [1, size - 1]
 		get_random_bytes(&rand_j, sizeof(int));
-		rand_j = (rand_j >= 0) ? rand_j : -rand_j;
-		rand_j -= (rand_j >> 5) << 5;
+		rand_j &= size - 1;
 		if (rand_j) break;
 	}
 
-	/* hash is a random number between [0,31] except dsthash, so MAYBE its newport can be multiplexed 
+	/* hash is a random number between [0, size - 1] except dsthash, so MAYBE its newport can be multiplexed 
 	   because dest_chain[hash] is impossible to have the same destination with this packet.*/
-	hash = (dsthash + rand_j >= 32) ? (dsthash + rand_j - 32) : (dsthash + rand_j); 
+	hash = (dsthash + rand_j) & (size - 1);
 		
-	for (i = 0; i < 31 && chance > 0; i++) {	
+	for (i = 0; i < IVI_MULTIPLEX_PROBES && chance > 0; i++) {	
 		if (!hlist_empty(&tcp_list.dest_chain[hash])) {
 			hlist_for_each_entry(multiplex_state, loop0, &tcp_list.dest_chain[hash], dest_node) {
 				retport = multiplex_state->newport;
@@ -1074,128 +1238,130 @@ static inline int tcp_dest_multiplex_port(u32 dstaddr, u16 dstp)
 			}
 		}
 		else {
-			if (++hash >= 32)      
-				hash = 0;
-			if (hash == dsthash) {
-				if (++hash >= 32)
-					hash = 0;
-			}
+			hash = (hash + 1) & (size - 1);
+			if (hash == dsthash)
+				hash = (hash + 1) & (size - 1);
 		}
 	}
 	
 	return 0;
 }
 
-int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp, u16 ratio, 
+// Find the mapping of an outflow connection, must be called under rcu_read_lock or with spin lock held
+static PTCP_STATE_CONTEXT tcp_out_lookup(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp)
+{
+	PTCP_STATE_CONTEXT StateContext;
+	struct hlist_node *loop;
+	struct hlist_head *chain;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&tcp_list.htable_seq);
+		chain = &tcp_list.out_chain[tcp_out_hash(oldaddr, oldp)];
+	} while (read_seqcount_retry(&tcp_list.htable_seq, seq));
+
+	hlist_for_each_entry_rcu(StateContext, loop, chain, out_node) {
+		if (StateContext->oldport == oldp && StateContext->oldaddr == oldaddr &&
+		    StateContext->dstaddr == dstaddr && StateContext->dstport == dstp)
+			return StateContext;
+	}
+	return NULL;
+}
+
+// Find the mapping of an inflow connection, must be called under rcu_read_lock or with spin lock held
+static PTCP_STATE_CONTEXT tcp_in_lookup(__be16 newp, __be32 dstaddr, __be16 dstp)
+{
+	PTCP_STATE_CONTEXT StateContext;
+	struct hlist_node *loop;
+	struct hlist_head *chain;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&tcp_list.htable_seq);
+		chain = &tcp_list.in_chain[tcp_in_hash(newp, dstaddr, dstp)];
+	} while (read_seqcount_retry(&tcp_list.htable_seq, seq));
+
+	hlist_for_each_entry_rcu(StateContext, loop, chain, in_node) {
+		if (StateContext->newport == newp && StateContext->dstaddr == dstaddr && StateContext->dstport == dstp)
+			return StateContext;
+	}
+	return NULL;
+}
+
+// Run the TCP state machine on an existing mapping and clean it if required, must be called under rcu_read_lock
+// and MUST NOT acquire spin lock when calling this function
+static FILTER_STATUS update_tcp_mapping(PTCP_STATE_CONTEXT StateContext, struct tcphdr *th, __u32 len, PACKET_DIR dir)
+{
+	FILTER_STATUS ftState;
+
+	spin_lock_bh(&StateContext->lock);
+	if (tcp_light)
+		ftState = UpdateTcpStateLight(th, dir, StateContext);
+	else
+		ftState = UpdateTcpStateContext(th, len, dir, StateContext);
+	if (ftState == FILTER_ACCEPT && dir == PACKET_DIR_LOCAL)
+		StateContext->state_seq = tcp_list.state_seq;
+	spin_unlock_bh(&StateContext->lock);
+
+	if (ftState == FILTER_DROP_CLEAN) {
+		spin_lock_bh(&tcp_list.lock);
+		if (!StateContext->removed)
+			remove_tcp_mapping(StateContext);
+		spin_unlock_bh(&tcp_list.lock);
+	}
+
+	return ftState;
+}
+
+static int __get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp, u16 ratio, 
                              u16 adjacent, u16 offset, struct tcphdr *th, __u32 len, __be16 *newp)
 {	
-	int hash, reusing, status, flag, start_port;
+	int hash, reusing, port, multiplexflag;
 	__be16 retport;
 	PTCP_STATE_CONTEXT StateContext;
-	PTCP_STATE_CONTEXT i0;
-	struct hlist_node *loop, *l0;
-	struct hlist_node *temp;
+	struct hlist_node *loop;
+	struct ivi_port_pool *pool;
 	FILTER_STATUS ftState;
 		
 	retport = 0;
 	*newp = 0;
 	reusing = 0;
-	status = 0;
 	ratio = fls(ratio) - 1;
-	adjacent = fls(adjacent) - 1;
-	start_port = ((1 << (ratio + adjacent)) > 1024) ? 1 << (ratio + adjacent) : 1024; // the ports below start_port are reserved for system ports.
 	
-	refresh_tcp_map_list(0);
+	rcu_read_lock();
+
+	// Established connections are looked up without taking the list lock.
+	StateContext = tcp_out_lookup(oldaddr, oldp, dstaddr, dstp);
+	if (StateContext != NULL)
+		goto found;
+
 	spin_lock_bh(&tcp_list.lock);
 
-	hash = v4addr_port_hashfn(oldaddr, oldp);
-	if (!hlist_empty(&tcp_list.out_chain[hash])) {
-		hlist_for_each_entry_safe(StateContext, loop, temp, &tcp_list.out_chain[hash], out_node) {
-			if (StateContext->oldport == oldp && StateContext->oldaddr == oldaddr) {
-				if (StateContext->dstaddr == dstaddr && StateContext->dstport == dstp) {
-					// Update state context.
-					ftState = UpdateTcpStateContext(th, len, PACKET_DIR_LOCAL, StateContext);
-			
-					if (ftState == FILTER_ACCEPT) {
-						retport = StateContext->newport;
-						StateContext->state_seq = tcp_list.state_seq;
-						
-#ifdef IVI_DEBUG_MAP_TCP
-						//printk(KERN_INFO "get_outflow_tcp_map_port: Found map " NIP4_FMT ":%d -> " 
-						//                 NIP4_FMT ":%d ------> %d on out_chain[%d], TCP state %d\n", 
-						//                 NIP4(oldaddr), oldp, NIP4(dstaddr), dstp, retport, 
-						//                 hash, StateContext->Status);
-#endif
-					}
-					else if (ftState == FILTER_DROP) {
-						// Return -1 to drop current segment, keep the state info.
-#ifdef IVI_DEBUG_MAP_TCP
-						printk(KERN_ERR "get_outflow_tcp_map_port: drop packet on map " NIP4_FMT ":%d -> " 
-						                NIP4_FMT ":%d ------> %d on out_chain[%d], TCP state %d\n", 
-						                NIP4(oldaddr), oldp, NIP4(dstaddr), dstp, StateContext->newport, 
-						                hash, StateContext->Status);
-#endif
-					}
-					else  // FILTER_DROP_CLEAN                         
-					{
-						// Remove state info, return -1
-						hlist_del(&StateContext->out_node);
-						hlist_del(&StateContext->in_node);
-						hlist_del(&StateContext->dest_node);
-						tcp_list.size--;
-						flag = 0; // indicating whether tcp_list.port_num needs to be substracted by 1.
-
-						hlist_for_each_entry(i0, l0, &tcp_list.in_chain[port_hashfn(StateContext->newport)], in_node) {
-							if (i0->newport == StateContext->newport) {
-								flag = 1;
-								
-#ifdef IVI_DEBUG_MAP_TCP
-								printk(KERN_INFO "get_outflow_tcp_map_port: newport %d is still used by someone(" 
-								                 NIP4_FMT ":%d -> " NIP4_FMT ":%d). port_num is still %d\n", 
-								                 StateContext->newport, NIP4(i0->oldaddr), i0->oldport, 
-								                 NIP4(i0->dstaddr), i0->dstport, tcp_list.port_num);
-#endif
-								break;
-							}
-						}
-						if (!flag) {
-							tcp_list.port_num--;
-#ifdef IVI_DEBUG_MAP_TCP
-							printk(KERN_INFO "get_outflow_tcp_map_port: port_num is decreased by 1 to %d(%d)\n", 
-							                 tcp_list.port_num, StateContext->newport);
-#endif
-						}
-						
-                    	kfree(StateContext);
-                    	
-#ifdef IVI_DEBUG_MAP_TCP
-						printk(KERN_ERR "get_outflow_tcp_map_port: clean state on map " NIP4_FMT ":%d -> " NIP4_FMT 
-						                ":%d ------> %d on out_chain[%d], TCP state %d\n", NIP4(oldaddr), oldp, 
-						                NIP4(dstaddr), dstp, retport, hash, StateContext->Status);
-#endif
-               		}
-               		
-               		*newp = retport;
-					spin_unlock_bh(&tcp_list.lock);
-					return (retport == 0 ? -1 : 0);
-               	}
-               	
-               	else if (reusing == 0) {
-               		// src addr&port same, while dest addr&port different: reuse the mapped port (Endpoint-independent)
-               		retport = StateContext->newport;
-               		reusing = 1;
+	hash = tcp_out_hash(oldaddr, oldp);
+	hlist_for_each_entry(StateContext, loop, &tcp_list.out_chain[hash], out_node) {
+		if (StateContext->oldport == oldp && StateContext->oldaddr == oldaddr) {
+			if (StateContext->dstaddr == dstaddr && StateContext->dstport == dstp) {
+				// Missed by the lockless lookup while the tables were being rehashed.
+				spin_unlock_bh(&tcp_list.lock);
+				goto found;
+			}
+			else if (reusing == 0) {
+				// src addr&port same, while dest addr&port different: reuse the mapped port (Endpoint-independent)
+				retport = StateContext->newport;
+				reusing = 1;
 #ifdef IVI_DEBUG_MAP_TCP
-					printk(KERN_INFO "get_outflow_tcp_map_port: port %d can be multiplexed with source address " 
-					                 NIP4_FMT ":%d\n", retport, NIP4(oldaddr), oldp);
+				printk(KERN_INFO "get_outflow_tcp_map_port: port %d can be multiplexed with source address " 
+				                 NIP4_FMT ":%d\n", retport, NIP4(oldaddr), oldp);
 #endif
-				}
-            }
+			}
 		}
 	}
 	
+	rcu_read_unlock();
+	
 	if (reusing == 1 && retport > 0) {
 		spin_unlock_bh(&tcp_list.lock);
-		if (create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, 1) < 0) {
+		if (create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, 1, NULL) < 0) {
 #ifdef IVI_DEBUG_MAP_TCP
 			printk(KERN_ERR "get_outflow_tcp_map_port: create_tcp_mapping when multiplexing1 failed.\n");
 #endif
@@ -1211,7 +1377,7 @@ int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16
 		retport = tcp_dest_multiplex_port(dstaddr, dstp);
 		if (retport > 0) { // multiplex port found
 			spin_unlock_bh(&tcp_list.lock);
-			if (create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, 1) < 0) {
+			if (create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, 1, NULL) < 0) {
 #ifdef IVI_DEBUG_MAP_TCP
 				printk(KERN_ERR "get_outflow_tcp_map_port: create_tcp_mapping when multiplexing2 failed\n");
 #endif
@@ -1221,33 +1387,31 @@ int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16
 			return 0;
 		}
 		else {
+			spin_unlock_bh(&tcp_list.lock);
+
+			// The pool has per-CPU locking of its own, the RCU read side only keeps
+			// ivi_map_tcp_port_setup from freeing it until the mapping is in place.
+			rcu_read_lock();
+			pool = rcu_dereference(tcp_list.ports);
+			
 			// If it's so lucky to reach here, we have to generate a new port
-			if (tcp_list.port_num >= ((65536 - start_port)>>ratio)) {
-				spin_unlock_bh(&tcp_list.lock);
-				printk(KERN_ERR "get_outflow_tcp map_port: tcp map list full, port_num = %d\n", tcp_list.port_num);
-				return -1;
-				
-				/*spin_unlock_bh(&tcp_list.lock);
-				refresh_tcp_map_list(tcp_list.state_seq - (((65536 - 4096) >> ratio)) - 1); // the port whose state_seq is less or equal to this threshold will be recycled
-				spin_lock_bh(&tcp_list.lock);
-				if (tcp_list.port_num >= ((65536 - 4096) >> ratio)) {
-					spin_unlock_bh(&tcp_list.lock);
-					printk(KERN_ERR "get_outflow_tcp map_port: map list is rather full.\n");
-					return -1;
-				}*/
-			}
-					
-			if (ratio == 0)
+			if (ratio == 0) {
 				retport = oldp; // In 1:1 mapping mode, use old port directly.
-			
-			else if ((retport = new_tcp_map_port(ratio, adjacent, offset, start_port)) < 0) {
-				spin_unlock_bh(&tcp_list.lock);
-				printk(KERN_ERR "get_outflow_tcp_map_port: failed to assign a new map port.\n");
+				multiplexflag = 1; // not allocated from the pool, the mapping takes its own reference
+			}
+			else if ((port = ivi_port_alloc(pool)) < 0) {
+				rcu_read_unlock();
+				printk(KERN_ERR "get_outflow_tcp map_port: tcp map list full, port_num = %d\n", ivi_port_in_use(pool));
 				return -1;
 			}
+			else {
+				retport = port;
+				multiplexflag = 0;
+			}
 			
-			spin_unlock_bh(&tcp_list.lock);
-			if (create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, 0) < 0) {
+			port = create_tcp_mapping(oldaddr, oldp, dstaddr, dstp, retport, th, len, multiplexflag, pool);
+			rcu_read_unlock();
+			if (port < 0) {
 #ifdef IVI_DEBUG_MAP_TCP
 				printk(KERN_ERR "get_outflow_tcp_map_port: create_tcp_mapping failed.\n");
 #endif
@@ -1257,112 +1421,305 @@ int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16
 			return 0;
 		}
 	}
+
+found:
+	ftState = update_tcp_mapping(StateContext, th, len, PACKET_DIR_LOCAL);
+	if (ftState == FILTER_ACCEPT) {
+		retport = StateContext->newport;
+		
+#ifdef IVI_DEBUG_MAP_TCP
+		//printk(KERN_INFO "get_outflow_tcp_map_port: Found map " NIP4_FMT ":%d -> " 
+		//                 NIP4_FMT ":%d ------> %d, TCP state %d\n", 
+		//                 NIP4(oldaddr), oldp, NIP4(dstaddr), dstp, retport, 
+		//                 StateContext->Status);
+#endif
+	}
+	else if (ftState == FILTER_DROP) {
+		// Return -1 to drop current segment, keep the state info.
+#ifdef IVI_DEBUG_MAP_TCP
+		printk(KERN_ERR "get_outflow_tcp_map_port: drop packet on map " NIP4_FMT ":%d -> " 
+		                NIP4_FMT ":%d ------> %d, TCP state %d\n", 
+		                NIP4(oldaddr), oldp, NIP4(dstaddr), dstp, StateContext->newport, 
+		                StateContext->Status);
+#endif
+	}
+	else { // FILTER_DROP_CLEAN: state info has been removed, return -1
+#ifdef IVI_DEBUG_MAP_TCP
+		printk(KERN_ERR "get_outflow_tcp_map_port: clean state on map " NIP4_FMT ":%d -> " NIP4_FMT 
+		                ":%d ------> %d, TCP state %d\n", NIP4(oldaddr), oldp, 
+		                NIP4(dstaddr), dstp, StateContext->newport, StateContext->Status);
+#endif
+	}
+	rcu_read_unlock();
+	
+	*newp = retport;
+	return (retport == 0 ? -1 : 0);
 }
 
-int get_inflow_tcp_map_port(__be16 newp, __be32 dstaddr,  __be16 dstp, struct tcphdr *th, __u32 len, __be32 *oldaddr, __be16 *oldp)
+int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp, u16 ratio, 
+                             u16 adjacent, u16 offset, struct tcphdr *th, __u32 len, __be16 *newp)
+{
+	u64 start;
+	int ret;
+
+	trace_ivi_session_lookup_enter(IPPROTO_TCP, 0, oldaddr, oldp);
+	start = ivi_lat_begin();
+	ret = __get_outflow_tcp_map_port(oldaddr, oldp, dstaddr, dstp, ratio, adjacent, offset, th, len, newp);
+	ivi_lat_end(IVI_LAT_SESSION_TCP, start);
+	trace_ivi_session_lookup_exit(IPPROTO_TCP, 0, oldaddr, oldp, ret);
+	return ret;
+}
+
+// Tell whether an outflow connection is already mapped, without creating anything or running the state machine
+int ivi_map_tcp_established(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = (tcp_out_lookup(oldaddr, oldp, dstaddr, dstp) != NULL);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Get the cached translation of an established outflow connection and keep its mapping
+ * alive, return NULL when the segment has to go through get_outflow_tcp_map_port().
+ * Must be called under rcu_read_lock, the flow is valid until rcu_read_unlock.
+ */
+struct tcp_flow *ivi_map_tcp_flow_get(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp)
+{
+	struct tcp_flow *flow;
+	PTCP_STATE_CONTEXT StateContext;
+	u32 now;
+
+	if (!tcp_flow_chain || !(flow = tcp_flow_lookup(oldaddr, oldp, dstaddr, dstp)))
+		return NULL;
+
+	// The state machine left ESTABLISHED on a segment of the slow path, the flow goes with the mapping
+	StateContext = flow->session;
+	if (StateContext->removed || StateContext->Status != TCP_STATUS_ESTABLISHED)
+		return NULL;
+
+	// Same as UpdateTcpStateLight() on an unchanged state, a racing writer only moves the time
+	now = get_seconds();
+	if (StateContext->StateSetTime != now)
+		StateContext->StateSetTime = now;
+	return flow;
+}
+
+// Cache the translation of an outflow connection if its mapping is established and has none yet
+void ivi_map_tcp_flow_learn(const struct tcp_flow *flow)
+{
+	PTCP_STATE_CONTEXT StateContext;
+	struct tcp_flow *newflow;
+
+	if (!tcp_flow_chain)
+		return;
+
+	// Most segments of the slow path belong to mappings that cannot or need not be cached
+	rcu_read_lock();
+	StateContext = tcp_out_lookup(flow->oldaddr, flow->oldport, flow->dstaddr, flow->dstport);
+	if (!StateContext || StateContext->Status != TCP_STATUS_ESTABLISHED || StateContext->flow) {
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
+
+	if (!(newflow = kmalloc(sizeof(struct tcp_flow), GFP_ATOMIC)))
+		return;
+	memcpy(newflow, flow, sizeof(struct tcp_flow));
+
+	// The template must not predate the last configuration change, whose flush it may have missed
+	spin_lock_bh(&tcp_list.lock);
+	StateContext = tcp_out_lookup(flow->oldaddr, flow->oldport, flow->dstaddr, flow->dstport);
+	if (flow->tmpl.gen != ivi_xlate_gen || \
+	    !StateContext || StateContext->Status != TCP_STATUS_ESTABLISHED || StateContext->flow) {
+		spin_unlock_bh(&tcp_list.lock);
+		kfree(newflow);
+		return;
+	}
+	newflow->session = StateContext;
+	StateContext->flow = newflow;
+	hlist_add_head_rcu(&newflow->node, &tcp_flow_chain[tcp_flow_hash(flow->oldaddr, flow->oldport, \
+	                                                                 flow->dstaddr, flow->dstport)]);
+	tcp_flow_num++;
+	spin_unlock_bh(&tcp_list.lock);
+}
+
+// Drop all cached translations, e.g. when the rules or the prefixes they were computed from change
+void ivi_map_tcp_flow_flush(void)
+{
+	struct tcp_flow *flow;
+	struct hlist_node *loop;
+	struct hlist_node *temp;
+	unsigned int i;
+
+	if (!tcp_flow_chain)
+		return;
+
+	spin_lock_bh(&tcp_list.lock);
+	for (i = 0; i < (1U << tcp_flow_bits); i++) {
+		hlist_for_each_entry_safe(flow, loop, temp, &tcp_flow_chain[i], node)
+			remove_tcp_flow(flow->session);
+	}
+	spin_unlock_bh(&tcp_list.lock);
+}
+
+// Number of established connections translated from the flow cache
+int ivi_map_tcp_flow_count(void)
+{
+	return tcp_flow_num;
+}
+
+static int __get_inflow_tcp_map_port(__be16 newp, __be32 dstaddr,  __be16 dstp, struct tcphdr *th, __u32 len, __be32 *oldaddr, __be16 *oldp)
 {
 	FILTER_STATUS ftState;
-	PTCP_STATE_CONTEXT  StateContext = NULL, i0;
-	struct hlist_node  *loop, *l0;
-	struct hlist_node  *temp;
-	int ret, hash, flag;
+	PTCP_STATE_CONTEXT StateContext;
+	int ret;
 	
-	refresh_tcp_map_list(0);
-	spin_lock_bh(&tcp_list.lock);
-	ret = 1;
+	ret = -1;
 	*oldp = 0;
 	*oldaddr = 0;
 	
-	hash = port_hashfn(newp);
-	hlist_for_each_entry_safe(StateContext, loop, temp, &tcp_list.in_chain[hash], in_node) {
-		// Found existing mapping info
-		if (StateContext->newport == newp && StateContext->dstaddr == dstaddr && StateContext->dstport == dstp)
-		{
-			*oldaddr = StateContext->oldaddr;
-			*oldp = StateContext->oldport;
-			
-			// Update state context.
-			ftState = UpdateTcpStateContext(th, len, PACKET_DIR_REMOTE, StateContext);
+	rcu_read_lock();
+
+	// Established connections are looked up without taking the list lock.
+	StateContext = tcp_in_lookup(newp, dstaddr, dstp);
+	if (StateContext == NULL) {
+		// Missed by the lockless lookup, either no mapping or the tables were being rehashed.
+		spin_lock_bh(&tcp_list.lock);
+		StateContext = tcp_in_lookup(newp, dstaddr, dstp);
+		spin_unlock_bh(&tcp_list.lock);
+	}
 
-			if (ftState == FILTER_ACCEPT) {
-				ret = 0;
-				
+	if (StateContext == NULL) { // fail to find a mapping either in tcp_list.
+		rcu_read_unlock();
 #ifdef IVI_DEBUG_MAP_TCP
-				printk(KERN_INFO "get_inflow_tcp_map_port: Found map " NIP4_FMT ":%d -> " NIP4_FMT ":%d -----> %d "
-				                 "on in_chain[%d], TCP state %d\n", NIP4(*oldaddr), *oldp, NIP4(dstaddr), dstp, newp, 
-				                 hash, StateContext->Status);
+		printk(KERN_INFO "get_inflow_tcp_map_port: no mapping for port %d.\n", newp);
 #endif
+		return -1;
+	}
 
-			}
-			else if (ftState == FILTER_DROP) { 
-				ret = -1; // FILTER_DROP: drop current segment, keep the state info.
-				
-#ifdef IVI_DEBUG_MAP_TCP
-				printk(KERN_INFO "get_inflow_tcp_map_port: Invalid packet on map " NIP4_FMT ":%d -> " 
-				                 NIP4_FMT ":%d -----> %d on in_chain[%d], TCP state %d\n", 
-				                 NIP4(StateContext->oldaddr), StateContext->oldport, NIP4(dstaddr), dstp, newp, 
-				                 hash, StateContext->Status);
-#endif
+	*oldaddr = StateContext->oldaddr;
+	*oldp = StateContext->oldport;
+	
+	// Update state context.
+	ftState = update_tcp_mapping(StateContext, th, len, PACKET_DIR_REMOTE);
 
-			}
-			else  // FILTER_DROP_CLEAN: drop current segment, and clean the state info
-			{
-				// Remove state info, return -1
-				hlist_del(&StateContext->out_node);
-				hlist_del(&StateContext->in_node);
-				hlist_del(&StateContext->dest_node);
-				tcp_list.size--;
-				
-				flag = 0; // indicating whether tcp_list.port_num needs to be substracted by 1.
- 				hlist_for_each_entry(i0, l0, &tcp_list.in_chain[port_hashfn(StateContext->newport)], in_node) {
- 					if (i0->newport == StateContext->newport) {
- 						flag = 1;
- 						
-#ifdef IVI_DEBUG_MAP_TCP
- 						printk(KERN_INFO "get_inflow_tcp_map_port: newport %d is still used by someone(" NIP4_FMT ":%d -> " 
- 						                 NIP4_FMT ":%d). port_num is still %d\n", StateContext->newport, 
- 						                 NIP4(i0->oldaddr), i0->oldport, NIP4(i0->dstaddr), i0->dstport, tcp_list.port_num);
-#endif
- 						break;
- 					}
- 				}
- 				if (!flag) {
- 					tcp_list.port_num--;
- 					
+	if (ftState == FILTER_ACCEPT) {
+		ret = 0;
+		
 #ifdef IVI_DEBUG_MAP_TCP
- 					printk(KERN_INFO "get_inflow_tcp_map_port: port_num is decreased by 1 to %d\n", tcp_list.port_num);
+		printk(KERN_INFO "get_inflow_tcp_map_port: Found map " NIP4_FMT ":%d -> " NIP4_FMT ":%d -----> %d, "
+		                 "TCP state %d\n", NIP4(*oldaddr), *oldp, NIP4(dstaddr), dstp, newp, 
+		                 StateContext->Status);
 #endif
 
- 				}
-				kfree(StateContext);
-				ret = -1;
-				
+	}
+	else if (ftState == FILTER_DROP) { 
+		// FILTER_DROP: drop current segment, keep the state info.
 #ifdef IVI_DEBUG_MAP_TCP
-				printk(KERN_ERR "get_inflow_tcp_map_port: clean state on map " NIP4_FMT ":%d -> " NIP4_FMT 
-				                ":%d -----> %d on in_chain[%d], TCP state %d\n", NIP4(StateContext->oldaddr), 
-				                StateContext->oldport, NIP4(dstaddr), dstp, newp, hash, StateContext->Status);
+		printk(KERN_INFO "get_inflow_tcp_map_port: Invalid packet on map " NIP4_FMT ":%d -> " 
+		                 NIP4_FMT ":%d -----> %d, TCP state %d\n", 
+		                 NIP4(StateContext->oldaddr), StateContext->oldport, NIP4(dstaddr), dstp, newp, 
+		                 StateContext->Status);
 #endif
-			}
 
-			break;
-		}
 	}
-	
-	if (ret == 1) {	// fail to find a mapping either in tcp_list.
+	else { // FILTER_DROP_CLEAN: drop current segment, the state info has been cleaned
 #ifdef IVI_DEBUG_MAP_TCP
-		printk(KERN_INFO "get_inflow_tcp_map_port: in_chain[%d] empty.\n", hash);
+		printk(KERN_ERR "get_inflow_tcp_map_port: clean state on map " NIP4_FMT ":%d -> " NIP4_FMT 
+		                ":%d -----> %d, TCP state %d\n", NIP4(StateContext->oldaddr), 
+		                StateContext->oldport, NIP4(dstaddr), dstp, newp, StateContext->Status);
 #endif
-		
-		ret = -1;
 	}
 
-	spin_unlock_bh(&tcp_list.lock);
+	rcu_read_unlock();
+	return ret;
+}
+
+int get_inflow_tcp_map_port(__be16 newp, __be32 dstaddr,  __be16 dstp, struct tcphdr *th, __u32 len, __be32 *oldaddr, __be16 *oldp)
+{
+	u64 start;
+	int ret;
+
+	trace_ivi_session_lookup_enter(IPPROTO_TCP, 1, dstaddr, newp);
+	start = ivi_lat_begin();
+	ret = __get_inflow_tcp_map_port(newp, dstaddr, dstp, th, len, oldaddr, oldp);
+	ivi_lat_end(IVI_LAT_SESSION_TCP, start);
+	trace_ivi_session_lookup_exit(IPPROTO_TCP, 1, dstaddr, newp, ret);
 	return ret;
 }
 
 
+// Rebuild the TCP port pool for the local PSID, ratio and adjacent are given as powers of 2
+// the ports of existing mappings stay referenced
+int ivi_map_tcp_port_setup(u16 ratio, u16 adjacent, u16 offset)
+{
+	struct ivi_port_pool *pool, *old;
+	PTCP_STATE_CONTEXT iter;
+	struct hlist_node *loop;
+	int i, retval;
+
+	if ((pool = (struct ivi_port_pool *)kmalloc(sizeof(struct ivi_port_pool), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if ((retval = ivi_port_pool_init(pool, ratio, adjacent, offset)) < 0) {
+		kfree(pool);
+		return retval;
+	}
+
+	spin_lock_bh(&tcp_list.lock);
+	for (i = 0; i < (1 << tcp_list.htable_bits); i++) {
+		hlist_for_each_entry(iter, loop, &tcp_list.out_chain[i], out_node) {
+			ivi_port_get(pool, iter->newport);
+		}
+	}
+	ivi_port_pool_fill(pool);
+	old = tcp_list.ports;
+	rcu_assign_pointer(tcp_list.ports, pool);
+	spin_unlock_bh(&tcp_list.lock);
+
+	// Ports are allocated outside the list lock, wait for those still taken from the old pool
+	synchronize_rcu();
+	ivi_port_pool_release(old);
+	kfree(old);
+	return 0;
+}
+
+// Set the number of buckets of TCP tables, the tables may still grow beyond it under load
+int ivi_map_tcp_set_htable_size(unsigned int size)
+{
+	unsigned int bits = ivi_htable_bits(size);
+
+	tcp_list.htable_min_bits = bits;
+	return rehash_tcp_map_list(bits);
+}
+
 int ivi_map_tcp_init(void) {
-	init_tcp_map_list();
+	int retval;
+
+	if (flow_cache && !tcp_light) {
+		printk(KERN_WARNING "IVI: flow_cache needs tcp_light, flow cache disabled.\n");
+		flow_cache = 0;
+	}
+
+	if ((retval = ivi_session_cache_create("ivi_tcp_state", tcp_light ? TCP_LIGHT_STATE_SIZE : sizeof(TCP_STATE_CONTEXT), 
+	                                       &tcp_state_cache, &tcp_state_pool)) < 0)
+		return retval;
+	if ((retval = init_tcp_map_list()) < 0) {
+		ivi_session_cache_destroy(tcp_state_cache, tcp_state_pool);
+		return retval;
+	}
+	if (flow_cache) {
+		tcp_flow_bits = tcp_list.htable_bits;
+		get_random_bytes(&tcp_flow_seed, sizeof(u32));
+		tcp_flow_num = 0;
+		if (!(tcp_flow_chain = ivi_htable_alloc(tcp_flow_bits))) {
+			printk(KERN_WARNING "IVI: failed to allocate the flow table, flow cache disabled.\n");
+			flow_cache = 0;
+		}
+	}
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_map_tcp loaded.\n");
 #endif 
@@ -1370,7 +1727,17 @@ int ivi_map_tcp_init(void) {
 }
 
 void ivi_map_tcp_exit(void) {
+	cancel_delayed_work_sync(&tcp_list.gc_work);
 	free_tcp_map_list();
+	ivi_htable_free(tcp_list.out_chain, tcp_list.htable_bits);
+	ivi_htable_free(tcp_list.in_chain, tcp_list.htable_bits);
+	ivi_htable_free(tcp_list.dest_chain, tcp_list.htable_bits);
+	ivi_port_pool_release(tcp_list.ports);
+	kfree(tcp_list.ports);
+	rcu_barrier(); // wait for tcp_state_free_rcu before destroying the cache
+	ivi_session_cache_destroy(tcp_state_cache, tcp_state_pool);
+	ivi_htable_free(tcp_flow_chain, tcp_flow_bits);
+	tcp_flow_chain = NULL;
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_map_tcp unloaded.\n");
 #endif
@@ -42,6 +42,9 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include <linux/types.h>
 #include <linux/tcp.h>
 #include <asm/unaligned.h>
@@ -49,18 +52,24 @@
 //#include "a.h"
 
 #include "ivi_config.h"
+#include "ivi_port.h"
 #include "ivi_map.h"
 
 /* map list structure */
 struct tcp_map_list {
-	spinlock_t lock;
-	struct     hlist_head out_chain[IVI_HTABLE_SIZE];   // Map table from oldport to newport
-	struct     hlist_head in_chain[IVI_HTABLE_SIZE];    // Map table from newport to oldport
-	struct     hlist_head dest_chain[IVI_HTABLE_SIZE];   // Map table with destination and newport
+	spinlock_t lock;                                     // Writer lock, lookups of existing mappings run under RCU
+	seqcount_t htable_seq;                               // Bumped while the tables are being rehashed
+	struct     hlist_head *out_chain;                    // Map table from oldport to newport
+	struct     hlist_head *in_chain;                     // Map table from newport to oldport
+	struct     hlist_head *dest_chain;                   // Map table with destination and newport
+	unsigned int htable_bits;                            // Each table above has (1 << htable_bits) buckets
+	unsigned int htable_min_bits;                        // The tables never shrink below this size
+	u32        hash_seed;                                // Random seed of the hash functions
 	int        size;                                     // Number of mappings in the list
-	int        port_num;                                 // Number of MAP ports allocated in the map list
+	struct     ivi_port_pool *ports;                     // MAP ports of the local PSID, ivi_port_in_use() is the number of ports allocated
 	int        state_seq;                                // Sequence number of the mapping(never decreased)                                  
-	__be16     last_alloc_port;                         // Save the last allocated port number
+	struct     delayed_work gc_work;                     // Collect timed-out mappings and resize the tables off the packet path
+	int        gc_bucket;                                // Next out_chain bucket to be swept by gc_work
 };
 
 // Packet flow direction
@@ -94,25 +103,36 @@ typedef struct _TCP_STATE_INFO {
 	u_int8_t   Options;
 } TCP_STATE_INFO, *PTCP_STATE_INFO;
 
+struct tcp_flow;
+
 typedef struct _TCP_STATE_CONTEXT {
+	// The first cache line (64 bytes on 64 bit without lock debugging) holds all that a segment
+	// of an established flow reads or writes in light mode: the lookup keys and the state.
 	struct hlist_node out_node;  // Inserted to out_chain
 	struct hlist_node in_node;   // Inserted to in_chain
-	struct hlist_node dest_node;   // Inserted to dest_chain
-	
-	int state_seq;
-	
+
 	// Indexes pointing back to port hash table
 	__be32            oldaddr;
-	__be16            oldport;
 	__be32            dstaddr;
+	__be16            oldport;
 	__be16            dstport;
 	__be16            newport;
 
+	spinlock_t        lock;        // Protects the TCP state info below
+	int state_seq;
+
 	// TCP state info
-	TCP_STATE_INFO    Seen[PACKET_DIR_MAX];     // Seen[0] for local state, Seen[1] for remote state
-	struct timeval    StateSetTime;    // The time when the current state is set
-	unsigned int      StateTimeOut;    // Timeout value for the current state
 	TCP_STATUS        Status;
+	u32               StateSetTime;    // The time when the current state is set, get_seconds()
+
+	unsigned int      StateTimeOut;    // Timeout value for the current state, only written on changes
+	struct hlist_node dest_node;   // Inserted to dest_chain
+	struct rcu_head   rcu;         // Freed after a grace period, lookups may still hold it
+	int               removed;     // Unlinked from the chains, protected by tcp_list.lock
+	struct tcp_flow  *flow;        // Cached translation once established, protected by tcp_list.lock
+
+	// Sequence and window tracking, not allocated in light mode (see TCP_LIGHT_STATE_SIZE)
+	TCP_STATE_INFO    Seen[PACKET_DIR_MAX];     // Seen[0] for local state, Seen[1] for remote state
 	// For detecting retransmitted packets
 	PACKET_DIR        LastDir;
 	u_int8_t          RetransCount;
@@ -123,21 +143,54 @@ typedef struct _TCP_STATE_CONTEXT {
 	u_int32_t         LastEnd;
 } TCP_STATE_CONTEXT, *PTCP_STATE_CONTEXT;
 
+// Light tracking (module parameter 'tcp_light') only runs tcp_state_table and never touches
+// the fields from Seen on, which are left out of the sessions allocated by the slab cache:
+// a session takes two cache lines instead of three.
+#define TCP_LIGHT_STATE_SIZE	offsetof(TCP_STATE_CONTEXT, Seen)
+
+/* Translation of an established outflow connection, looked up by the whole 4-tuple before
+ * the session tables. Later segments are rewritten from here without running the state
+ * machine, taking any lock or looking up the rules (module parameter 'flow_cache'). */
+struct tcp_flow {
+	struct hlist_node node;      // Inserted to the flow table, protected by tcp_list.lock
+	__be32            oldaddr;   // Keys of the mapping, in the same byte order
+	__be32            dstaddr;
+	__be16            oldport;
+	__be16            dstport;
+	__be16            newport;   // Source port and address after NAT44
+	__be32            newaddr;
+	struct ivi_xlate_tmpl tmpl;  // IPv6 side of the translation
+	PTCP_STATE_CONTEXT session;  // Freed along with the flow
+	struct rcu_head   rcu;
+};
+
 extern struct tcp_map_list tcp_list;
+extern bool tcp_light;
+extern bool flow_cache;
 extern struct hlist_node *pf_state;
 extern struct hlist_node *tcp_state;
 
-extern void init_tcp_map_list(void);
+extern int init_tcp_map_list(void);
 
 extern void refresh_tcp_map_list(int);
 
 extern void free_tcp_map_list(void);
 
+extern int ivi_map_tcp_set_htable_size(unsigned int size);
+extern int ivi_map_tcp_port_setup(u16 ratio, u16 adjacent, u16 offset);
+
 extern int port_reserve(__be16);
 
 /* mapping operations */
 extern int get_outflow_tcp_map_port(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp, u16 ratio, u16 adjacent, u16 offset, struct tcphdr *th, __u32 len, __be16 *newp);
 extern int get_inflow_tcp_map_port(__be16 newp, __be32 dstaddr, __be16 dstp, struct tcphdr *th, __u32 len, __be32 *oldaddr, __be16 *oldp);
+extern int ivi_map_tcp_established(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp);
+
+/* flow cache operations */
+extern struct tcp_flow *ivi_map_tcp_flow_get(__be32 oldaddr, __be16 oldp, __be32 dstaddr, __be16 dstp);
+extern void ivi_map_tcp_flow_learn(const struct tcp_flow *flow);
+extern void ivi_map_tcp_flow_flush(void);
+extern int ivi_map_tcp_flow_count(void);
 
 extern int ivi_map_tcp_init(void);
 extern void ivi_map_tcp_exit(void);
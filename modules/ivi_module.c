@@ -39,6 +39,8 @@
 #include "ivi_rule6.h"
 #include "ivi_map.h"
 #include "ivi_map_tcp.h"
+#include "ivi_stats.h"
+#include "ivi_trace.h"
 #include "ivi_nf.h"
 #include "ivi_ioctl.h"
 
@@ -56,6 +58,15 @@ static int __init ivi_module_init(void) {
 	if ((retval = ivi_map_tcp_init()) < 0) {
 		return retval;
 	}
+	if ((retval = ivi_xmit_init()) < 0) {
+		return retval;
+	}
+	if ((retval = ivi_stats_init()) < 0) {
+		return retval;
+	}
+	if ((retval = ivi_trace_init()) < 0) {
+		return retval;
+	}
 	if ((retval = ivi_nf_init()) < 0) {
 		return retval;
 	}
@@ -69,6 +80,9 @@ module_init(ivi_module_init);
 static void __exit ivi_module_exit(void) {
 	ivi_ioctl_exit();
 	ivi_nf_exit();
+	ivi_trace_exit();
+	ivi_stats_exit();
+	ivi_xmit_exit();
 	ivi_map_tcp_exit();
 	ivi_map_exit();
 	ivi_rule6_exit();
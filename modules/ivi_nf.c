@@ -39,6 +39,113 @@ struct net_device *v4_dev, *v6_dev;
 
 static int running;
 
+/* Translate established sessions from an rx_handler on the ingress devices, ahead of
+ * the IP layer and netfilter. Whatever the fast path declines still takes the hooks. */
+static bool rx_fastpath = false;
+module_param(rx_fastpath, bool, 0444);
+MODULE_PARM_DESC(rx_fastpath, "Translate established flows from an rx_handler before the IP layer");
+
+static struct net_device *v4_rx, *v6_rx;
+
+/* Leave the sessions to nf_conntrack: nf_nat maps the source of outbound IPv4 flows to
+ * ports of the local PSID and reverts the replies once they are back in IPv4, so the
+ * translator itself keeps no state. Needs a nat table (iptable_nat) to be loaded. */
+bool nat_conntrack = false;
+module_param(nat_conntrack, bool, 0444);
+MODULE_PARM_DESC(nat_conntrack, "Let nf_conntrack and nf_nat map the ports of the local PSID instead of the session tables");
+
+static u32 nat_seed;
+
+/*
+ * Bind the source of a new outbound flow, to v4publicaddr in NAT44 mode and to a port of
+ * the local PSID that no other conntrack entry uses towards the same destination. The
+ * PSID owns blocks of hgw_adjacent contiguous ports every (hgw_ratio * hgw_adjacent)
+ * ports, above the system ports as in ivi_port_pool_init(). nf_nat only takes a single
+ * range, so we look for a free port ourselves, from a hash of the flow, and pass it on.
+ */
+static unsigned int ivi_nf_nat_bind(struct nf_conn *ct) {
+	struct nf_conntrack_tuple tuple = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	struct nf_nat_range range;
+	unsigned int ratio, adjacent, start_port, low, high, size, index, i;
+	u16 port;
+
+	memset(&range, 0, sizeof(range));
+	if (ivi_mode == IVI_MODE_HGW_NAT44) {
+		range.flags |= NF_NAT_RANGE_MAP_IPS;
+		range.min_addr.ip = range.max_addr.ip = htonl(v4publicaddr);
+		tuple.src.u3.ip = htonl(v4publicaddr);
+	}
+
+	switch (tuple.dst.protonum) {
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+			if (ivi_mode == IVI_MODE_HGW && ntohs(tuple.src.u.all) < 1024)
+				return nf_nat_setup_info(ct, &range, NF_NAT_MANIP_SRC);
+			break;
+		case IPPROTO_ICMP:
+			if (tuple.dst.u.icmp.type == ICMP_ECHO)
+				break;
+			// fall through, only echo identifiers are mapped
+		default:
+			return nf_nat_setup_info(ct, &range, NF_NAT_MANIP_SRC);
+	}
+
+	ratio = fls(hgw_ratio) - 1;
+	adjacent = fls(hgw_adjacent) - 1;
+	if (ratio + adjacent > 16 || hgw_offset >= (1 << ratio))
+		return NF_DROP;
+	start_port = ((1 << (ratio + adjacent)) > 1024) ? 1 << (ratio + adjacent) : 1024;
+	low = ((start_port - 1) >> (ratio + adjacent)) + 1;
+	high = (65536 >> (ratio + adjacent)) - 1;
+	if (high < low)
+		return NF_DROP;
+	size = (high - low + 1) << adjacent;
+
+	index = jhash_3words(tuple.src.u3.ip, tuple.dst.u3.ip, \
+	                     ((u32)tuple.src.u.all << 16) | tuple.dst.u.all, nat_seed) % size;
+	for (i = 0; i < min_t(unsigned int, size, IVI_NAT_PROBES); i++, index = (index + 1) % size) {
+		port = (((index >> adjacent) + low) << (ratio + adjacent)) + (hgw_offset << adjacent) + \
+		       (index & ((1 << adjacent) - 1));
+		tuple.src.u.all = htons(port);
+		if (!nf_nat_used_tuple(&tuple, ct)) {
+			range.flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+			range.min_proto.all = range.max_proto.all = htons(port);
+			return nf_nat_setup_info(ct, &range, NF_NAT_MANIP_SRC);
+		}
+	}
+
+	IVI_STATS_INC(IVI_STAT_PORT_FULL);
+	return NF_DROP;
+}
+
+/*
+ * Source NAT of an IPv4 packet about to be translated, in place of the session tables.
+ * The packet leaves IPv4 before it reaches POSTROUTING, so the source manipulation is
+ * applied and the conntrack entry confirmed here. Returns -1 if the packet has to be
+ * dropped, the headers may have moved otherwise.
+ */
+int ivi_nf_nat_out(struct sk_buff *skb) {
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct || nf_ct_is_untracked(ct))
+		return -1;
+
+	if (!nf_ct_is_confirmed(ct) && !nf_nat_initialized(ct, NF_NAT_MANIP_SRC)) {
+		if (ivi_nf_nat_bind(ct) != NF_ACCEPT)
+			return -1;
+	}
+
+	if (nf_nat_packet(ct, ctinfo, NF_INET_POST_ROUTING, skb) != NF_ACCEPT)
+		return -1;
+
+	if (nf_conntrack_confirm(skb) != NF_ACCEPT)
+		return -1;
+
+	return 0;
+}
+
 unsigned int nf_hook4(unsigned int hooknum, struct sk_buff *skb,
 		const struct net_device *in, const struct net_device *out,
 		int (*okfn)(struct sk_buff *)) {
@@ -47,11 +154,13 @@ unsigned int nf_hook4(unsigned int hooknum, struct sk_buff *skb,
 		return NF_ACCEPT;
 	}
 
-	if (ivi_v4v6_xmit(skb) == 0) {
-		return NF_DROP;
-	}
-	else {
-		return NF_ACCEPT;
+	switch (ivi_v4v6_xmit(skb)) {
+		case 0:
+			return NF_DROP;
+		case IVI_XMIT_STOLEN:
+			return NF_STOLEN;
+		default:
+			return NF_ACCEPT;
 	}
 }
 
@@ -63,12 +172,78 @@ unsigned int nf_hook6(unsigned int hooknum, struct sk_buff *skb,
 		return NF_ACCEPT;
 	}
 
-	if (ivi_v6v4_xmit(skb) == 0) {
-		return NF_DROP;
+	switch (ivi_v6v4_xmit(skb)) {
+		case 0:
+			return NF_DROP;
+		case IVI_XMIT_STOLEN:
+			return NF_STOLEN;
+		default:
+			return NF_ACCEPT;
 	}
-	else {
-		return NF_ACCEPT;
+}
+
+static rx_handler_result_t ivi_rx_handler(struct sk_buff **pskb) {
+	struct sk_buff *skb = *pskb;
+	int ret;
+
+	if (!running)
+		return RX_HANDLER_PASS;
+
+	if (!(skb = skb_share_check(skb, GFP_ATOMIC)))
+		return RX_HANDLER_CONSUMED;
+	*pskb = skb;
+
+	if (skb->protocol == htons(ETH_P_IP) && skb->dev == v4_dev)
+		ret = ivi_v4v6_fastpath(skb);
+	else if (skb->protocol == htons(ETH_P_IPV6) && skb->dev == v6_dev)
+		ret = ivi_v6v4_fastpath(skb);
+	else
+		return RX_HANDLER_PASS;
+
+	switch (ret) {
+		case 0:
+			IVI_STATS_INC(IVI_STAT_RX_FAST);
+			kfree_skb(skb);
+			return RX_HANDLER_CONSUMED;
+		case IVI_XMIT_STOLEN:
+			IVI_STATS_INC(IVI_STAT_RX_FAST);
+			return RX_HANDLER_CONSUMED;
+		default:
+			return RX_HANDLER_PASS;
+	}
+}
+
+static struct net_device *ivi_rx_attach_dev(struct net_device *dev) {
+	int err;
+
+	if (!dev)
+		return NULL;
+
+	if ((err = netdev_rx_handler_register(dev, ivi_rx_handler, NULL)) != 0) {
+		// Bridge, bonding and macvlan ports already own the handler, fall back to netfilter
+		printk(KERN_INFO "IVI: rx fast path unavailable on %s (%d), using netfilter only.\n", dev->name, err);
+		return NULL;
 	}
+	return dev;
+}
+
+static void ivi_rx_attach(void) {
+	rtnl_lock();
+	if (!v4_rx)
+		v4_rx = ivi_rx_attach_dev(v4_dev);
+	if (!v6_rx && v6_dev != v4_dev)
+		v6_rx = ivi_rx_attach_dev(v6_dev);
+	rtnl_unlock();
+}
+
+static void ivi_rx_detach(void) {
+	rtnl_lock();
+	if (v4_rx)
+		netdev_rx_handler_unregister(v4_rx);
+	if (v6_rx)
+		netdev_rx_handler_unregister(v6_rx);
+	v4_rx = v6_rx = NULL;
+	rtnl_unlock();
 }
 
 struct nf_hook_ops v4_ops = {
@@ -91,6 +266,13 @@ struct nf_hook_ops v6_ops = {
 
 int nf_running(const int run) {
 	running = run;
+	// Sessions live in conntrack then, the rx_handler would have none to look up
+	if (rx_fastpath && !nat_conntrack) {
+		if (run)
+			ivi_rx_attach();
+		else
+			ivi_rx_detach();
+	}
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "nf_running: set running state to %d.\n", running);
 #endif
@@ -111,6 +293,13 @@ int ivi_nf_init(void) {
 	running = 0;
 	v4_dev = NULL;
 	v6_dev = NULL;
+	v4_rx = v6_rx = NULL;
+
+	// The IPv4 hook has to see the conntrack entry of the packet
+	if (nat_conntrack) {
+		v4_ops.priority = NF_IP_PRI_CONNTRACK + 1;
+		get_random_bytes(&nat_seed, sizeof(u32));
+	}
 
 	nf_register_hook(&v4_ops);
 	nf_register_hook(&v6_ops);
@@ -126,6 +315,8 @@ void ivi_nf_exit(void) {
 
 	nf_unregister_hook(&v4_ops);
 	nf_unregister_hook(&v6_ops);
+
+	ivi_rx_detach();
 	
 	if (v4_dev)
 		dev_put(v4_dev);
@@ -42,9 +42,14 @@
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
 #include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/route.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <net/netfilter/nf_nat.h>
+#include <net/netfilter/nf_nat_core.h>
 
 #include "ivi_config.h"
 #include "ivi_map.h"
@@ -53,10 +58,13 @@
 extern int nf_getv4dev(struct net_device *dev);
 extern int nf_getv6dev(struct net_device *dev);
 extern int nf_running(const int run);
+extern int ivi_nf_nat_out(struct sk_buff *skb);
 
 extern int ivi_nf_init(void);
 extern void ivi_nf_exit(void);
 
 extern struct net_device *v4_dev, *v6_dev;
 
+extern bool nat_conntrack;
+
 #endif /* IVI_NF_H */
@@ -0,0 +1,231 @@
+/*************************************************************************
+ *
+ * ivi_port.c :
+ *
+ * This file defines the MAP port allocator. The ports owned by the local
+ * PSID carry a reference count each and are split into one partition per
+ * CPU, every partition keeping its free ports in a FIFO under its own lock.
+ * A CPU allocates from its own partition and steals from the others once
+ * it runs dry, so new flows on different cores do not share a free list.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#include "ivi_port.h"
+
+// Get the index of a port in the pool, return -1 if the port is not owned by the local PSID
+static inline int ivi_port_index(struct ivi_port_pool *pool, __be16 port)
+{
+	u16 j;
+
+	if (pool->size == 0)
+		return -1;
+	if (((port >> pool->adjacent) & ((1 << pool->ratio) - 1)) != pool->offset)
+		return -1;
+	j = port >> (pool->ratio + pool->adjacent);
+	if (j < pool->low || j > pool->high)
+		return -1;
+	return ((j - pool->low) << pool->adjacent) | (port & ((1 << pool->adjacent) - 1));
+}
+
+// Get the port at an index of the pool
+static inline __be16 ivi_port_at(struct ivi_port_pool *pool, int index)
+{
+	u16 j = (index >> pool->adjacent) + pool->low;
+	u16 k = index & ((1 << pool->adjacent) - 1);
+
+	return (j << (pool->ratio + pool->adjacent)) + (pool->offset << pool->adjacent) + k;
+}
+
+// Free ports go back to the partition they belong to, so a partition never holds more than part_size ports
+static inline void ivi_port_enqueue(struct ivi_port_pool *pool, int index)
+{
+	struct ivi_port_part *part = &pool->parts[index % pool->nr_parts];
+
+	if (test_and_set_bit(index, pool->queued))
+		return;
+	spin_lock_bh(&part->lock);
+	part->fifo[(part->head + part->count) % pool->part_size] = index;
+	part->count++;
+	spin_unlock_bh(&part->lock);
+}
+
+// Take the earliest released port of a partition, return -1 if it is empty
+static inline int ivi_port_dequeue(struct ivi_port_pool *pool, struct ivi_port_part *part)
+{
+	int index = -1;
+
+	if (part->count == 0)
+		return -1;  // racy peek, saves the lock on partitions already drained
+	spin_lock_bh(&part->lock);
+	if (part->count > 0) {
+		index = part->fifo[part->head];
+		part->head = (part->head + 1) % pool->part_size;
+		part->count--;
+		clear_bit(index, pool->queued);
+	}
+	spin_unlock_bh(&part->lock);
+	return index;
+}
+
+// Allocate an empty pool, ratio and adjacent are given as powers of 2 like hgw_ratio and hgw_adjacent
+// must be called in process context
+int ivi_port_pool_init(struct ivi_port_pool *pool, u16 ratio, u16 adjacent, u16 offset)
+{
+	int start_port, i;
+
+	memset(pool, 0, sizeof(struct ivi_port_pool));
+	pool->ratio = fls(ratio) - 1;
+	pool->adjacent = fls(adjacent) - 1;
+	pool->offset = offset;
+	if (pool->ratio + pool->adjacent > 16 || pool->offset >= (1 << pool->ratio)) {
+		printk(KERN_ERR "ivi_port_pool_init: invalid ratio %d, adjacent %d or offset %d.\n", ratio, adjacent, offset);
+		return -EINVAL;
+	}
+
+	// the ports below start_port are reserved for system ports.
+	start_port = ((1 << (pool->ratio + pool->adjacent)) > 1024) ? 1 << (pool->ratio + pool->adjacent) : 1024;
+	pool->low = (u16)((start_port - 1) >> (pool->ratio + pool->adjacent)) + 1;
+	pool->high = (u16)(65536 >> (pool->ratio + pool->adjacent)) - 1;
+	if (pool->high < pool->low)
+		return 0; // no port left to the local PSID
+
+	pool->size = (pool->high - pool->low + 1) << pool->adjacent;
+	pool->nr_parts = num_possible_cpus();
+	pool->part_size = DIV_ROUND_UP(pool->size, pool->nr_parts);
+	pool->ref = (atomic_t *)vmalloc(pool->size * sizeof(atomic_t));
+	pool->fifo = (u16 *)vmalloc(pool->nr_parts * pool->part_size * sizeof(u16));
+	pool->queued = (unsigned long *)vmalloc(BITS_TO_LONGS(pool->size) * sizeof(unsigned long));
+	pool->parts = (struct ivi_port_part *)kzalloc(pool->nr_parts * sizeof(struct ivi_port_part), GFP_KERNEL);
+	if (!pool->ref || !pool->fifo || !pool->queued || !pool->parts) {
+		ivi_port_pool_release(pool);
+		printk(KERN_ERR "ivi_port_pool_init: failed to allocate a pool of %d ports.\n", pool->size);
+		return -ENOMEM;
+	}
+	memset(pool->ref, 0, pool->size * sizeof(atomic_t));
+	memset(pool->queued, 0, BITS_TO_LONGS(pool->size) * sizeof(unsigned long));
+	for (i = 0; i < pool->nr_parts; i++) {
+		spin_lock_init(&pool->parts[i].lock);
+		pool->parts[i].fifo = pool->fifo + i * pool->part_size;
+	}
+	return 0;
+}
+
+void ivi_port_pool_release(struct ivi_port_pool *pool)
+{
+	if (pool->ref)
+		vfree(pool->ref);
+	if (pool->fifo)
+		vfree(pool->fifo);
+	if (pool->queued)
+		vfree(pool->queued);
+	if (pool->parts)
+		kfree(pool->parts);
+	memset(pool, 0, sizeof(struct ivi_port_pool));
+}
+
+// Put every port without reference into the free list in ascending order, called once the
+// references of the existing mappings have been taken with ivi_port_get
+void ivi_port_pool_fill(struct ivi_port_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->size; i++) {
+		if (atomic_read(&pool->ref[i]) == 0)
+			ivi_port_enqueue(pool, i);
+	}
+}
+
+static int __ivi_port_alloc(struct ivi_port_pool *pool)
+{
+	int first, i, index;
+
+	if (pool->size == 0)
+		return -1;
+
+	first = raw_smp_processor_id() % pool->nr_parts;
+	for (i = 0; i < pool->nr_parts; i++) {
+		struct ivi_port_part *part = &pool->parts[(first + i) % pool->nr_parts];
+
+		while ((index = ivi_port_dequeue(pool, part)) >= 0) {
+			// The port may have been taken directly (1:1 mode or multiplexing) while it was queued,
+			// it will be queued again when its last mapping is gone.
+			if (atomic_cmpxchg(&pool->ref[index], 0, 1) == 0) {
+				atomic_inc(&pool->in_use);
+				return ivi_port_at(pool, index);
+			}
+		}
+	}
+	IVI_STATS_INC(IVI_STAT_PORT_FULL);
+	return -1;
+}
+
+// Allocate a free port and take the first reference on it, return -1 if the pool is exhausted
+// the local partition is tried first, then the others in turn; no map list lock is needed
+int ivi_port_alloc(struct ivi_port_pool *pool)
+{
+	u64 start;
+	int port;
+
+	trace_ivi_port_alloc_enter(pool->size);
+	start = ivi_lat_begin();
+	port = __ivi_port_alloc(pool);
+	ivi_lat_end(IVI_LAT_PORT_ALLOC, start);
+	trace_ivi_port_alloc_exit(pool->size, port);
+	return port;
+}
+
+// Take a reference on a port used by a new mapping, ports not owned by the local PSID are ignored
+// must be protected by the map list lock when calling this function
+void ivi_port_get(struct ivi_port_pool *pool, __be16 port)
+{
+	int index = ivi_port_index(pool, port);
+
+	if (index < 0)
+		return;
+	if (atomic_inc_return(&pool->ref[index]) == 1)
+		atomic_inc(&pool->in_use);
+}
+
+// Drop a reference on a port, the port is freed when the last mapping using it is gone
+// return the number of mappings still using the port, must be protected by the map list lock when calling this function
+// (ivi_port_alloc only ever raises a count from zero, so the check below cannot go stale)
+int ivi_port_put(struct ivi_port_pool *pool, __be16 port)
+{
+	int index = ivi_port_index(pool, port);
+	int ref;
+
+	if (index < 0 || atomic_read(&pool->ref[index]) == 0)
+		return 0;
+	if ((ref = atomic_dec_return(&pool->ref[index])) == 0) {
+		atomic_dec(&pool->in_use);
+		ivi_port_enqueue(pool, index);
+	}
+	return ref;
+}
@@ -0,0 +1,98 @@
+/*************************************************************************
+ *
+ * ivi_port.h :
+ *
+ * This file is the header file for the 'ivi_port.c' file.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#ifndef IVI_PORT_H
+#define IVI_PORT_H
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <asm/atomic.h>
+
+#include "ivi_config.h"
+#include "ivi_stats.h"
+#include "ivi_trace.h"
+
+/* free ports of one CPU, port index i belongs to partition i % nr_parts */
+struct ivi_port_part {
+	spinlock_t lock;
+	u16 *fifo;              // Free ports, the one released earliest is allocated first
+	int head;
+	int count;
+} ____cacheline_aligned_in_smp;
+
+/* pool of MAP ports owned by the local PSID */
+struct ivi_port_pool {
+	u16 ratio;              // log2 of the address sharing ratio
+	u16 adjacent;           // log2 of the number of contiguous ports
+	u16 offset;             // local PSID
+	u16 low;                // first and last value of the port bits above the PSID
+	u16 high;
+	int size;               // Number of ports in the pool, 0 if the pool is not set up
+	atomic_t in_use;        // Number of ports referenced by at least one mapping
+	atomic_t *ref;          // Number of mappings using each port
+	unsigned long *queued;  // Ports currently in a partition fifo
+	struct ivi_port_part *parts;
+	int nr_parts;
+	int part_size;          // Capacity of each partition fifo
+	u16 *fifo;              // Storage of all partition fifos
+};
+
+extern int ivi_port_pool_init(struct ivi_port_pool *pool, u16 ratio, u16 adjacent, u16 offset);
+extern void ivi_port_pool_release(struct ivi_port_pool *pool);
+extern void ivi_port_pool_fill(struct ivi_port_pool *pool);
+
+extern int ivi_port_alloc(struct ivi_port_pool *pool);
+extern void ivi_port_get(struct ivi_port_pool *pool, __be16 port);
+extern int ivi_port_put(struct ivi_port_pool *pool, __be16 port);
+
+// Number of ports that can still be allocated from the pool
+static inline int ivi_port_avail(struct ivi_port_pool *pool)
+{
+	return pool->size - atomic_read(&pool->in_use);
+}
+
+// Number of ports referenced by at least one mapping
+static inline int ivi_port_in_use(struct ivi_port_pool *pool)
+{
+	return atomic_read(&pool->in_use);
+}
+
+#endif /* IVI_PORT_H */
@@ -64,11 +64,13 @@ struct tnode {
 	unsigned char bits;
 	unsigned int full_children;
 	unsigned int empty_children;
+	struct rcu_head rcu;
 	struct tentry *child[0];
 };
 
 struct tleaf_info {
 	struct hlist_node node;
+	struct rcu_head rcu;
 	int plen;
 	u32 mask_plen;
 	struct in6_addr prefix6;
@@ -83,11 +85,59 @@ struct tleaf {
 	unsigned long parent;
 	t_key key;
 	struct hlist_head head;
+	struct rcu_head rcu;
 };
 
+/*
+ * Lookups walk the trie under rcu_read_lock() only, as fib_trie does. Writers hold trie_lock,
+ * publish child and root pointers with rcu_assign_pointer(), never change a tnode in place
+ * except for its child pointers (inflate() and halve() build new tnodes) and free nodes after
+ * a grace period. A lookup racing with a resize may miss a rule, it never sees freed memory.
+ */
 static struct tentry *trie = NULL;
 static spinlock_t trie_lock;
 
+/*
+ * Optional DIR-24-8 table compiled from the trie: tbl24 is indexed by the top 24 bits of
+ * the address and holds either the rule of the /24 or, with DIR_TBL8 set, a group of tbl8
+ * indexed by the last 8 bits for the /24s covered by longer rules. A lookup is one or two
+ * reads for 32 MB of tbl24 plus 512 bytes per tbl8 group.
+ */
+#define DIR_TBL24_SIZE	(1 << 24)
+#define DIR_TBL8		0x8000
+#define DIR_MAX			(DIR_TBL8 - 1)  // max number of rules and of tbl8 groups
+
+struct rule_dir_info {
+	struct in6_addr prefix6;
+	int plen;
+	int prefix6_len;
+	u16 ratio;
+	u16 adjacent;
+	u8 format;
+	u8 transport;
+};
+
+struct rule_dir {
+	u16 *tbl24;  // 0 for no rule, i + 1 for rules[i]
+	u16 *tbl8;
+	struct rule_dir_info *rules;
+	int nr_tbl8;
+	int nr_rules;
+	unsigned long size;  // bytes
+};
+
+bool rule_dir24 = 0;
+module_param(rule_dir24, bool, 0444);
+MODULE_PARM_DESC(rule_dir24, "Look up IPv4 rules in a DIR-24-8 table compiled from the trie, at least 32 MB");
+
+/*
+ * As the IPv6 rule table, the table is dropped under trie_lock by every change of the
+ * trie and rule_dir_work publishes a new one; lookups walk the trie in between.
+ */
+static struct rule_dir *rule_dir = NULL;
+static u32 rule_gen;
+static struct delayed_work rule_dir_work;
+
 #ifdef IVI_DEBUG
 /* Memory counter */
 static int balance = 0;
@@ -98,8 +148,17 @@ static inline struct tnode* node_parent(const struct tentry *node)
 	return (struct tnode *)(node->parent & ~NODE_TYPE_MASK);
 }
 
+static inline struct tnode* node_parent_rcu(const struct tentry *node)
+{
+	struct tnode *ret = node_parent(node);
+
+	return rcu_dereference(ret);
+}
+
+// The node must be initialized before a reader may find it through its parent pointer
 static inline void node_set_parent(struct tentry *node, const struct tnode *ptr)
 {
+	smp_wmb();
 	node->parent = (unsigned long)ptr | NODE_TYPE(node);
 }
 
@@ -108,6 +167,11 @@ static inline struct tentry* tnode_get_child(const struct tnode *tn, unsigned in
 	return (tn->child[i]);
 }
 
+static inline struct tentry* tnode_get_child_rcu(const struct tnode *tn, unsigned int i)
+{
+	return rcu_dereference(tn->child[i]);
+}
+
 static inline int tnode_child_length(const struct tnode *tn)
 {
 	return 1 << tn->bits;
@@ -151,15 +215,31 @@ static inline int tkey_mismatch(t_key a, int offset, t_key b)
 	return i;
 }
 
+static void tnode_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tnode, rcu));
+}
+
+static void tleaf_info_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tleaf_info, rcu));
+}
+
+static void tleaf_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct tleaf, rcu));
+}
+
 /* Caller must free or store all the children of tnode 'n'
  *   before calling this function to free it.
+ * Nodes are freed after a grace period, lookups may still be walking them.
  */
 static inline void tnode_free(struct tnode *n)
 {
 	if (!n)
 		return;
 
-	kfree(n);
+	call_rcu(&n->rcu, tnode_free_rcu);
 #ifdef IVI_DEBUG
 	balance--;
 #endif
@@ -170,7 +250,7 @@ static inline void tleaf_info_free(struct tleaf_info *li)
 	if (!li)
 		return;
 
-	kfree(li);
+	call_rcu(&li->rcu, tleaf_info_free_rcu);
 #ifdef IVI_DEBUG
 	balance--;
 #endif
@@ -181,12 +261,41 @@ static inline void tleaf_free(struct tleaf *l)
 	if (!l)
 		return;
 	
-	kfree(l);
+	call_rcu(&l->rcu, tleaf_free_rcu);
 #ifdef IVI_DEBUG
 	balance--;
 #endif
 }
 
+static void rule_dir_free(struct rule_dir *dir)
+{
+	vfree(dir->tbl24);
+	vfree(dir->tbl8);
+	vfree(dir->rules);
+	kfree(dir);
+}
+
+// Called with trie_lock held after every change of the trie, returns the table to release
+static struct rule_dir* rule_dir_invalidate(void)
+{
+	struct rule_dir *old = rule_dir;
+
+	rule_gen++;
+	rcu_assign_pointer(rule_dir, NULL);
+	if (rule_dir24)
+		schedule_delayed_work(&rule_dir_work, IVI_RULE_BUILD_DELAY);
+	return old;
+}
+
+// Free a table dropped by rule_dir_invalidate() once no lookup can see it, may sleep
+static void rule_dir_release(struct rule_dir *old)
+{
+	if (old) {
+		synchronize_rcu();
+		rule_dir_free(old);
+	}
+}
+
 static void tentry_free(struct tentry *node)
 {
 	if (!node)
@@ -227,15 +336,22 @@ static struct tleaf *tleaf_new(void)
 	return l;
 }
 
-static struct tleaf_info *tleaf_info_new(int plen)
+// Satellite data is filled in before the leaf info is published and never changed afterwards
+static struct tleaf_info *tleaf_info_new(struct rule_info *rule)
 {
 	struct tleaf_info *li = (struct tleaf_info *)kzalloc(sizeof(struct tleaf_info), GFP_ATOMIC);
 #ifdef IVI_DEBUG
 	balance++;
 #endif
 	if (li) {
-		li->plen = plen;
-		li->mask_plen = ntohl(inet_make_mask(plen));
+		li->plen = rule->plen4;
+		li->mask_plen = ntohl(inet_make_mask(rule->plen4));
+		li->prefix6 = rule->prefix6;
+		li->prefix6_len = rule->plen6;
+		li->ratio = rule->ratio;
+		li->adjacent = rule->adjacent;
+		li->format = rule->format;
+		li->transport = rule->transport;
 		INIT_HLIST_NODE(&li->node);
 	}
 	return li;
@@ -308,7 +424,7 @@ static void tnode_put_child_reorg(struct tnode *tn, int i, struct tentry *n, int
 	if (n)
 		node_set_parent(n, tn);
 
-	tn->child[i] = n;
+	rcu_assign_pointer(tn->child[i], n);
 }
 
 static inline void put_child(struct tnode *tn, int i, struct tentry *n)
@@ -372,7 +488,7 @@ static struct tnode *inflate(struct tnode *tn)
 			continue;
 
 		/* A leaf or an internal node with skipped bits */
-		if (IS_LEAF(node) || ((struct tnode *)node)->pos > tn->pos + tn->bits) {
+		if (IS_LEAF(node) || ((struct tnode *)node)->pos > tn->pos + tn->bits - 1) {
 				if (tkey_extract_bits(node->key, oldtnode->pos + oldtnode->bits, 1) == 0)
 					put_child(tn, 2*i, node);
 				else
@@ -580,7 +696,7 @@ static void trie_rebalance(struct tnode *tn)
 
 		tp = node_parent((struct tentry *) tn);
 		if (!tp)
-			trie = (struct tentry *)tn;
+			rcu_assign_pointer(trie, (struct tentry *)tn);
 
 		if (!tp)
 			break;
@@ -591,7 +707,7 @@ static void trie_rebalance(struct tnode *tn)
 	if (IS_TNODE(tn))
 		tn = (struct tnode *)resize((struct tnode *)tn);
 
-	trie = (struct tentry *)tn;
+	rcu_assign_pointer(trie, (struct tentry *)tn);
 }
 
 static struct tleaf_info *find_leaf_info(struct tleaf *l, int plen)
@@ -617,7 +733,7 @@ static void insert_leaf_info(struct tleaf *l, struct tleaf_info *li)
 	struct hlist_node *temp;
 
 	if (hlist_empty(head)) {
-		hlist_add_head(&li->node, head);
+		hlist_add_head_rcu(&li->node, head);
 	} else {
 		hlist_for_each_entry(p, temp, head, node) {
 			if (li->plen > p->plen)
@@ -626,9 +742,9 @@ static void insert_leaf_info(struct tleaf *l, struct tleaf_info *li)
 			last = p;
 		}
 		if (last)
-			hlist_add_after(&last->node, &li->node);
+			hlist_add_after_rcu(&last->node, &li->node);
 		else
-			hlist_add_before(&li->node, &p->node);
+			hlist_add_before_rcu(&li->node, &p->node);
 	}
 }
 
@@ -662,7 +778,7 @@ static int check_leaf(struct tleaf *l, t_key key, struct in6_addr *prefix6, int
 	struct tleaf_info *li;
 	struct hlist_head *head = &l->head;
 	struct hlist_node *temp;
-	hlist_for_each_entry(li, temp, head, node) {
+	hlist_for_each_entry_rcu(li, temp, head, node) {
 		if (l->key == (key & li->mask_plen)) {
 			*prefix6 = li->prefix6;
 			if (plen4)
@@ -687,9 +803,39 @@ static int check_leaf(struct tleaf *l, t_key key, struct in6_addr *prefix6, int
 	return 1;
 }
 
+// Must be called under rcu_read_lock
+static int rule_dir_lookup(struct rule_dir *dir, t_key key, struct in6_addr *prefix6, int *plen4, int *plen6, u16 *ratio, u16 *adjacent, u8 *fmt, u8 *transpt)
+{
+	struct rule_dir_info *r;
+	u16 e;
+
+	e = dir->tbl24[key >> 8];
+	if (e & DIR_TBL8)
+		e = dir->tbl8[((e & ~DIR_TBL8) << 8) | (key & 0xff)];
+	if (!e)
+		return 1;
+
+	r = &dir->rules[e - 1];
+	*prefix6 = r->prefix6;
+	if (plen4)
+		*plen4 = r->plen;
+	if (plen6)
+		*plen6 = r->prefix6_len;
+	if (ratio)
+		*ratio = r->ratio;
+	if (adjacent)
+		*adjacent = r->adjacent;
+	if (fmt)
+		*fmt = r->format;
+	if (transpt)
+		*transpt = r->transport;
+	return 0;
+}
+
 int ivi_rule_lookup(u32 key, struct in6_addr *prefix6, int *plen4, int *plen6, u16 *ratio, u16 *adjacent, u8 *fmt, u8 *transpt)
 {
 	int ret;
+	struct rule_dir *dir;
 	struct tentry *n;
 	struct tnode *pn;
 	unsigned int pos, bits;
@@ -698,10 +844,20 @@ int ivi_rule_lookup(u32 key, struct in6_addr *prefix6, int *plen4, int *plen6, u
 	unsigned int current_prefix_length = KEYLENGTH;
 	struct tnode *cn;
 	t_key pref_mismatch;
+	u64 start;
 
-	spin_lock_bh(&trie_lock);
-	
-	n = trie;
+	trace_ivi_rule_lookup_enter(key);
+	start = ivi_lat_begin();
+
+	rcu_read_lock();
+
+	dir = rcu_dereference(rule_dir);
+	if (dir) {
+		ret = rule_dir_lookup(dir, key, prefix6, plen4, plen6, ratio, adjacent, fmt, transpt);
+		goto found;
+	}
+
+	n = rcu_dereference(trie);
 	if (!n)
 		goto failed;
 
@@ -721,7 +877,7 @@ int ivi_rule_lookup(u32 key, struct in6_addr *prefix6, int *plen4, int *plen6, u
 		if (!chopped_off)
 			cindex = tkey_extract_bits(mask_pfx(key, current_prefix_length), pos, bits);
 
-		n = tnode_get_child(pn, cindex);
+		n = tnode_get_child_rcu(pn, cindex);
 
 		if (n == NULL) {
 			goto backtrace;
@@ -739,7 +895,7 @@ int ivi_rule_lookup(u32 key, struct in6_addr *prefix6, int *plen4, int *plen6, u
 		if (current_prefix_length < pos + bits) {
 			if (tkey_extract_bits(cn->key, current_prefix_length,
 				cn->pos - current_prefix_length)
-				|| !(cn->child[0]))
+				|| !tnode_get_child_rcu(cn, 0))
 				goto backtrace;
 		}
 
@@ -778,7 +934,7 @@ backtrace:
 		if (chopped_off <= pn->bits) {
 			cindex &= ~(1 << (chopped_off-1));
 		} else {
-			struct tnode *parent = node_parent((struct tentry *) pn);
+			struct tnode *parent = node_parent_rcu((struct tentry *) pn);
 			if (!parent)
 				goto failed;
 
@@ -792,16 +948,19 @@ backtrace:
 failed:
 	ret = 1;
 found:
-	spin_unlock_bh(&trie_lock);
+	rcu_read_unlock();
+
+	ivi_lat_end(IVI_LAT_RULE, start);
+	trace_ivi_rule_lookup_exit(key, ret);
 	return ret;
 }
 
-static struct tleaf_info* trie_insert_node(u32 key, u32 plen)
+// Link a new leaf info into the trie, return -1 on failure with 'li' left to the caller
+static int trie_insert_node(u32 key, struct tleaf_info *li)
 {
 	int pos, newpos;
 	int missbit;
 	struct tleaf *l;
-	struct tleaf_info *li = NULL;
 	struct tentry *n;
 	struct tnode *tp = NULL, *tn = NULL;
 	t_key cindex;
@@ -827,27 +986,15 @@ static struct tleaf_info* trie_insert_node(u32 key, u32 plen)
 
 	/* Case 1: n is a leaf. Compare prefixes */
 	if (n != NULL && IS_LEAF(n) && tkey_equals(key, n->key)) {
-		l = (struct tleaf *)n;
-		li = tleaf_info_new(plen);
-		if (!li)
-			return NULL;
-
-		insert_leaf_info(l, li);
-		return li;
+		insert_leaf_info((struct tleaf *)n, li);
+		return 0;
 	}
 	l = tleaf_new();
 
 	if (!l)
-		return NULL;
+		return -1;
 
 	l->key = key;
-	li = tleaf_info_new(plen);
-
-	if (!li) {
-		tleaf_free(l);
-		return NULL;
-	}
-
 	insert_leaf_info(l, li);
 
 	if (trie != NULL && n == NULL) {
@@ -874,8 +1021,10 @@ static struct tleaf_info* trie_insert_node(u32 key, u32 plen)
 			tn = tnode_new(key, newpos, 1); /* First tnode (root) */
 		}
 
-		if (tn == NULL)
-			return NULL;
+		if (tn == NULL) {
+			tleaf_free(l);
+			return -1;
+		}
 
 		node_set_parent((struct tentry *)tn, tp);
 
@@ -887,21 +1036,22 @@ static struct tleaf_info* trie_insert_node(u32 key, u32 plen)
 			cindex = tkey_extract_bits(key, tp->pos, tp->bits);
 			put_child((struct tnode *)tp, cindex, (struct tentry *)tn);
 		} else {
-			trie = (struct tentry *)tn;
+			rcu_assign_pointer(trie, (struct tentry *)tn);
 			tp = tn;
 		}
 	}
 	/* Re-balance the trie */
 	trie_rebalance(tp);
-	return li;
+	return 0;
 }
 
 int ivi_rule_insert(struct rule_info *rule)
 {
 	u32 key, mask;
 	int plen;
+	struct rule_dir *old;
 	struct tleaf *l;
-	struct tleaf_info *li;
+	struct tleaf_info *li, *new_li;
 
 	if ((rule->plen4 > 32) || (rule->plen6 > 128))
 		return -1;
@@ -910,28 +1060,24 @@ int ivi_rule_insert(struct rule_info *rule)
 	mask = ntohl(inet_make_mask(plen));
 	key = rule->prefix4 & mask;
 
+	if (!(new_li = tleaf_info_new(rule)))
+		return -1;
+
 	spin_lock_bh(&trie_lock);
 	l = fib_find_node(key);
 	li = find_leaf_info(l, plen);
 	if (li) {
-		// Update satellite data.
-		li->prefix6 = rule->prefix6;
-		li->prefix6_len = rule->plen6;
-		li->ratio = rule->ratio;
-		li->adjacent = rule->adjacent;
-		li->format = rule->format;
-		li->transport = rule->transport;
-	} else {
-		li = trie_insert_node(key, plen);
-		// Insert satellite data.
-		li->prefix6 = rule->prefix6;
-		li->prefix6_len = rule->plen6;
-		li->ratio = rule->ratio;
-		li->adjacent = rule->adjacent;
-		li->format = rule->format;
-		li->transport = rule->transport;
+		// Update satellite data, lookups see either the old or the new rule.
+		hlist_replace_rcu(&li->node, &new_li->node);
+		tleaf_info_free(li);
+	} else if (trie_insert_node(key, new_li) != 0) {
+		spin_unlock_bh(&trie_lock);
+		tleaf_info_free(new_li);
+		return -1;
 	}
+	old = rule_dir_invalidate();
 	spin_unlock_bh(&trie_lock);
+	rule_dir_release(old);
 #ifdef IVI_DEBUG_RULE
 	printk(KERN_DEBUG "ivi_rule_insert: " NIP4_FMT "/%d -> " NIP6_FMT "/%d, ratio %d, adjacent %d, addr-format %d, transport %d\n", 
 		NIP4(rule->prefix4), rule->plen4, NIP6(rule->prefix6), rule->plen6, rule->ratio, rule->adjacent, rule->format, rule->transport);
@@ -948,7 +1094,7 @@ static void trie_leaf_remove(struct tleaf *l)
 		put_child((struct tnode *)tp, cindex, NULL);
 		trie_rebalance(tp);
 	} else
-		trie = NULL;
+		rcu_assign_pointer(trie, NULL);
 
 	tleaf_free(l);
 }
@@ -957,6 +1103,7 @@ int ivi_rule_delete(struct rule_info *rule)
 {
 	u32 key, mask;
 	int plen, ret;
+	struct rule_dir *old = NULL;
 	struct tleaf *l;
 	struct tleaf_info *li;
 
@@ -987,7 +1134,7 @@ int ivi_rule_delete(struct rule_info *rule)
 		|| li->format != rule->format || li->ratio != rule->ratio || li->adjacent != rule->adjacent || li->transport != rule->transport)
 		goto out_from_lock;
 	
-	hlist_del(&li->node);
+	hlist_del_rcu(&li->node);
 	tleaf_info_free(li);
 #ifdef IVI_DEBUG_RULE
 	printk(KERN_DEBUG "ivi_rule_delete: " NIP4_FMT "/%d -> " NIP6_FMT "/%d, ratio = %d, adjacent = %d, addr-format %d, transport %d\n", 
@@ -997,9 +1144,11 @@ int ivi_rule_delete(struct rule_info *rule)
 	if (hlist_empty(&l->head))
 		trie_leaf_remove(l);
 	
+	old = rule_dir_invalidate();
 	ret = 0;
 out_from_lock:
 	spin_unlock_bh(&trie_lock);
+	rule_dir_release(old);
 out:
 	return ret;
 }
@@ -1072,13 +1221,168 @@ static void trie_flush_leaf(struct tleaf *l)
 		return;
 
 	hlist_for_each_entry_safe(li, loop, temp, &l->head, node) {
-		hlist_del(&li->node);
+		hlist_del_rcu(&li->node);
 		tleaf_info_free(li);
 	}
 }
 
+
+/*
+ * DIR-24-8 table
+ */
+
+/*
+ * Compile the rules of the trie into a new DIR-24-8 table and publish it, unless the trie
+ * changed in the meantime or rule_dir24 is off. Called by rule_dir_work, may sleep.
+ */
+int ivi_rule_rebuild(void)
+{
+	struct rule_dir *dir, *old = NULL;
+	struct tleaf_info *li;
+	struct hlist_node *temp;
+	struct tleaf *l;
+	u32 gen, *keys = NULL, i, j, e;
+	int *plens = NULL;
+	int n, nr_long, plen, ret;
+
+	if (!rule_dir24)
+		return 0;
+
+	/* size the copy of the rules, the trie may change while it is allocated */
+	spin_lock_bh(&trie_lock);
+	gen = rule_gen;
+	n = nr_long = 0;
+	for (l = trie_first_leaf(trie); l; l = trie_next_leaf(l)) {
+		hlist_for_each_entry(li, temp, &l->head, node) {
+			n++;
+			if (li->plen > 24)
+				nr_long++;
+		}
+	}
+	spin_unlock_bh(&trie_lock);
+
+	if (n == 0)
+		return 0;  // the empty trie is looked up as fast
+	if (n > DIR_MAX || nr_long > DIR_MAX)
+		return -ENOSPC;
+
+	ret = -ENOMEM;
+	dir = kzalloc(sizeof(struct rule_dir), GFP_KERNEL);
+	if (dir == NULL)
+		goto out;
+
+	dir->tbl24 = (u16 *)vzalloc(DIR_TBL24_SIZE * sizeof(u16));
+	dir->tbl8 = (u16 *)vmalloc((nr_long ? nr_long : 1) * 256 * sizeof(u16));
+	dir->rules = (struct rule_dir_info *)vmalloc(n * sizeof(struct rule_dir_info));
+	keys = (u32 *)vmalloc(n * sizeof(u32));
+	plens = (int *)vmalloc(n * sizeof(int));
+	if (dir->tbl24 == NULL || dir->tbl8 == NULL || dir->rules == NULL || keys == NULL || plens == NULL)
+		goto out;
+
+	spin_lock_bh(&trie_lock);
+	if (gen != rule_gen) {
+		/* the change has scheduled rule_dir_work again */
+		spin_unlock_bh(&trie_lock);
+		ret = -EAGAIN;
+		goto out;
+	}
+	i = 0;
+	for (l = trie_first_leaf(trie); l; l = trie_next_leaf(l)) {
+		hlist_for_each_entry(li, temp, &l->head, node) {
+			keys[i] = l->key;
+			plens[i] = li->plen;
+			dir->rules[i].prefix6 = li->prefix6;
+			dir->rules[i].plen = li->plen;
+			dir->rules[i].prefix6_len = li->prefix6_len;
+			dir->rules[i].ratio = li->ratio;
+			dir->rules[i].adjacent = li->adjacent;
+			dir->rules[i].format = li->format;
+			dir->rules[i].transport = li->transport;
+			i++;
+		}
+	}
+	spin_unlock_bh(&trie_lock);
+	dir->nr_rules = n;
+
+	/*
+	 * Fill in the rules from the shortest to the longest so that longer prefixes overwrite
+	 * the ones they are part of. Rules up to /24 are all in place before the first tbl8
+	 * group is taken, a group starts as a copy of the tbl24 entry it replaces.
+	 */
+	for (plen = 0; plen <= KEYLENGTH; plen++) {
+		for (i = 0; i < n; i++) {
+			if (plens[i] != plen)
+				continue;
+			if (plen <= 24) {
+				for (j = keys[i] >> 8; j < (keys[i] >> 8) + (1U << (24 - plen)); j++)
+					dir->tbl24[j] = i + 1;
+				continue;
+			}
+			e = dir->tbl24[keys[i] >> 8];
+			if (!(e & DIR_TBL8)) {
+				for (j = 0; j < 256; j++)
+					dir->tbl8[(dir->nr_tbl8 << 8) + j] = e;
+				e = DIR_TBL8 | dir->nr_tbl8++;
+				dir->tbl24[keys[i] >> 8] = e;
+			}
+			e = (e & ~DIR_TBL8) << 8;
+			for (j = keys[i] & 0xff; j < (keys[i] & 0xff) + (1U << (32 - plen)); j++)
+				dir->tbl8[e + j] = i + 1;
+		}
+	}
+	dir->size = sizeof(struct rule_dir) + DIR_TBL24_SIZE * sizeof(u16)
+		+ dir->nr_tbl8 * 256 * sizeof(u16) + n * sizeof(struct rule_dir_info);
+
+	spin_lock_bh(&trie_lock);
+	if (gen == rule_gen) {
+		old = rule_dir;
+		rcu_assign_pointer(rule_dir, dir);
+		ret = 0;
+	} else {
+		ret = -EAGAIN;
+	}
+	spin_unlock_bh(&trie_lock);
+
+	if (ret == 0) {
+#ifdef IVI_DEBUG_RULE
+		printk(KERN_DEBUG "ivi_rule_rebuild: %d rules, %d tbl8 groups, %lu bytes\n", n, dir->nr_tbl8, dir->size);
+#endif
+		dir = NULL;
+		rule_dir_release(old);
+	}
+
+out:
+	vfree(keys);
+	vfree(plens);
+	if (dir)
+		rule_dir_free(dir);
+	return ret;
+}
+
+static void rule_dir_rebuild(struct work_struct *work)
+{
+	int ret = ivi_rule_rebuild();
+
+	if (ret == -ENOMEM || ret == -ENOSPC)
+		printk(KERN_WARNING "IVI: ivi_rule failed to build the DIR-24-8 table (%d), using the trie.\n", ret);
+}
+
+// Bytes of the DIR-24-8 table in use, 0 while lookups walk the trie
+unsigned long ivi_rule_table_size(void)
+{
+	struct rule_dir *dir;
+	unsigned long size;
+
+	rcu_read_lock();
+	dir = rcu_dereference(rule_dir);
+	size = dir ? dir->size : 0;
+	rcu_read_unlock();
+	return size;
+}
+
 void ivi_rule_flush(void)
 {
+	struct rule_dir *old;
 	struct tleaf *l, *ll = NULL;
 
 	spin_lock_bh(&trie_lock);
@@ -1094,12 +1398,17 @@ void ivi_rule_flush(void)
 	if (ll && hlist_empty(&ll->head))
 		trie_leaf_remove(ll);
 
+	old = rule_dir_invalidate();
 	spin_unlock_bh(&trie_lock);
+	rule_dir_release(old);
 }
 
 int ivi_rule_init(void) {
 	trie = NULL;
 	spin_lock_init(&trie_lock);
+	rule_dir = NULL;
+	rule_gen = 0;
+	INIT_DELAYED_WORK(&rule_dir_work, rule_dir_rebuild);
 #ifdef IVI_DEBUG
 	balance = 0;
 	printk(KERN_DEBUG "IVI: ivi_rule loaded.\n");
@@ -1109,6 +1418,8 @@ int ivi_rule_init(void) {
 
 void ivi_rule_exit(void) {
 	ivi_rule_flush();
+	cancel_delayed_work_sync(&rule_dir_work);  // the flush dropped the table
+	rcu_barrier(); // wait for the nodes freed by the flush
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_rule unloaded.\n");
 	printk(KERN_DEBUG "IVI: ivi_rule memory balance = %d\n", balance);
@@ -41,16 +41,23 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <linux/inetdevice.h>
 
 #include "ivi_config.h"
+#include "ivi_trace.h"
+
+extern bool rule_dir24;
 
 extern int ivi_rule_lookup(u32 key, struct in6_addr *prefix6, int *plen4, int *plen6, u16 *ratio, u16 *adjacent, u8 *fmt, u8 *transpt);
 extern int ivi_rule_insert(struct rule_info *rule);
 extern int ivi_rule_delete(struct rule_info *rule);
 extern void ivi_rule_flush(void);
+extern int ivi_rule_rebuild(void);  // compile the DIR-24-8 table now instead of in the delayed work
+extern unsigned long ivi_rule_table_size(void);
 
 extern int ivi_rule_init(void);
 extern void ivi_rule_exit(void);
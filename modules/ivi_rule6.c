@@ -50,13 +50,69 @@ struct rule6_node {
 	u16 adjacent;
 	u8 format;
 	u8 flag;
+	struct rcu_head rcu;
 };
 
 #define RN_RINFO 0x0001
 
+/*
+ * Lookups walk the tree under rcu_read_lock() only. Writers hold radix_lock, link new
+ * nodes with rcu_assign_pointer() once they are complete and free nodes after a grace
+ * period. The rule info of a published node never changes, only RN_RINFO may be cleared.
+ */
 static struct rule6_node *radix = NULL;
 static spinlock_t radix_lock;
 
+/*
+ * Compiled lookup table: a poptrie of RULE6_STRIDE bits per level built from the rules
+ * of the radix tree. Each node holds a bitmap of the slots that have a child node and a
+ * bitmap of the slots where a run of identical leaves starts; children and leaves of a
+ * node are contiguous, so a slot is found with a popcount of the bitmap.
+ *
+ * The bits shared by every rule are checked with one compare before the first level,
+ * so a set of FMRs under one operator prefix is resolved in a few node reads.
+ */
+#define RULE6_STRIDE	6
+#define RULE6_LEVELS	(128 / RULE6_STRIDE + 1)
+
+struct rule6_mnode {
+	u64 vector;   // bit i: slot i has a child node
+	u64 leafvec;  // bit i: a run of identical leaves starts at slot i
+	u32 base0;    // first leaf of the node
+	u32 base1;    // first child of the node
+};
+
+struct rule6_mrule {
+	u32 prefix4;
+	int plen6;
+	int plen4;
+	u16 ratio;
+	u16 adjacent;
+	u8 format;
+};
+
+struct rule6_fib {
+	struct in6_addr skip;  // bits shared by all rules
+	int skip_len;
+	struct rule6_mnode *nodes;
+	u32 *leaves;  // 0 for no rule, i + 1 for rules[i]
+	struct rule6_mrule *rules;
+	int nr_nodes;
+	int nr_leaves;
+	int nr_rules;
+	unsigned long size;  // bytes
+};
+
+/*
+ * The table is replaced as a whole: writers drop it under radix_lock when they change
+ * the tree and rule6_fib_work publishes a new one. Lookups walk the radix tree while
+ * there is no table. rule6_gen counts the changes so that a table built from a stale
+ * copy of the rules is never published.
+ */
+static struct rule6_fib *rule6_fib = NULL;
+static u32 rule6_gen;
+static struct delayed_work rule6_fib_work;
+
 #ifdef IVI_DEBUG
 /* Memory counter */
 static int balance = 0;
@@ -95,18 +151,86 @@ static __inline__ struct rule6_node * node_alloc(void)
 	return n;
 }
 
+static void node_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct rule6_node, rcu));
+}
+
+// Nodes are freed after a grace period, lookups may still be walking them
 static __inline__ void node_free(struct rule6_node *n)
 {
-	kfree(n);
+	call_rcu(&n->rcu, node_free_rcu);
 #ifdef IVI_DEBUG
 	balance--;
 #endif
 }
 
+// Point the parent of 'fn', or the root, to 'n' instead
+static __inline__ void node_relink(struct rule6_node *pn, struct rule6_node *fn, struct rule6_node *n)
+{
+	if (!pn)
+		rcu_assign_pointer(radix, n);
+	else if (pn->left == fn)
+		rcu_assign_pointer(pn->left, n);
+	else
+		rcu_assign_pointer(pn->right, n);
+}
+
+static void rule6_fib_free(struct rule6_fib *fib)
+{
+	vfree(fib->nodes);
+	vfree(fib->leaves);
+	vfree(fib->rules);
+	kfree(fib);
+}
+
+// Called with radix_lock held after every change of the tree, returns the table to release
+static struct rule6_fib* rule6_fib_invalidate(void)
+{
+	struct rule6_fib *old = rule6_fib;
+
+	rule6_gen++;
+	rcu_assign_pointer(rule6_fib, NULL);
+	schedule_delayed_work(&rule6_fib_work, IVI_RULE_BUILD_DELAY);
+	return old;
+}
+
+// Free a table dropped by rule6_fib_invalidate() once no lookup can see it, may sleep
+static void rule6_fib_release(struct rule6_fib *old)
+{
+	if (old) {
+		synchronize_rcu();
+		rule6_fib_free(old);
+	}
+}
+
 /*
  * Rule insertion
  */
 
+/*
+ * A new node carrying rule info, it is filled in before it is published and its
+ * rule info is never changed afterwards: a rule is updated by replacing its node.
+ */
+static struct rule6_node* node_new_rule(const struct in6_addr *addr, int plen, struct rule_info *rule)
+{
+	struct rule6_node *ln = node_alloc();
+
+	if (ln == NULL)
+		return NULL;
+
+	ln->key = *addr;
+	ln->prefix4 = rule->prefix4;
+	ln->bit_pos = plen;
+	ln->plen6 = rule->plen6;
+	ln->plen4 = rule->plen4;
+	ln->ratio = rule->ratio;
+	ln->adjacent = rule->adjacent;
+	ln->format = rule->format;
+	ln->flag |= RN_RINFO;
+	return ln;
+}
+
 static struct rule6_node* radix_insert_node(const struct in6_addr *addr, struct rule_info *rule)
 {
 	struct rule6_node *fn, *in, *ln, *pn;
@@ -132,8 +256,21 @@ static struct rule6_node* radix_insert_node(const struct in6_addr *addr, struct
 
 		/* Exact match ? */
 		if (plen == fn->bit_pos) {
-			fn->flag |= RN_RINFO;  /* fn contains rule info now */
-			return fn;
+			/* replace fn with a copy that contains the rule info */
+			ln = node_new_rule(&fn->key, plen, rule);
+			if (ln == NULL)
+				return NULL;
+
+			ln->left = fn->left;
+			ln->right = fn->right;
+			ln->parent = pn;
+			if (ln->left)
+				rcu_assign_pointer(ln->left->parent, ln);
+			if (ln->right)
+				rcu_assign_pointer(ln->right->parent, ln);
+			node_relink(pn, fn, ln);
+			node_free(fn);
+			return ln;
 		}
 
 		/*
@@ -151,30 +288,20 @@ root_empty:
 	 * We have walked to the bottom of tree.
 	 * Create new leaf node without children.
 	 */
-	ln = node_alloc();
+	ln = node_new_rule(addr, plen, rule);
 	if (ln == NULL)
 		return NULL;
 
-	/* set new leaf's key */
-	ln->key = *addr;
-	ln->prefix4 = rule->prefix4;
-	ln->bit_pos = plen;
-	ln->plen6 = rule->plen6;
-	ln->plen4 = rule->plen4;
-	ln->ratio = rule->ratio;
-	ln->adjacent = rule->adjacent;
-	ln->format = rule->format;
 	ln->parent = pn;
-	ln->flag |= RN_RINFO;
 
 	if (!pn) {
 		/* we have empty root */
-		radix = ln;
+		rcu_assign_pointer(radix, ln);
 	} else {
 		if (dir)
-			pn->right = ln;
+			rcu_assign_pointer(pn->right, ln);
 		else
-			pn->left  = ln;
+			rcu_assign_pointer(pn->left, ln);
 	}
 
 	return ln;
@@ -187,6 +314,8 @@ insert_above:
 	 * we've to insert an intermediate node on the list
 	 * this new node will point to the one we need to create
 	 * and the current
+	 *
+	 * The new nodes are complete before they are linked in the tree.
 	 */
 
 	pn = fn->parent;
@@ -205,7 +334,7 @@ insert_above:
 	 */
 	if (plen > bit) {
 		in = node_alloc();
-		ln = node_alloc();
+		ln = node_new_rule(addr, plen, rule);
 
 		if (in == NULL || ln == NULL) {
 			if (in)
@@ -221,30 +350,7 @@ insert_above:
 		in->parent = pn;
 		in->flag = 0; /* in's flag is cleared */
 
-		if (!pn) {
-			/* in is root now */
-			radix = in;
-		} else {
-			/* update parent pointer */
-			if (dir)
-				pn->right = in;
-			else
-				pn->left  = in;
-		}
-
-		/* set new leaf's key */
-		ln->key = *addr;
-		ln->prefix4 = rule->prefix4;
-		ln->bit_pos = plen;
-		ln->plen6 = rule->plen6;
-		ln->plen4 = rule->plen4;
-		ln->ratio = rule->ratio;
-		ln->adjacent = rule->adjacent;
-		ln->format = rule->format;
 		ln->parent = in;
-		ln->flag |= RN_RINFO;
-
-		fn->parent = in;
 
 		if (addr_bit_set(addr, bit)) {
 			in->right = ln;
@@ -253,6 +359,19 @@ insert_above:
 			in->left  = ln;
 			in->right = fn;
 		}
+
+		rcu_assign_pointer(fn->parent, in);
+
+		if (!pn) {
+			/* in is root now */
+			rcu_assign_pointer(radix, in);
+		} else {
+			/* update parent pointer */
+			if (dir)
+				rcu_assign_pointer(pn->right, in);
+			else
+				rcu_assign_pointer(pn->left, in);
+		}
 	} else { /* plen <= bit */
 
 		/*
@@ -260,45 +379,36 @@ insert_above:
 		 *	          /	   \
 		 *	     (old node)[fn] NULL
 		 */
-		ln = node_alloc();
+		ln = node_new_rule(addr, plen, rule);
 
 		if (ln == NULL)
 			return NULL;
 
-		/* set new leaf's key */
-		ln->key = *addr;
-		ln->prefix4 = rule->prefix4;
-		ln->bit_pos = plen;
-		ln->plen6 = rule->plen6;
-		ln->plen4 = rule->plen4;
-		ln->ratio = rule->ratio;
-		ln->adjacent = rule->adjacent;
-		ln->format = rule->format;
 		ln->parent = pn;
-		ln->flag |= RN_RINFO;
+
+		if (addr_bit_set(&fn->key, plen))
+			ln->right = fn;
+		else
+			ln->left  = fn;
+
+		rcu_assign_pointer(fn->parent, ln);
 
 		if (!pn) {
 			 /* ln is root now */
-			radix = ln;
+			rcu_assign_pointer(radix, ln);
 		} else {
 			if (dir)
-				pn->right = ln;
+				rcu_assign_pointer(pn->right, ln);
 			else
-				pn->left  = ln;
+				rcu_assign_pointer(pn->left, ln);
 		}
-
-		if (addr_bit_set(&fn->key, plen))
-			ln->right = fn;
-		else
-			ln->left  = fn;
-
-		fn->parent = ln;
 	}
 	return ln;
 }
 
 int ivi_rule6_insert(struct rule_info *rule)
 {
+	struct rule6_fib *old = NULL;
 	int ret, plen6;
 
 	if (rule->plen4 > 0) {
@@ -325,12 +435,14 @@ int ivi_rule6_insert(struct rule_info *rule)
 #endif
 	} else {
 		ret = 0;
+		old = rule6_fib_invalidate();
 #ifdef IVI_DEBUG_RULE
 		printk(KERN_DEBUG "ivi_rule6_insert: " NIP6_FMT " plen6 = %d, prefix4 = " NIP4_FMT ", plen4 = %d, ratio = %d, adjacent = %d, addr-format %d\n", 
 			NIP6(rule->prefix6), rule->plen6, NIP4(rule->prefix4), rule->plen4, rule->ratio, rule->adjacent, rule->format);
 #endif
 	}
 	spin_unlock_bh(&radix_lock);
+	rule6_fib_release(old);
 	return ret;
 }
 
@@ -339,23 +451,23 @@ int ivi_rule6_insert(struct rule_info *rule)
  * Rule lookup
  */
 
+// Must be called under rcu_read_lock
 static struct rule6_node* radix_lookup(const struct in6_addr *addr)
 {
 	struct rule6_node *fn, *next;
 	u32 dir;
 
-	if (unlikely(!radix))  /* empty radix tree */
+	fn = rcu_dereference(radix);
+	if (unlikely(!fn))  /* empty radix tree */
 		return NULL;
 
 	/*
 	 * Descend on a tree
 	 */
-	fn = radix;
-
 	for (;;) {
 		dir = addr_bit_set(addr, fn->bit_pos);
 
-		next = dir ? fn->right : fn->left;
+		next = dir ? rcu_dereference(fn->right) : rcu_dereference(fn->left);
 
 		if (!next)
 			break;
@@ -370,16 +482,64 @@ static struct rule6_node* radix_lookup(const struct in6_addr *addr)
 		}
 
 		/* backtrace */
-		fn = fn->parent;
+		fn = rcu_dereference(fn->parent);
 	}
 
 	return NULL;
 }
 
+// RULE6_STRIDE bits of the address (hi, lo) starting at bit 'pos', bits past 128 read as 0
+static __inline__ u32 addr_chunk(u64 hi, u64 lo, int pos)
+{
+	if (pos <= 64 - RULE6_STRIDE)
+		return (hi >> (64 - RULE6_STRIDE - pos)) & ((1 << RULE6_STRIDE) - 1);
+	if (pos < 64)
+		return ((hi << (pos + RULE6_STRIDE - 64)) | (lo >> (128 - RULE6_STRIDE - pos))) & ((1 << RULE6_STRIDE) - 1);
+	if (pos <= 128 - RULE6_STRIDE)
+		return (lo >> (128 - RULE6_STRIDE - pos)) & ((1 << RULE6_STRIDE) - 1);
+	return (lo << (pos + RULE6_STRIDE - 128)) & ((1 << RULE6_STRIDE) - 1);
+}
+
+static __inline__ void addr_split(const struct in6_addr *addr, u64 *hi, u64 *lo)
+{
+	*hi = (u64)ntohl(addr->s6_addr32[0]) << 32 | ntohl(addr->s6_addr32[1]);
+	*lo = (u64)ntohl(addr->s6_addr32[2]) << 32 | ntohl(addr->s6_addr32[3]);
+}
+
+// Must be called under rcu_read_lock
+static struct rule6_mrule* rule6_fib_lookup(struct rule6_fib *fib, const struct in6_addr *addr)
+{
+	struct rule6_mnode *node;
+	u64 hi, lo, bit;
+	u32 leaf;
+	int pos;
+
+	if (!ipv6_prefix_equal(&fib->skip, addr, fib->skip_len))
+		return NULL;
+
+	addr_split(addr, &hi, &lo);
+	node = fib->nodes;
+	pos = fib->skip_len;
+
+	for (;;) {
+		bit = 1ULL << addr_chunk(hi, lo, pos);
+		if (!(node->vector & bit))
+			break;
+		node = &fib->nodes[node->base1 + hweight64(node->vector & ((bit << 1) - 1)) - 1];
+		pos += RULE6_STRIDE;
+	}
+
+	leaf = fib->leaves[node->base0 + hweight64(node->leafvec & ((bit << 1) - 1)) - 1];
+	return leaf ? &fib->rules[leaf - 1] : NULL;
+}
+
 int ivi_rule6_lookup(struct in6_addr *addr, int *plen, u32 *prefix4, int *plen4, u16 *ratio, u16 *adjacent, u8 *fmt)
 {
+	struct rule6_fib *fib;
+	struct rule6_mrule *r, rn;
 	struct rule6_node* n;
 	int ret;
+	u64 start;
 
 	if (!plen)
 		return -1;
@@ -387,31 +547,49 @@ int ivi_rule6_lookup(struct in6_addr *addr, int *plen, u32 *prefix4, int *plen4,
 	ret = -1;
 	*plen = 0;
 
-	spin_lock_bh(&radix_lock);
-	
-	n = radix_lookup(addr);
+	trace_ivi_rule6_lookup_enter(addr);
+	start = ivi_lat_begin();
+
+	rcu_read_lock();
 
-	if (n) {
+	r = NULL;
+	fib = rcu_dereference(rule6_fib);
+	if (fib) {
+		r = rule6_fib_lookup(fib, addr);
+	} else if ((n = radix_lookup(addr)) != NULL) {
+		/* no compiled table since the last change */
 #ifdef IVI_DEBUG_RULE
 		printk(KERN_DEBUG "ivi_rule6_lookup: " NIP6_FMT " -> %d\n", NIP6(n->key), n->bit_pos);
 #endif
+		rn.prefix4 = n->prefix4;
+		rn.plen6 = n->plen6;
+		rn.plen4 = n->plen4;
+		rn.ratio = n->ratio;
+		rn.adjacent = n->adjacent;
+		rn.format = n->format;
+		r = &rn;
+	}
+
+	if (r) {
 		if (plen)
-			*plen = n->plen6;
+			*plen = r->plen6;
 		if (prefix4)
-			*prefix4 = n->prefix4;
+			*prefix4 = r->prefix4;
 		if (plen4)
-			*plen4 = n->plen4;
+			*plen4 = r->plen4;
 		if (ratio)
-			*ratio = n->ratio;
+			*ratio = r->ratio;
 		if (adjacent)
-			*adjacent = n->adjacent;
+			*adjacent = r->adjacent;
 		if (fmt)
-			*fmt = n->format;
+			*fmt = r->format;
 		ret = 0;
 	}
 	
-	spin_unlock_bh(&radix_lock);
+	rcu_read_unlock();
 
+	ivi_lat_end(IVI_LAT_RULE6, start);
+	trace_ivi_rule6_lookup_exit(addr, ret);
 	return ret;
 	
 }
@@ -453,33 +631,14 @@ static struct rule6_node* radix_delete_trim(struct rule6_node* fn)
 		fn = pn;  /* backtrace */
 	} else if (children == 1) {
 		/* move the single child up */
-		child->parent = pn;
-
-		if (!pn) {
-			/* child is root now */
-			radix = child;
-		} else {
-			/* update parent pointers */
-			if (pn->left == fn)
-				pn->left = child;
-			else
-				pn->right = child;
-		}
+		rcu_assign_pointer(child->parent, pn);
+		node_relink(pn, fn, child);
 	
 		node_free(fn);
 		fn = pn;  /* backtrace */
 	} else {
 		/* 'fn' is leaf, simply free it */
-		if (!pn) {
-			/* radix tree is empty now */
-			radix = NULL;
-		} else {
-			/* update parent pointers */
-			if (pn->left == fn)
-				pn->left = NULL;
-			else
-				pn->right = NULL;
-		}
+		node_relink(pn, fn, NULL);  /* the tree may be empty now */
 		node_free(fn);
 		fn = pn;  /* backtrace */
 	}
@@ -511,33 +670,14 @@ static struct rule6_node* radix_delete_trim(struct rule6_node* fn)
 			break;
 		} else if (children == 1) {
 			/* move the single child up */
-			child->parent = pn;
-
-			if (!pn) {
-				/* child is root now */
-				radix = child;
-			} else {
-				/* update parent pointers */
-				if (pn->left == fn)
-					pn->left = child;
-				else
-					pn->right = child;
-			}
+			rcu_assign_pointer(child->parent, pn);
+			node_relink(pn, fn, child);
 		
 			node_free(fn);
 			fn = pn;  /* backtrace */
 		} else {
 			/* 'fn' is leaf, simply free it */
-			if (!pn) {
-				/* radix tree is empty now */
-				radix = NULL;
-			} else {
-				/* update parent pointers */
-				if (pn->left == fn)
-					pn->left = NULL;
-				else
-					pn->right = NULL;
-			}
+			node_relink(pn, fn, NULL);  /* the tree may be empty now */
 			node_free(fn);
 			fn = pn;  /* backtrace */
 		}
@@ -548,6 +688,7 @@ static struct rule6_node* radix_delete_trim(struct rule6_node* fn)
 
 int ivi_rule6_delete(struct rule_info *rule)
 {
+	struct rule6_fib *old = NULL;
 	struct rule6_node *fn, *next;
 	u32 dir;
 	int ret, plen6;
@@ -596,15 +737,17 @@ int ivi_rule6_delete(struct rule_info *rule)
 	    && (fn->adjacent == rule->adjacent)
 	    && (fn->format == rule->format)
 	    && ipv6_prefix_equal(&fn->key, &rule->prefix6, fn->bit_pos)) {
-		if (radix_delete_trim(fn) != NULL) {
-			ret = 0;
+		/* NULL only means the trim reached the root or emptied the tree, the rule is gone either way */
+		radix_delete_trim(fn);
+		ret = 0;
+		old = rule6_fib_invalidate();
 #ifdef IVI_DEBUG_RULE
-			printk(KERN_DEBUG "ivi_rule6_delete: " NIP6_FMT "/%d\n", NIP6(rule->prefix6), rule->plen6);
+		printk(KERN_DEBUG "ivi_rule6_delete: " NIP6_FMT "/%d\n", NIP6(rule->prefix6), rule->plen6);
 #endif
-		}
 	}
 
 	spin_unlock_bh(&radix_lock);
+	rule6_fib_release(old);
 
 	return ret;
 }
@@ -664,8 +807,257 @@ static struct rule6_node* first_rule6_info(void)
 	return next_rule6_info(radix);
 }
 
+
+/*
+ * Compiled lookup table
+ */
+
+struct rule6_build {
+	struct rule6_fib *fib;  // NULL while the nodes and leaves are only counted
+	struct in6_addr *keys;  // key of each rule, masked to its length
+	int *lens;  // bit_pos of each rule
+	u32 *idx;
+	u32 leaf[RULE6_LEVELS][1 << RULE6_STRIDE];  // leaves of the node being built at each level
+	int nr_nodes;
+	int nr_leaves;
+};
+
+static __inline__ void addr_mask(struct in6_addr *addr, int plen)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, plen -= 32) {
+		if (plen <= 0)
+			addr->s6_addr32[i] = 0;
+		else if (plen < 32)
+			addr->s6_addr32[i] &= htonl(~0U << (32 - plen));
+	}
+}
+
+static __inline__ u32 key_chunk(const struct in6_addr *key, int pos)
+{
+	u64 hi, lo;
+
+	addr_split(key, &hi, &lo);
+	return addr_chunk(hi, lo, pos);
+}
+
+static __inline__ int leaf_len(struct rule6_build *b, u32 leaf)
+{
+	return leaf ? b->lens[leaf - 1] : -1;
+}
+
+/*
+ * Build node 'pos' at bit 'offset' for the rules idx[0..n), which are all longer than
+ * 'offset' and in traversal order, i.e. sorted by key with a prefix before the longer
+ * ones. 'inherit' is the rule covering the whole node. The children of the node are
+ * allocated next to each other before they are built, as the lookup expects.
+ */
+static void rule6_build_node(struct rule6_build *b, u32 pos, int offset, int depth, u32 *idx, int n, u32 inherit)
+{
+	struct rule6_mnode node;
+	u32 *leaf = b->leaf[depth];
+	u32 last = 0;
+	int end = offset + RULE6_STRIDE;
+	int i, j, k, s, len;
+
+	for (s = 0; s < (1 << RULE6_STRIDE); s++)
+		leaf[s] = inherit;
+
+	/* a rule ending at this level covers a range of slots, the longest rule wins;
+	   the other rules are kept in order at the head of idx for the children */
+	for (i = 0, k = 0; i < n; i++) {
+		len = b->lens[idx[i]];
+		if (len > end) {
+			idx[k++] = idx[i];
+			continue;
+		}
+		s = key_chunk(&b->keys[idx[i]], offset);
+		for (j = s; j < s + (1 << (end - len)); j++) {
+			if (leaf_len(b, leaf[j]) < len)
+				leaf[j] = idx[i] + 1;
+		}
+	}
+
+	memset(&node, 0, sizeof(node));
+	for (i = 0; i < k; i++)
+		node.vector |= 1ULL << key_chunk(&b->keys[idx[i]], offset);
+
+	node.base1 = b->nr_nodes;
+	b->nr_nodes += hweight64(node.vector);
+
+	node.base0 = b->nr_leaves;
+	for (s = 0; s < (1 << RULE6_STRIDE); s++) {
+		if (node.vector & (1ULL << s))
+			continue;
+		if (!node.leafvec || leaf[s] != last) {
+			node.leafvec |= 1ULL << s;
+			if (b->fib)
+				b->fib->leaves[b->nr_leaves] = leaf[s];
+			b->nr_leaves++;
+			last = leaf[s];
+		}
+	}
+
+	if (b->fib)
+		b->fib->nodes[pos] = node;
+
+	/* the rules of a child are contiguous and the children come in slot order */
+	for (i = 0, n = 0; i < k; i = j, n++) {
+		s = key_chunk(&b->keys[idx[i]], offset);
+		for (j = i + 1; j < k && key_chunk(&b->keys[idx[j]], offset) == s; j++)
+			;
+		rule6_build_node(b, node.base1 + n, end, depth + 1, idx + i, j - i, leaf[s]);
+	}
+}
+
+static void rule6_build_pass(struct rule6_build *b, int skip_len, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		b->idx[i] = i;
+	b->nr_nodes = 1;
+	b->nr_leaves = 0;
+	rule6_build_node(b, 0, skip_len, 0, b->idx, n, 0);
+}
+
+/*
+ * Compile the rules of the radix tree into a new lookup table and publish it, unless
+ * the tree changed in the meantime. Called by rule6_fib_work, may sleep.
+ */
+int ivi_rule6_rebuild(void)
+{
+	struct rule6_build *b;
+	struct rule6_fib *fib, *old = NULL;
+	struct rule6_node *r;
+	u32 gen;
+	int n, i, ret;
+
+	/* size the copy of the rules, the tree may change while it is allocated */
+	spin_lock_bh(&radix_lock);
+	gen = rule6_gen;
+	for (n = 0, r = first_rule6_info(); r; r = next_rule6_info(r))
+		n++;
+	spin_unlock_bh(&radix_lock);
+
+	if (n == 0)
+		return 0;  // the empty tree is looked up as fast
+
+	ret = -ENOMEM;
+	b = kzalloc(sizeof(struct rule6_build), GFP_KERNEL);
+	fib = kzalloc(sizeof(struct rule6_fib), GFP_KERNEL);
+	if (b == NULL || fib == NULL)
+		goto out;
+
+	b->keys = (struct in6_addr *)vmalloc(n * sizeof(struct in6_addr));
+	b->lens = (int *)vmalloc(n * sizeof(int));
+	b->idx = (u32 *)vmalloc(n * sizeof(u32));
+	fib->rules = (struct rule6_mrule *)vmalloc(n * sizeof(struct rule6_mrule));
+	if (b->keys == NULL || b->lens == NULL || b->idx == NULL || fib->rules == NULL)
+		goto out;
+
+	spin_lock_bh(&radix_lock);
+	if (gen != rule6_gen) {
+		/* the change has scheduled rule6_fib_work again */
+		spin_unlock_bh(&radix_lock);
+		ret = -EAGAIN;
+		goto out;
+	}
+	for (i = 0, r = first_rule6_info(); r; r = next_rule6_info(r), i++) {
+		b->keys[i] = r->key;
+		addr_mask(&b->keys[i], r->bit_pos);
+		b->lens[i] = r->bit_pos;
+		fib->rules[i].prefix4 = r->prefix4;
+		fib->rules[i].plen6 = r->plen6;
+		fib->rules[i].plen4 = r->plen4;
+		fib->rules[i].ratio = r->ratio;
+		fib->rules[i].adjacent = r->adjacent;
+		fib->rules[i].format = r->format;
+	}
+	spin_unlock_bh(&radix_lock);
+	fib->nr_rules = n;
+
+	/* bits shared by all the rules, no rule is shorter */
+	fib->skip_len = b->lens[0];
+	for (i = 1; i < n; i++) {
+		if (b->lens[i] < fib->skip_len)
+			fib->skip_len = b->lens[i];
+	}
+	for (i = 1; i < n; i++) {
+		if (!ipv6_prefix_equal(&b->keys[0], &b->keys[i], fib->skip_len))
+			fib->skip_len = ipv6_addr_diff(&b->keys[0], &b->keys[i]);
+	}
+	fib->skip = b->keys[0];
+	addr_mask(&fib->skip, fib->skip_len);
+
+	/* count the nodes and leaves, then fill them in */
+	rule6_build_pass(b, fib->skip_len, n);
+	fib->nodes = (struct rule6_mnode *)vmalloc(b->nr_nodes * sizeof(struct rule6_mnode));
+	fib->leaves = (u32 *)vmalloc(b->nr_leaves * sizeof(u32));
+	if (fib->nodes == NULL || (b->nr_leaves && fib->leaves == NULL))
+		goto out;
+
+	b->fib = fib;
+	rule6_build_pass(b, fib->skip_len, n);
+	fib->nr_nodes = b->nr_nodes;
+	fib->nr_leaves = b->nr_leaves;
+	fib->size = sizeof(struct rule6_fib) + fib->nr_nodes * sizeof(struct rule6_mnode)
+		+ fib->nr_leaves * sizeof(u32) + n * sizeof(struct rule6_mrule);
+
+	spin_lock_bh(&radix_lock);
+	if (gen == rule6_gen) {
+		old = rule6_fib;
+		rcu_assign_pointer(rule6_fib, fib);
+		ret = 0;
+	} else {
+		ret = -EAGAIN;
+	}
+	spin_unlock_bh(&radix_lock);
+
+	if (ret == 0) {
+#ifdef IVI_DEBUG_RULE
+		printk(KERN_DEBUG "ivi_rule6_rebuild: %d rules, skip %d bits, %d nodes, %d leaves\n",
+			n, fib->skip_len, fib->nr_nodes, fib->nr_leaves);
+#endif
+		fib = NULL;
+		rule6_fib_release(old);
+	}
+
+out:
+	if (b) {
+		vfree(b->keys);
+		vfree(b->lens);
+		vfree(b->idx);
+		kfree(b);
+	}
+	if (fib)
+		rule6_fib_free(fib);
+	return ret;
+}
+
+static void rule6_fib_rebuild(struct work_struct *work)
+{
+	if (ivi_rule6_rebuild() == -ENOMEM)
+		printk(KERN_WARNING "IVI: ivi_rule6 failed to build the lookup table, using the radix tree.\n");
+}
+
+// Bytes of the lookup table in use, 0 while lookups walk the radix tree
+unsigned long ivi_rule6_table_size(void)
+{
+	struct rule6_fib *fib;
+	unsigned long size;
+
+	rcu_read_lock();
+	fib = rcu_dereference(rule6_fib);
+	size = fib ? fib->size : 0;
+	rcu_read_unlock();
+	return size;
+}
+
 void ivi_rule6_flush(void)
 {
+	struct rule6_fib *old;
 	struct rule6_node *r, *rr = NULL;
 
 	spin_lock_bh(&radix_lock);
@@ -682,13 +1074,18 @@ void ivi_rule6_flush(void)
 	if (rr)
 		radix_delete_trim(rr);
 
+	old = rule6_fib_invalidate();
 	spin_unlock_bh(&radix_lock);
+	rule6_fib_release(old);
 }
 
 
 int ivi_rule6_init(void) {
 	radix = NULL;
 	spin_lock_init(&radix_lock);
+	rule6_fib = NULL;
+	rule6_gen = 0;
+	INIT_DELAYED_WORK(&rule6_fib_work, rule6_fib_rebuild);
 #ifdef IVI_DEBUG
 	balance = 0;
 	printk(KERN_DEBUG "IVI: ivi_rule6 loaded.\n");
@@ -698,6 +1095,8 @@ int ivi_rule6_init(void) {
 
 void ivi_rule6_exit(void) {
 	ivi_rule6_flush();
+	cancel_delayed_work_sync(&rule6_fib_work);  // the flush dropped the table
+	rcu_barrier(); // wait for the nodes freed by the flush
 #ifdef IVI_DEBUG
 	printk(KERN_DEBUG "IVI: ivi_rule6 unloaded.\n");
 	printk(KERN_DEBUG "IVI: ivi_rule6 memory balance = %d\n", balance);
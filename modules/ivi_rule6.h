@@ -41,11 +41,14 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 
 #include "ivi_config.h"
 #include "ivi_rule.h"
+#include "ivi_trace.h"
 
 extern u8 u_byte;
 
@@ -73,6 +76,8 @@ extern int ivi_rule6_insert(struct rule_info *rule);
 extern int ivi_rule6_lookup(struct in6_addr *addr, int *plen, u32 *prefix4, int *plen4, u16 *ratio, u16 *adjacent, u8 *fmt);
 extern int ivi_rule6_delete(struct rule_info *rule);
 extern void ivi_rule6_flush(void);
+extern int ivi_rule6_rebuild(void);  // compile the lookup table now instead of in the delayed work
+extern unsigned long ivi_rule6_table_size(void);
 
 extern int ivi_rule6_init(void);
 extern void ivi_rule6_exit(void);
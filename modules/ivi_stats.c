@@ -0,0 +1,154 @@
+/*************************************************************************
+ *
+ * ivi_stats.c :
+ *
+ * This file keeps the per-CPU packet counters of the module and shows
+ * them, summed over all CPUs, in /proc/net/ivi/stats together with the
+ * occupancy of the session tables and of their port pools.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <net/net_namespace.h>
+
+#include "ivi_stats.h"
+#include "ivi_map.h"
+#include "ivi_map_tcp.h"
+#include "ivi_rule6.h"
+
+DEFINE_PER_CPU(struct ivi_stats, ivi_stats);
+
+static const char *const ivi_stat_names[IVI_STAT_MAX] = {
+	"v4v6_tcp",
+	"v4v6_udp",
+	"v4v6_icmp",
+	"v4v6_other",
+	"v6v4_tcp",
+	"v6v4_udp",
+	"v6v4_icmp",
+	"v6v4_other",
+	"rx_fastpath",
+	"drop_nomem",
+	"drop_nomap",
+	"drop_port",
+	"drop_icmp",
+	"drop_proto",
+	"drop_gso",
+	"drop_frag",
+	"alloc_fail",
+	"port_full",
+};
+
+static struct proc_dir_entry *ivi_proc_dir;
+
+static void ivi_stats_show_list(struct seq_file *seq, const char *name, struct map_list *list) {
+	int size, in_use, ports;
+
+	spin_lock_bh(&list->lock);
+	size = list->size;
+	in_use = ivi_port_in_use(list->ports);
+	ports = list->ports->size;
+	spin_unlock_bh(&list->lock);
+
+	seq_printf(seq, "%s_sessions %d\n", name, size);
+	seq_printf(seq, "%s_ports %d/%d\n", name, in_use, ports);
+}
+
+static int ivi_stats_show(struct seq_file *seq, void *v) {
+	struct ivi_port_pool *pool;
+	u64 sum[IVI_STAT_MAX];
+	int cpu, i, size, in_use, ports;
+
+	memset(sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < IVI_STAT_MAX; i++)
+			sum[i] += per_cpu(ivi_stats, cpu).counter[i];
+	}
+	for (i = 0; i < IVI_STAT_MAX; i++)
+		seq_printf(seq, "%s %llu\n", ivi_stat_names[i], (unsigned long long)sum[i]);
+
+	ivi_stats_show_list(seq, "udp", &udp_list);
+	ivi_stats_show_list(seq, "icmp", &icmp_list);
+
+	// The TCP pool is swapped under RCU, see ivi_map_tcp_port_setup()
+	rcu_read_lock();
+	size = tcp_list.size;
+	pool = rcu_dereference(tcp_list.ports);
+	in_use = ivi_port_in_use(pool);
+	ports = pool->size;
+	rcu_read_unlock();
+
+	seq_printf(seq, "tcp_sessions %d\n", size);
+	seq_printf(seq, "tcp_ports %d/%d\n", in_use, ports);
+	seq_printf(seq, "tcp_flows %d\n", ivi_map_tcp_flow_count());
+	seq_printf(seq, "frag_flows %d\n", ivi_frag_count());
+
+	// Compiled rule tables, 0 while lookups walk the tries
+	seq_printf(seq, "rule_table_bytes %lu\n", ivi_rule_table_size());
+	seq_printf(seq, "rule6_table_bytes %lu\n", ivi_rule6_table_size());
+	return 0;
+}
+
+static int ivi_stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, ivi_stats_show, NULL);
+}
+
+static const struct file_operations ivi_stats_fops = {
+	.owner		=	THIS_MODULE,
+	.open		=	ivi_stats_open,
+	.read		=	seq_read,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+};
+
+int ivi_stats_init(void) {
+	if ((ivi_proc_dir = proc_mkdir("ivi", init_net.proc_net)) == NULL) {
+		printk(KERN_ERR "ivi_stats_init: failed to create /proc/net/ivi.\n");
+		return -ENOMEM;
+	}
+	if (proc_create("stats", S_IRUGO, ivi_proc_dir, &ivi_stats_fops) == NULL) {
+		printk(KERN_ERR "ivi_stats_init: failed to create /proc/net/ivi/stats.\n");
+		remove_proc_entry("ivi", init_net.proc_net);
+		return -ENOMEM;
+	}
+#ifdef IVI_DEBUG
+	printk(KERN_DEBUG "IVI: ivi_stats loaded.\n");
+#endif
+	return 0;
+}
+
+void ivi_stats_exit(void) {
+	remove_proc_entry("stats", ivi_proc_dir);
+	remove_proc_entry("ivi", init_net.proc_net);
+#ifdef IVI_DEBUG
+	printk(KERN_DEBUG "IVI: ivi_stats unloaded.\n");
+#endif
+}
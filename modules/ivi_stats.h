@@ -0,0 +1,79 @@
+/*************************************************************************
+ *
+ * ivi_stats.h :
+ *
+ * This file is the header file for the 'ivi_stats.c' file.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#ifndef IVI_STATS_H
+#define IVI_STATS_H
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/percpu.h>
+
+#include "ivi_config.h"
+
+enum {
+	IVI_STAT_V4V6_TCP,     // Packets handed back to the stack as IPv6, by IPv4 protocol
+	IVI_STAT_V4V6_UDP,
+	IVI_STAT_V4V6_ICMP,
+	IVI_STAT_V4V6_OTHER,
+	IVI_STAT_V6V4_TCP,     // Packets handed back to the stack as IPv4
+	IVI_STAT_V6V4_UDP,
+	IVI_STAT_V6V4_ICMP,
+	IVI_STAT_V6V4_OTHER,
+	IVI_STAT_RX_FAST,      // Packets of either direction taken by the rx_handler, see rx_fastpath
+	IVI_STAT_DROP_NOMEM,   // Silent drops: no memory for the packet
+	IVI_STAT_DROP_NOMAP,   // no session for the packet and none could be created
+	IVI_STAT_DROP_PORT,    // destination port outside of the local PSID
+	IVI_STAT_DROP_ICMP,    // ICMP type that is not translated
+	IVI_STAT_DROP_PROTO,   // transport protocol that is not translated
+	IVI_STAT_DROP_GSO,     // GSO packet that can be neither translated nor segmented
+	IVI_STAT_DROP_FRAG,    // later IPv6 fragment with no first one seen, or first one with its fragment chain full
+	IVI_STAT_ALLOC_FAIL,   // Failed skb and session allocations
+	IVI_STAT_PORT_FULL,    // Port allocations failed for lack of a free port of the local PSID
+	IVI_STAT_MAX
+};
+
+struct ivi_stats {
+	u64 counter[IVI_STAT_MAX];
+};
+
+DECLARE_PER_CPU(struct ivi_stats, ivi_stats);
+
+// Counters are only updated by the local CPU, without lock or atomic operation, and summed on read
+#define IVI_STATS_INC(i)	this_cpu_inc(ivi_stats.counter[(i)])
+
+extern int ivi_stats_init(void);
+extern void ivi_stats_exit(void);
+
+#endif /* IVI_STATS_H */
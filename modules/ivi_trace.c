@@ -0,0 +1,134 @@
+/*************************************************************************
+ *
+ * ivi_trace.c :
+ *
+ * This file creates the tracepoints of the translation path and keeps
+ * the optional per-CPU log2 latency histograms of its steps, shown and
+ * switched on in debugfs: write 1 to /sys/kernel/debug/ivi/latency_enable
+ * and read /sys/kernel/debug/ivi/latency, any write to which clears it.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define CREATE_TRACE_POINTS
+#include "ivi_trace.h"
+
+DEFINE_PER_CPU(struct ivi_lat, ivi_lat);
+
+u8 ivi_lat_enabled __read_mostly = 0;
+
+static const char *const ivi_lat_names[IVI_LAT_MAX] = {
+	"rule_lookup",
+	"rule6_lookup",
+	"session_udp",
+	"session_icmp",
+	"session_tcp",
+	"port_alloc",
+	"skb_alloc",
+	"csum",
+};
+
+static struct dentry *ivi_debugfs_dir;
+
+static int ivi_lat_show(struct seq_file *seq, void *v) {
+	u64 sum[IVI_LAT_BUCKETS];
+	int cpu, i, j, last;
+
+	for (i = 0; i < IVI_LAT_MAX; i++) {
+		memset(sum, 0, sizeof(sum));
+		last = -1;
+		for (j = 0; j < IVI_LAT_BUCKETS; j++) {
+			for_each_possible_cpu(cpu)
+				sum[j] += per_cpu(ivi_lat, cpu).bucket[i][j];
+			if (sum[j])
+				last = j;
+		}
+
+		seq_printf(seq, "%s (ns):\n", ivi_lat_names[i]);
+		for (j = 0; j <= last; j++) {
+			if (j == 0)
+				seq_printf(seq, "  [0, 1) %llu\n", (unsigned long long)sum[j]);
+			else if (j == IVI_LAT_BUCKETS - 1)
+				seq_printf(seq, "  [%llu, ...) %llu\n", 1ULL << (j - 1), (unsigned long long)sum[j]);
+			else
+				seq_printf(seq, "  [%llu, %llu) %llu\n", 1ULL << (j - 1), 1ULL << j, \
+				           (unsigned long long)sum[j]);
+		}
+	}
+	return 0;
+}
+
+static int ivi_lat_open(struct inode *inode, struct file *file) {
+	return single_open(file, ivi_lat_show, NULL);
+}
+
+// Any write clears the histograms, updates running at the same time on other CPUs may survive it
+static ssize_t ivi_lat_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(ivi_lat, cpu), 0, sizeof(struct ivi_lat));
+	return count;
+}
+
+static const struct file_operations ivi_lat_fops = {
+	.owner		=	THIS_MODULE,
+	.open		=	ivi_lat_open,
+	.read		=	seq_read,
+	.write		=	ivi_lat_write,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+};
+
+// Tracepoints do not depend on debugfs, the module loads without the histograms if it is missing
+int ivi_trace_init(void) {
+	ivi_debugfs_dir = debugfs_create_dir("ivi", NULL);
+	if (IS_ERR_OR_NULL(ivi_debugfs_dir)) {
+		printk(KERN_WARNING "ivi_trace_init: debugfs is not available, no latency histograms.\n");
+		ivi_debugfs_dir = NULL;
+		return 0;
+	}
+	debugfs_create_u8("latency_enable", S_IRUGO | S_IWUSR, ivi_debugfs_dir, &ivi_lat_enabled);
+	debugfs_create_file("latency", S_IRUGO | S_IWUSR, ivi_debugfs_dir, NULL, &ivi_lat_fops);
+#ifdef IVI_DEBUG
+	printk(KERN_DEBUG "IVI: ivi_trace loaded.\n");
+#endif
+	return 0;
+}
+
+void ivi_trace_exit(void) {
+	ivi_lat_enabled = 0;
+	debugfs_remove_recursive(ivi_debugfs_dir);
+#ifdef IVI_DEBUG
+	printk(KERN_DEBUG "IVI: ivi_trace unloaded.\n");
+#endif
+}
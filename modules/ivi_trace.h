@@ -0,0 +1,277 @@
+/*************************************************************************
+ *
+ * ivi_trace.h :
+ *
+ * This file is the header file for the 'ivi_trace.c' file.
+ *
+ * Copyright (C) 2013 CERNET Network Center
+ * All rights reserved.
+ * 
+ * Design and coding: 
+ *   Xing Li <xing@cernet.edu.cn> 
+ *	 Congxiao Bao <congxiao@cernet.edu.cn>
+ *   Guoliang Han <bupthgl@gmail.com>
+ * 	 Yuncheng Zhu <haoyu@cernet.edu.cn>
+ * 	 Wentao Shang <wentaoshang@gmail.com>
+ * 	 
+ * Contributions:
+ *
+ * This file is part of MAP-T/MAP-E Kernel Module.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with MAP-T/MAP-E Kernel Module. If not, see 
+ * <http://www.gnu.org/licenses/>.
+ *
+ * For more versions, please send an email to <bupthgl@gmail.com> to
+ * obtain an password to access the svn server.
+ *
+ * LIC: GPLv2
+ *
+ ************************************************************************/
+
+#ifndef IVI_TRACE_LAT_H
+#define IVI_TRACE_LAT_H
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/sched.h>
+
+#include "ivi_config.h"
+
+enum {
+	IVI_LAT_RULE,          // ivi_rule_lookup()
+	IVI_LAT_RULE6,         // ivi_rule6_lookup()
+	IVI_LAT_SESSION_UDP,   // get_outflow_map_port() and get_inflow_map_port() on udp_list
+	IVI_LAT_SESSION_ICMP,  // the same on icmp_list
+	IVI_LAT_SESSION_TCP,   // get_outflow_tcp_map_port() and get_inflow_tcp_map_port()
+	IVI_LAT_PORT_ALLOC,    // ivi_port_alloc()
+	IVI_LAT_SKB_ALLOC,     // allocation of the skb of a translated packet
+	IVI_LAT_CSUM,          // checksum over the payload of a translated packet
+	IVI_LAT_MAX
+};
+
+// Bucket i counts the latencies in [2^(i-1), 2^i) ns, the last one also all longer ones
+#define IVI_LAT_BUCKETS	32
+
+struct ivi_lat {
+	u64 bucket[IVI_LAT_MAX][IVI_LAT_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct ivi_lat, ivi_lat);
+
+extern u8 ivi_lat_enabled;
+
+// Latency histograms are off until enabled in debugfs, till then the clock is never read
+static inline u64 ivi_lat_begin(void) {
+	return unlikely(ivi_lat_enabled) ? local_clock() : 0;
+}
+
+static inline void ivi_lat_end(int item, u64 start) {
+	if (unlikely(start))
+		this_cpu_inc(ivi_lat.bucket[item][min_t(int, fls64(local_clock() - start), IVI_LAT_BUCKETS - 1)]);
+}
+
+extern int ivi_trace_init(void);
+extern void ivi_trace_exit(void);
+
+#endif /* IVI_TRACE_LAT_H */
+
+/*
+ * Tracepoints of the translation path, in enter/exit pairs so that perf or bpftrace can
+ * tell the time spent in each step, e.g. 'perf record -e ivi:*'.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ivi
+
+#if !defined(IVI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define IVI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ivi_rule_lookup_enter,
+	TP_PROTO(u32 addr),
+	TP_ARGS(addr),
+	TP_STRUCT__entry(
+		__field(u32, addr)
+	),
+	TP_fast_assign(
+		__entry->addr = addr;
+	),
+	TP_printk("addr=" NIP4_FMT, NIP4(__entry->addr))
+);
+
+TRACE_EVENT(ivi_rule_lookup_exit,
+	TP_PROTO(u32 addr, int ret),
+	TP_ARGS(addr, ret),
+	TP_STRUCT__entry(
+		__field(u32, addr)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->ret = ret;
+	),
+	TP_printk("addr=" NIP4_FMT " ret=%d", NIP4(__entry->addr), __entry->ret)
+);
+
+TRACE_EVENT(ivi_rule6_lookup_enter,
+	TP_PROTO(const struct in6_addr *addr),
+	TP_ARGS(addr),
+	TP_STRUCT__entry(
+		__array(u8, addr, 16)
+	),
+	TP_fast_assign(
+		memcpy(__entry->addr, addr, 16);
+	),
+	TP_printk("addr=%pI6c", __entry->addr)
+);
+
+TRACE_EVENT(ivi_rule6_lookup_exit,
+	TP_PROTO(const struct in6_addr *addr, int ret),
+	TP_ARGS(addr, ret),
+	TP_STRUCT__entry(
+		__array(u8, addr, 16)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		memcpy(__entry->addr, addr, 16);
+		__entry->ret = ret;
+	),
+	TP_printk("addr=%pI6c ret=%d", __entry->addr, __entry->ret)
+);
+
+// addr and port are the local source of an outflow session, the remote source and mapped port of an inflow one
+TRACE_EVENT(ivi_session_lookup_enter,
+	TP_PROTO(u8 proto, u8 inflow, u32 addr, u16 port),
+	TP_ARGS(proto, inflow, addr, port),
+	TP_STRUCT__entry(
+		__field(u8, proto)
+		__field(u8, inflow)
+		__field(u32, addr)
+		__field(u16, port)
+	),
+	TP_fast_assign(
+		__entry->proto = proto;
+		__entry->inflow = inflow;
+		__entry->addr = addr;
+		__entry->port = port;
+	),
+	TP_printk("proto=%u %s addr=" NIP4_FMT " port=%u", __entry->proto,
+	          __entry->inflow ? "in" : "out", NIP4(__entry->addr), __entry->port)
+);
+
+TRACE_EVENT(ivi_session_lookup_exit,
+	TP_PROTO(u8 proto, u8 inflow, u32 addr, u16 port, int ret),
+	TP_ARGS(proto, inflow, addr, port, ret),
+	TP_STRUCT__entry(
+		__field(u8, proto)
+		__field(u8, inflow)
+		__field(u32, addr)
+		__field(u16, port)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->proto = proto;
+		__entry->inflow = inflow;
+		__entry->addr = addr;
+		__entry->port = port;
+		__entry->ret = ret;
+	),
+	TP_printk("proto=%u %s addr=" NIP4_FMT " port=%u ret=%d", __entry->proto,
+	          __entry->inflow ? "in" : "out", NIP4(__entry->addr), __entry->port, __entry->ret)
+);
+
+TRACE_EVENT(ivi_port_alloc_enter,
+	TP_PROTO(int size),
+	TP_ARGS(size),
+	TP_STRUCT__entry(
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__entry->size = size;
+	),
+	TP_printk("size=%d", __entry->size)
+);
+
+TRACE_EVENT(ivi_port_alloc_exit,
+	TP_PROTO(int size, int port),
+	TP_ARGS(size, port),
+	TP_STRUCT__entry(
+		__field(int, size)
+		__field(int, port)
+	),
+	TP_fast_assign(
+		__entry->size = size;
+		__entry->port = port;
+	),
+	TP_printk("size=%d port=%d", __entry->size, __entry->port)
+);
+
+TRACE_EVENT(ivi_skb_alloc_enter,
+	TP_PROTO(unsigned int len),
+	TP_ARGS(len),
+	TP_STRUCT__entry(
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+	),
+	TP_printk("len=%u", __entry->len)
+);
+
+TRACE_EVENT(ivi_skb_alloc_exit,
+	TP_PROTO(unsigned int len, int failed),
+	TP_ARGS(len, failed),
+	TP_STRUCT__entry(
+		__field(unsigned int, len)
+		__field(int, failed)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->failed = failed;
+	),
+	TP_printk("len=%u failed=%d", __entry->len, __entry->failed)
+);
+
+TRACE_EVENT(ivi_csum_enter,
+	TP_PROTO(u8 proto, int len),
+	TP_ARGS(proto, len),
+	TP_STRUCT__entry(
+		__field(u8, proto)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->proto = proto;
+		__entry->len = len;
+	),
+	TP_printk("proto=%u len=%d", __entry->proto, __entry->len)
+);
+
+TRACE_EVENT(ivi_csum_exit,
+	TP_PROTO(u8 proto, int len),
+	TP_ARGS(proto, len),
+	TP_STRUCT__entry(
+		__field(u8, proto)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->proto = proto;
+		__entry->len = len;
+	),
+	TP_printk("proto=%u len=%d", __entry->proto, __entry->len)
+);
+
+#endif /* IVI_TRACE_H */
+
+// This header is read again from ivi_trace.c to create the tracepoints, see the Makefile
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ivi_trace
+#include <trace/define_trace.h>
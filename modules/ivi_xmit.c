@@ -76,6 +76,40 @@ u8 hgw_transport = 0;  // header manipulation manner
 
 u16 mss_limit = 1440;  // max mss supported
 
+// rewrite the headers of the received skb instead of copying the packet into a new one
+static bool xlate_inplace = true;
+module_param(xlate_inplace, bool, 0644);
+MODULE_PARM_DESC(xlate_inplace, "Translate packets in place instead of copying them into a new buffer");
+
+// route translated packets and send them out instead of feeding them to netif_rx()
+static bool direct_output = false;
+module_param(direct_output, bool, 0644);
+MODULE_PARM_DESC(direct_output, "Route translated packets and transmit them directly instead of re-injecting them into the receive path");
+
+// bytes of headers we may read or rewrite directly through skb->data
+#define IVI_XLATE_PULL 128
+
+// translated packets are queued per CPU and delivered together once the receive softirq is done
+static unsigned int xmit_batch = 0;
+module_param(xmit_batch, uint, 0644);
+MODULE_PARM_DESC(xmit_batch, "Number of translated packets queued per CPU before delivery, 0 to deliver each one at once");
+
+struct ivi_batch {
+	struct sk_buff_head queue;
+	struct tasklet_struct flush;
+};
+
+static DEFINE_PER_CPU(struct ivi_batch, ivi_batch);
+
+// last route taken by a batch, reused while consecutive packets go to the same destination
+struct ivi_route_cache {
+	struct dst_entry *dst;
+	__be16 protocol;
+	u8 nexthdr;
+	u8 tos;
+	struct in6_addr daddr;  // IPv4 destination in the first word
+};
+
 
 #define ADDR_DIR_SRC 0
 #define ADDR_DIR_DST 1
@@ -268,6 +302,520 @@ static int ipaddr_6to4(struct in6_addr *v6addr, u8 _dir, unsigned int *v4addr, u
 	return retval;
 }
 
+/*
+ * Incremental checksum translation (RFC 1624): a transport checksum is moved from one
+ * pseudo-header to the other instead of being computed again over the whole payload.
+ */
+static inline __wsum csum_pseudo4(__be32 saddr, __be32 daddr, unsigned int len, u8 proto) {
+	return csum_tcpudp_nofold(saddr, daddr, len, proto, 0);
+}
+
+static inline __wsum csum_pseudo6(const struct in6_addr *saddr, const struct in6_addr *daddr, unsigned int len, u8 proto) {
+	return ~csum_unfold(csum_ipv6_magic(saddr, daddr, len, proto, 0));
+}
+
+// Full checksums over the payload of a packet, traced and timed; proto is only for the tracepoint
+static inline __wsum ivi_csum_partial(const void *buff, int len, u8 proto) {
+	__wsum csum;
+	u64 start;
+
+	trace_ivi_csum_enter(proto, len);
+	start = ivi_lat_begin();
+	csum = csum_partial(buff, len, 0);
+	ivi_lat_end(IVI_LAT_CSUM, start);
+	trace_ivi_csum_exit(proto, len);
+	return csum;
+}
+
+static inline __wsum ivi_skb_checksum(struct sk_buff *skb, int offset, int len, u8 proto) {
+	__wsum csum;
+	u64 start;
+
+	trace_ivi_csum_enter(proto, len);
+	start = ivi_lat_begin();
+	csum = skb_checksum(skb, offset, len, 0);
+	ivi_lat_end(IVI_LAT_CSUM, start);
+	trace_ivi_csum_exit(proto, len);
+	return csum;
+}
+
+// Allocation of the skb of a packet translated by copy, traced and timed
+static inline struct sk_buff *ivi_alloc_skb(unsigned int len) {
+	struct sk_buff *skb;
+	u64 start;
+
+	trace_ivi_skb_alloc_enter(len);
+	start = ivi_lat_begin();
+	skb = dev_alloc_skb(len);
+	ivi_lat_end(IVI_LAT_SKB_ALLOC, start);
+	trace_ivi_skb_alloc_exit(len, skb == NULL);
+	return skb;
+}
+
+/*
+ * Route a translated packet and hand it to dst_output() ourselves, saving another trip
+ * through the backlog queue, the receive path and our own PRE_ROUTING hook. We do what
+ * the forwarding path would do to the packet. Returns -1, with the packet untouched,
+ * when it has to go through the protocol stack instead: the stack then takes care of
+ * ICMP errors, local delivery and fragmentation.
+ */
+static int ivi_route_output(struct sk_buff *skb, struct ivi_route_cache *rc) {
+	struct net *net = dev_net(skb->dev);
+	struct dst_entry *dst;
+	struct ipv6hdr *ip6h;
+	struct iphdr *ip4h;
+	struct flowi6 fl6;
+	struct flowi4 fl4;
+	struct rtable *rt;
+
+	if (skb->protocol == __constant_htons(ETH_P_IPV6)) {
+		ip6h = ipv6_hdr(skb);
+		if (ip6h->hop_limit <= 1)
+			return -1;
+
+		if (rc && rc->dst && rc->protocol == skb->protocol && rc->nexthdr == ip6h->nexthdr && \
+		    ipv6_addr_equal(&rc->daddr, &ip6h->daddr)) {
+			dst = dst_clone(rc->dst);
+		} else {
+			memset(&fl6, 0, sizeof(fl6));
+			fl6.daddr = ip6h->daddr;
+			fl6.flowi6_proto = ip6h->nexthdr;
+			dst = ip6_route_output(net, NULL, &fl6);
+			if (dst->error) {
+				dst_release(dst);
+				return -1;
+			}
+			if (rc) {
+				dst_release(rc->dst);
+				rc->dst = dst_clone(dst);
+				rc->protocol = skb->protocol;
+				rc->nexthdr = ip6h->nexthdr;
+				rc->daddr = ip6h->daddr;
+			}
+		}
+	} else {
+		ip4h = ip_hdr(skb);
+		// nf_nat has to revert the destination in PREROUTING before the packet is routed
+		if (ip4h->ttl <= 1 || nat_conntrack)
+			return -1;
+
+		if (rc && rc->dst && rc->protocol == skb->protocol && rc->nexthdr == ip4h->protocol && \
+		    rc->tos == RT_TOS(ip4h->tos) && rc->daddr.s6_addr32[0] == ip4h->daddr) {
+			dst = dst_clone(rc->dst);
+		} else {
+			memset(&fl4, 0, sizeof(fl4));
+			fl4.daddr = ip4h->daddr;
+			fl4.flowi4_tos = RT_TOS(ip4h->tos);
+			fl4.flowi4_proto = ip4h->protocol;
+			rt = ip_route_output_key(net, &fl4);
+			if (IS_ERR(rt))
+				return -1;
+			dst = &rt->dst;
+			if (rc) {
+				dst_release(rc->dst);
+				rc->dst = dst_clone(dst);
+				rc->protocol = skb->protocol;
+				rc->nexthdr = ip4h->protocol;
+				rc->tos = RT_TOS(ip4h->tos);
+				rc->daddr.s6_addr32[0] = ip4h->daddr;
+			}
+		}
+	}
+
+	if ((dst->dev->flags & IFF_LOOPBACK) || (skb->len > dst_mtu(dst) && !skb_is_gso(skb))) {
+		dst_release(dst);
+		return -1;
+	}
+
+	if (skb->protocol == __constant_htons(ETH_P_IPV6)) {
+		ip6h = ipv6_hdr(skb);
+		ip6h->hop_limit--;
+	} else {
+		ip4h = ip_hdr(skb);
+		ip_decrease_ttl(ip4h);
+	}
+
+	skb_dst_drop(skb);
+	skb_dst_set(skb, dst);
+	skb->dev = dst->dev;
+
+	dst_output(skb);
+	return 0;
+}
+
+/*
+ * Deliver the packets queued on this CPU, from the tasklet scheduled when the first of
+ * them was queued. We run in softirq context after the receive softirq, so the packets
+ * can go straight to netif_receive_skb() rather than through the backlog once more, and
+ * packets routed directly share their route lookup with the preceding one when it has
+ * the same destination.
+ */
+static void ivi_batch_flush(unsigned long data) {
+	struct ivi_batch *batch = (struct ivi_batch *)data;
+	struct ivi_route_cache rc;
+	struct sk_buff_head list;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&list);
+	spin_lock_irq(&batch->queue.lock);
+	skb_queue_splice_init(&batch->queue, &list);
+	spin_unlock_irq(&batch->queue.lock);
+
+	memset(&rc, 0, sizeof(rc));
+	while ((skb = __skb_dequeue(&list)) != NULL) {
+		if (!direct_output || ivi_route_output(skb, &rc) != 0)
+			netif_receive_skb(skb);
+	}
+	dst_release(rc.dst);
+}
+
+// Count a translated packet by direction and by the protocol of the IPv4 packet it is or carries
+static inline void ivi_stats_xlated(struct sk_buff *skb) {
+	int item;
+	u8 protocol;
+
+	if (skb->protocol == __constant_htons(ETH_P_IPV6)) {
+		item = IVI_STAT_V4V6_TCP;
+		protocol = ipv6_hdr(skb)->nexthdr;
+		if (protocol == IPPROTO_IPIP)
+			protocol = ((struct iphdr *)(ipv6_hdr(skb) + 1))->protocol;
+	} else {
+		item = IVI_STAT_V6V4_TCP;
+		protocol = ip_hdr(skb)->protocol;
+	}
+
+	switch (protocol) {
+		case IPPROTO_TCP:
+			break;
+		case IPPROTO_UDP:
+			item += IVI_STAT_V4V6_UDP - IVI_STAT_V4V6_TCP;
+			break;
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			item += IVI_STAT_V4V6_ICMP - IVI_STAT_V4V6_TCP;
+			break;
+		default:
+			item += IVI_STAT_V4V6_OTHER - IVI_STAT_V4V6_TCP;
+	}
+	IVI_STATS_INC(item);
+}
+
+/*
+ * Send a translated packet on, right away or through the batch of this CPU. Once the
+ * batch is full we fall back to netif_rx() for the whole of it so as not to reorder.
+ */
+static void ivi_deliver(struct sk_buff *skb) {
+	struct ivi_batch *batch;
+	struct sk_buff *queued;
+
+	ivi_stats_xlated(skb);
+
+	if (xmit_batch) {
+		batch = this_cpu_ptr(&ivi_batch);
+		if (skb_queue_len(&batch->queue) < xmit_batch) {
+			skb_queue_tail(&batch->queue, skb);
+			tasklet_schedule(&batch->flush);
+			return;
+		}
+		while ((queued = skb_dequeue(&batch->queue)) != NULL) {
+			if (!direct_output || ivi_route_output(queued, NULL) != 0)
+				netif_rx(queued);
+		}
+	}
+
+	if (!direct_output || ivi_route_output(skb, NULL) != 0)
+		netif_rx(skb);
+}
+
+/*
+ * Hand a packet translated in place back to the protocol stack: rebuild the ethernet
+ * header in front of the new network header and drop what belonged to the old one.
+ */
+static int ivi_reinject(struct sk_buff *skb, __be16 proto, const __u8 *mac) {
+	struct ethhdr *eth;
+
+	skb_reset_network_header(skb);
+	eth = (struct ethhdr *)skb_push(skb, ETH_HLEN);
+	memcpy(eth, mac, 12); // Keep mac unchanged
+	eth->h_proto = proto;
+
+	skb_dst_drop(skb);
+	nf_reset(skb);
+	memset(skb->cb, 0, sizeof(skb->cb));
+
+	// Prepare to re-enter the protocol stack
+	skb->protocol = eth_type_trans(skb, skb->dev);
+	if (skb->ip_summed != CHECKSUM_PARTIAL)
+		skb->ip_summed = CHECKSUM_NONE;
+
+	ivi_deliver(skb);
+	return IVI_XMIT_STOLEN;
+}
+
+/*
+ * GSO packets are translated once and segmented at egress: the GSO type follows the new
+ * network header and the MSS is adjusted by delta. IPv6 to IPv4 passes 0 and keeps the
+ * MSS negotiated by the peers. Only TCP can be converted, -1 is returned for anything else.
+ */
+static int ivi_gso_xlate(struct sk_buff *skb, unsigned int from, unsigned int to, int delta) {
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	if (!skb_is_gso(skb))
+		return 0;
+
+	if (!(shinfo->gso_type & from))
+		return -1;
+
+	shinfo->gso_type = (shinfo->gso_type & ~from) | to;
+	shinfo->gso_size += delta;
+
+	// Headers were rewritten: have the segment count computed again
+	shinfo->gso_type |= SKB_GSO_DODGY;
+	shinfo->gso_segs = 0;
+	return 0;
+}
+
+/*
+ * MAP-E encapsulation of the IPv4 packet at skb->data, the caller reserved the headroom.
+ */
+static int ivi_v4v6_encap(struct sk_buff *skb, const struct in6_addr *saddr, const struct in6_addr *daddr, \
+                          const __u8 *mac) {
+	struct ipv6hdr *ip6h;
+	__be16 tot_len;
+
+	tot_len = ((struct iphdr *)skb->data)->tot_len;
+	ip6h = (struct ipv6hdr *)skb_push(skb, sizeof(struct ipv6hdr));
+	*(__u32 *)ip6h = __constant_htonl(0x60000000);
+	ip6h->payload_len = tot_len;
+	ip6h->nexthdr = IPPROTO_IPIP;
+	ip6h->hop_limit = 64 + 1; // we have to put translated IPv6 packet into the protocol stack again
+	ip6h->saddr = *saddr;
+	ip6h->daddr = *daddr;
+	return ivi_reinject(skb, __constant_htons(ETH_P_IPV6), mac);
+}
+
+/*
+ * Translate or encapsulate the IPv4 packet at skb->data in place, from the translation
+ * template of its session: the IPv6 header is pushed into the headroom reserved by the
+ * caller, the payload is never copied.
+ */
+static int ivi_v4v6_xlate_addrs(struct sk_buff *skb, const struct ivi_xlate_tmpl *tmpl) {
+	const struct in6_addr *saddr = &tmpl->saddr, *daddr = &tmpl->daddr;
+	struct sk_buff *segs;
+	struct iphdr *ip4h;
+	struct ipv6hdr *ip6h;
+	struct tcphdr *tcph;
+	struct udphdr *udph;
+	struct icmp6hdr *icmp6h;
+	unsigned int ihl, plen;
+	__be16 tot_len, type;
+	__wsum csum;
+	__u8 mac[12];
+	u8 protocol, ttl;
+	__sum16 check;
+
+	ip4h = ip_hdr(skb);
+
+	// The new headers overlap the old ones, save what we still need
+	ihl = ip4h->ihl << 2;
+	tot_len = ip4h->tot_len;
+	plen = ntohs(tot_len) - ihl;
+	protocol = ip4h->protocol;
+	ttl = ip4h->ttl;
+	memcpy(mac, eth_hdr(skb), 12);
+
+	/*
+	 * With CHECKSUM_PARTIAL the transport checksum only holds the pseudo-header sum, the
+	 * device completes it on output. With CHECKSUM_COMPLETE the device summed the whole
+	 * IPv4 packet, which is also the sum of its payload since a valid IPv4 header sums to 0.
+	 */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		csum = skb->csum;
+	else
+		csum = 0;
+
+	if (tmpl->transport == MAP_E) {
+		// The NAT44 code above updated the checksum as a complete one, seed it again
+		if (skb->ip_summed == CHECKSUM_PARTIAL && protocol == IPPROTO_TCP) {
+			tcph = (struct tcphdr *)((__u8 *)ip4h + ihl);
+			tcph->check = ~csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, protocol, 0);
+		} else if (skb->ip_summed == CHECKSUM_PARTIAL && protocol == IPPROTO_UDP) {
+			udph = (struct udphdr *)((__u8 *)ip4h + ihl);
+			udph->check = ~csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, protocol, 0);
+		}
+
+		// Encapsulation
+		if (!skb_is_gso(skb))
+			return ivi_v4v6_encap(skb, saddr, daddr, mac);
+
+		// There is no GSO type for IPv4 in IPv6 tunnels, segment before encapsulating
+		segs = skb_gso_segment(skb, 0);
+		if (IS_ERR_OR_NULL(segs)) {
+			IVI_STATS_INC(IVI_STAT_DROP_GSO);
+			return 0;
+		}
+
+		consume_skb(skb);
+		while (segs) {
+			skb = segs;
+			segs = segs->next;
+			skb->next = NULL;
+			if (skb_cow_head(skb, ETH_HLEN + sizeof(struct ipv6hdr))) {
+				IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+				kfree_skb(skb);
+			} else
+				ivi_v4v6_encap(skb, saddr, daddr, mac);
+		}
+		return IVI_XMIT_STOLEN;
+	}
+
+	if (ivi_gso_xlate(skb, SKB_GSO_TCPV4, SKB_GSO_TCPV6, (int)ihl - (int)sizeof(struct ipv6hdr)) != 0) {
+		IVI_STATS_INC(IVI_STAT_DROP_GSO);
+		return 0;
+	}
+
+	/*
+	 * Translation, first get the transport checksum over the IPv6 pseudo-header: length and
+	 * protocol sum the same in both, only the addresses are swapped for the IPv6 ones.
+	 */
+	check = 0;
+	if (skb->ip_summed != CHECKSUM_PARTIAL && protocol != IPPROTO_ICMP) {
+		udph = (struct udphdr *)((__u8 *)ip4h + ihl);
+		tcph = (struct tcphdr *)udph;
+		if (protocol == IPPROTO_UDP && udph->check == 0) {
+			// No IPv4 checksum to start from, only sum the payload if the device did not
+			if (skb->ip_summed != CHECKSUM_COMPLETE)
+				csum = ivi_skb_checksum(skb, ihl, plen, protocol);
+		} else {
+			csum = csum_sub(tmpl->csum6, csum_add((__force __wsum)ip4h->saddr, (__force __wsum)ip4h->daddr));
+			check = csum_fold(csum_add(~csum_unfold(protocol == IPPROTO_TCP ? tcph->check : udph->check), csum));
+		}
+	}
+
+	skb_pull(skb, ihl);
+	skb_reset_transport_header(skb);
+	ip6h = (struct ipv6hdr *)skb_push(skb, sizeof(struct ipv6hdr));
+	*(__u32 *)ip6h = __constant_htonl(0x60000000);
+	ip6h->payload_len = htons(plen);
+	ip6h->nexthdr = protocol;
+	ip6h->hop_limit = ttl;
+	ip6h->saddr = *saddr;
+	ip6h->daddr = *daddr;
+
+	switch (protocol) {
+		case IPPROTO_TCP:
+			tcph = tcp_hdr(skb);
+			if (skb->ip_summed == CHECKSUM_PARTIAL)
+				tcph->check = ~csum_ipv6_magic(saddr, daddr, plen, IPPROTO_TCP, 0);
+			else
+				tcph->check = check;
+			break;
+
+		case IPPROTO_UDP:
+			udph = udp_hdr(skb);
+			if (skb->ip_summed == CHECKSUM_PARTIAL)
+				udph->check = ~csum_ipv6_magic(saddr, daddr, plen, IPPROTO_UDP, 0);
+			else {
+				if (udph->check == 0)
+					udph->check = csum_ipv6_magic(saddr, daddr, plen, IPPROTO_UDP, csum);
+				else
+					udph->check = check;
+				if (udph->check == 0)
+					udph->check = CSUM_MANGLED_0;
+			}
+			break;
+
+		case IPPROTO_ICMP:
+			// Only echo request and reply make it here, see ivi_v4v6_xmit()
+			ip6h->nexthdr = IPPROTO_ICMPV6;
+			icmp6h = icmp6_hdr(skb);
+			type = *(__be16 *)icmp6h;
+			if (icmp6h->icmp6_type == ICMP_ECHO)
+				icmp6h->icmp6_type = ICMPV6_ECHO_REQUEST;
+			else
+				icmp6h->icmp6_type = ICMPV6_ECHO_REPLY;
+
+			// ICMPv4 has no pseudo-header, ICMPv6 does
+			csum_replace2(&icmp6h->icmp6_cksum, type, *(__be16 *)icmp6h);
+			icmp6h->icmp6_cksum = csum_ipv6_magic(saddr, daddr, plen, IPPROTO_ICMPV6, \
+			                              ~csum_unfold(icmp6h->icmp6_cksum));
+			break;
+	}
+
+	return ivi_reinject(skb, __constant_htons(ETH_P_IPV6), mac);
+}
+
+/*
+ * In-place counterpart of the tail of ivi_v4v6_xmit(). The translation template of the
+ * session is used as is when it is valid for the packet, otherwise it is computed again
+ * into tmpl, for the caller to store it.
+ */
+static int ivi_v4v6_xlate_inplace(struct sk_buff *skb, u16 s_port, u16 d_port, struct ivi_xlate_tmpl *tmpl) {
+	struct iphdr *ip4h;
+
+	ip4h = ip_hdr(skb);
+
+	if (!ivi_xlate_tmpl_valid(tmpl, d_port)) {
+		tmpl->transport = 0;
+
+		if (ipaddr_4to6(&(ip4h->daddr), d_port, ADDR_DIR_DST, &tmpl->daddr, &tmpl->transport) != 0)
+			return -EINVAL;
+
+		if (ipaddr_4to6(&(ip4h->saddr), s_port, ADDR_DIR_SRC, &tmpl->saddr, NULL) != 0)
+			return -EINVAL;
+
+		tmpl->csum6 = csum_partial(&tmpl->daddr, sizeof(struct in6_addr), \
+		                           csum_partial(&tmpl->saddr, sizeof(struct in6_addr), 0));
+		tmpl->dstport = d_port;
+		tmpl->gen = ivi_xlate_gen;
+	}
+
+	if (tmpl->transport != MAP_E && ip4h->protocol != IPPROTO_TCP && ip4h->protocol != IPPROTO_UDP \
+	    && ip4h->protocol != IPPROTO_ICMP) {
+		IVI_STATS_INC(IVI_STAT_DROP_PROTO);
+		return 0;
+	}
+
+	return ivi_v4v6_xlate_addrs(skb, tmpl);
+}
+
+/*
+ * Translate a segment of an established TCP flow from the flow cache: NAT44 and the
+ * IPv6 addresses come from the flow, neither the session tables nor the rules are looked
+ * up. Segments that could move the state machine are left to ivi_v4v6_xmit() (-EINVAL).
+ */
+static int ivi_v4v6_flow_xmit(struct sk_buff *skb) {
+	struct iphdr *ip4h;
+	struct tcphdr *tcph;
+	struct tcp_flow *flow;
+	int ret;
+
+	ip4h = ip_hdr(skb);
+	tcph = (struct tcphdr *)((__u8 *)ip4h + (ip4h->ihl << 2));
+	if (tcph->syn || tcph->fin || tcph->rst)
+		return -EINVAL;
+
+	rcu_read_lock();
+	flow = ivi_map_tcp_flow_get(ntohl(ip4h->saddr), ntohs(tcph->source), ntohl(ip4h->daddr), ntohs(tcph->dest));
+	// A flow learnt across a configuration change is left to the slow path until flushed
+	if (!flow || flow->tmpl.gen != ivi_xlate_gen) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+
+	if (htonl(flow->newaddr) != ip4h->saddr) {
+		csum_replace4(&tcph->check, ip4h->saddr, htonl(flow->newaddr));
+		csum_replace4(&ip4h->check, ip4h->saddr, htonl(flow->newaddr));
+		ip4h->saddr = htonl(flow->newaddr);
+	}
+	csum_replace2(&tcph->check, tcph->source, htons(flow->newport));
+	tcph->source = htons(flow->newport);
+
+	ret = ivi_v4v6_xlate_addrs(skb, &flow->tmpl);
+	rcu_read_unlock();
+	return ret;
+}
+
 int ivi_v4v6_xmit(struct sk_buff *skb) {
 	struct sk_buff *newskb;
 	struct ethhdr *eth4, *eth6;
@@ -277,11 +825,17 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 	struct udphdr *udph;
 	struct icmphdr *icmph;
 	struct icmp6hdr *icmp6h;
+	struct tcp_flow flow, *learn;
+	struct ivi_xlate_tmpl tmpl;
+	struct map_list *tmpl_list;
+	__be32 tmpl_addr, tmpl_dst;
+	__be16 tmpl_port;
 	__u8 *payload;
 	unsigned int hlen, plen;
 	u16 newp, s_port, d_port;
 	u8 transport;
 	char flag_udp_nullcheck;
+	int ret, stale;
 	
 	eth4 = eth_hdr(skb);
 	if (unlikely(eth4->h_proto != __constant_ntohs(ETH_P_IP))) {
@@ -313,12 +867,43 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 	if (ip4h->ttl <= 1) {
 		return -EINVAL;  // Just accept.
 	}
+
+	// GSO packets cannot be copied into a single buffer, they are always rewritten
+	if (xlate_inplace || skb_is_gso(skb)) {
+		// Headers must be linear and ours alone before we rewrite them, and the
+		// headroom must fit the IPv6 header pushed in front of them.
+		if (!pskb_may_pull(skb, min_t(unsigned int, skb->len, IVI_XLATE_PULL)) || \
+		    skb_cow_head(skb, ETH_HLEN + sizeof(struct ipv6hdr))) {
+			IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+			return 0;  // Drop packet on low memory
+		}
+		eth4 = eth_hdr(skb);
+		ip4h = ip_hdr(skb);
+
+		if (flow_cache && !nat_conntrack && ip4h->protocol == IPPROTO_TCP && !ip_is_fragment(ip4h)) {
+			if ((ret = ivi_v4v6_flow_xmit(skb)) != -EINVAL)
+				return ret;
+		}
+	}
+
+	// nf_nat maps the source in place of the session tables, see ivi_nf_nat_out()
+	if (nat_conntrack) {
+		if (ivi_nf_nat_out(skb) != 0) {
+			IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+			return 0;
+		}
+		eth4 = eth_hdr(skb);
+		ip4h = ip_hdr(skb);
+	}
 	
 	plen = ntohs(ip4h->tot_len) - (ip4h->ihl * 4);
 	payload = (__u8 *)(ip4h) + (ip4h->ihl << 2);
 	s_port = d_port = newp = 0;
 	transport = 0;
 	flag_udp_nullcheck = 0;
+	learn = NULL;
+	tmpl.gen = 0;
+	tmpl_list = NULL;
 
 	switch (ip4h->protocol) {
 		case IPPROTO_TCP:
@@ -334,7 +919,16 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 				}
 			}
 			
-			if (ivi_mode == IVI_MODE_HGW && ntohs(tcph->source) < 1024) {
+			// Segments of an established flow that missed the flow cache teach it the flow
+			if (flow_cache && !nat_conntrack && !tcph->syn && !tcph->fin && !tcph->rst) {
+				learn = &flow;
+				flow.oldaddr = ntohl(ip4h->saddr);
+				flow.oldport = ntohs(tcph->source);
+				flow.dstaddr = ntohl(ip4h->daddr);
+				flow.dstport = ntohs(tcph->dest);
+			}
+
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(tcph->source) < 1024)) {
 				newp = ntohs(tcph->source);
 			}
 			
@@ -344,6 +938,7 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 				printk(KERN_ERR "ivi_v4v6_xmit: fail to perform nat44 mapping for " NIP4_FMT \
 				                ":%d (TCP).\n", NIP4(ip4h->saddr), ntohs(tcph->source));
 #endif
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
 				return 0; // silently drop
 					
 			}
@@ -357,6 +952,10 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 			tcph->source = htons(newp);
 			s_port = ntohs(tcph->source);
 			d_port = ntohs(tcph->dest);
+			if (learn) {
+				flow.newaddr = ntohl(ip4h->saddr);
+				flow.newport = newp;
+			}
 
 			break;
 
@@ -365,19 +964,27 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 			if (udph->check == 0) 
 				flag_udp_nullcheck = 1;
 			
-			if (ivi_mode == IVI_MODE_HGW && ntohs(udph->source) < 1024) {
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(udph->source) < 1024)) {
 				newp = ntohs(udph->source);
 			}
 			
 			else if (get_outflow_map_port(&udp_list, ntohl(ip4h->saddr), ntohs(udph->source), \
-				ntohl(ip4h->daddr), hgw_ratio, hgw_adjacent, hgw_offset, &newp) == -1) {
+				ntohl(ip4h->daddr), hgw_ratio, hgw_adjacent, hgw_offset, &newp, &tmpl) == -1) {
 #ifdef IVI_DEBUG
 				printk(KERN_ERR "ivi_v4v6_xmit: fail to perform nat44 mapping for " NIP4_FMT \
 				                ":%d (UDP).\n", NIP4(ip4h->saddr), ntohs(udph->source));
 #endif
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
 				return 0; // silently drop
 				
-			} 
+			}
+
+			else {
+				tmpl_list = &udp_list;
+				tmpl_addr = ntohl(ip4h->saddr);
+				tmpl_port = ntohs(udph->source);
+				tmpl_dst = ntohl(ip4h->daddr);
+			}
 			
 			if (ivi_mode == IVI_MODE_HGW_NAT44) {
 				if (!flag_udp_nullcheck) {
@@ -388,6 +995,10 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 			}
 			if (!flag_udp_nullcheck) {
 				csum_replace2(&udph->check, udph->source, htons(newp));
+			} else if (skb->ip_summed == CHECKSUM_COMPLETE) {
+				// the device sum is used later on to compute the missing checksum
+				skb->csum = csum_add(csum_sub(skb->csum, (__force __wsum)udph->source), \
+				                     (__force __wsum)htons(newp));
 			}
 			udph->source = htons(newp);
 			s_port = ntohs(udph->source);
@@ -399,15 +1010,23 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 			icmph = (struct icmphdr *)payload;
 
 			if (icmph->type == ICMP_ECHO) {
-				if (get_outflow_map_port(&icmp_list, ntohl(ip4h->saddr), ntohs(icmph->un.echo.id), \
-					ntohl(ip4h->daddr), hgw_ratio, hgw_adjacent, hgw_offset, &newp) == -1) {
+				newp = ntohs(icmph->un.echo.id);
+				if (!nat_conntrack && get_outflow_map_port(&icmp_list, ntohl(ip4h->saddr), ntohs(icmph->un.echo.id), \
+					ntohl(ip4h->daddr), hgw_ratio, hgw_adjacent, hgw_offset, &newp, &tmpl) == -1) {
 #ifdef IVI_DEBUG
 					printk(KERN_ERR "ivi_v4v6_xmit: fail to perform nat44 mapping for " NIP4_FMT \
 					                ":%d (ICMP).\n", NIP4(ip4h->saddr), ntohs(icmph->un.echo.id));
 #endif
+					IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
 					return 0; // silently drop
 						
 				} else {
+					if (!nat_conntrack) {
+						tmpl_list = &icmp_list;
+						tmpl_addr = ntohl(ip4h->saddr);
+						tmpl_port = ntohs(icmph->un.echo.id);
+						tmpl_dst = ntohl(ip4h->daddr);
+					}
 					if (ivi_mode == IVI_MODE_HGW_NAT44) {
 						csum_replace4(&ip4h->check, ip4h->saddr, htonl(v4publicaddr));
 						ip4h->saddr = htonl(v4publicaddr);
@@ -423,12 +1042,14 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 					printk(KERN_ERR "ivi_v4v6_xmit: we currently doesn't send ECHO-REPLY " \
 					                "when CPE is working in NAT44 mode\n");
 #endif
+					IVI_STATS_INC(IVI_STAT_DROP_ICMP);
 					return 0; // silently drop
 				}
 				s_port = d_port = ntohs(icmph->un.echo.id);
 				
 			} else {
 				printk(KERN_ERR "ivi_v4v6_xmit: unsupported ICMP type in NAT44. Drop packet now.\n");
+				IVI_STATS_INC(IVI_STAT_DROP_ICMP);
 				return 0;
 			}
 
@@ -440,11 +1061,30 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 #endif
 	}
 
+	// Fragments keep going through the copying path below
+	if ((xlate_inplace || skb_is_gso(skb)) && !ip_is_fragment(ip4h)) {
+		stale = !ivi_xlate_tmpl_valid(&tmpl, d_port);
+		ret = ivi_v4v6_xlate_inplace(skb, s_port, d_port, &tmpl);
+
+		// Keep a template computed again for the next packets of the session
+		if (stale && ivi_xlate_tmpl_valid(&tmpl, d_port)) {
+			if (tmpl_list)
+				ivi_map_set_tmpl(tmpl_list, tmpl_addr, tmpl_port, tmpl_dst, &tmpl);
+			else if (learn) {
+				flow.tmpl = tmpl;
+				ivi_map_tcp_flow_learn(&flow);
+			}
+		}
+		return ret;
+	}
+
 	hlen = sizeof(struct ipv6hdr);
-	if (!(newskb = dev_alloc_skb(2 + ETH_HLEN + hlen + htons(ip4h->tot_len)))) {
+	if (!(newskb = ivi_alloc_skb(2 + ETH_HLEN + hlen + htons(ip4h->tot_len)))) {
 		// Allocation size is enough for both E and T;
 		// Even in ICMP translation case, it's enough for two IP headers' translation. 
 		printk(KERN_ERR "ivi_v4v6_xmit: failed to allocate new socket buffer.\n");
+		IVI_STATS_INC(IVI_STAT_ALLOC_FAIL);
+		IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
 		return 0;  // Drop packet on low memory
 	}
 	skb_reserve(newskb, 2);  // Align IP header on 16 byte boundary (ETH_LEN + 2)
@@ -491,7 +1131,7 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 				tcph = (struct tcphdr *)payload;
 				tcph->check = 0;
 				tcph->check = csum_ipv6_magic(&(ip6h->saddr), &(ip6h->daddr), plen, IPPROTO_TCP, \
-				                                csum_partial(payload, plen, 0));
+				                                ivi_csum_partial(payload, plen, IPPROTO_TCP));
 				break;
 
 			case IPPROTO_UDP:
@@ -499,7 +1139,7 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 				udph = (struct udphdr *)payload;
 				udph->check = 0;
 				udph->check = csum_ipv6_magic(&(ip6h->saddr), &(ip6h->daddr), plen, IPPROTO_UDP, \
-				                                csum_partial(payload, plen, 0));
+				                                ivi_csum_partial(payload, plen, IPPROTO_UDP));
 				break;
 
 			case IPPROTO_ICMP: 
@@ -516,17 +1156,19 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 					
 					icmp6h->icmp6_cksum = 0;
 					icmp6h->icmp6_cksum = csum_ipv6_magic(&(ip6h->saddr), &(ip6h->daddr), plen, \
-					                            IPPROTO_ICMPV6, csum_partial(payload, plen, 0));
+					                            IPPROTO_ICMPV6, ivi_csum_partial(payload, plen, IPPROTO_ICMPV6));
 					
 				} else {
 					//printk(KERN_ERR "ivi_v4v6_xmit: unsupported ICMP type in xlate. Drop packet.\n");
 					kfree_skb(newskb);
+					IVI_STATS_INC(IVI_STAT_DROP_ICMP);
 					return 0;
 				}
 				break;
 
 			default:
 				kfree_skb(newskb);
+				IVI_STATS_INC(IVI_STAT_DROP_PROTO);
 				return 0;
 		}
 	}
@@ -534,8 +1176,9 @@ int ivi_v4v6_xmit(struct sk_buff *skb) {
 	// Prepare to re-enter the protocol stack
 	newskb->protocol = eth_type_trans(newskb, skb->dev);
 	newskb->ip_summed = CHECKSUM_NONE;
+	skb_reset_network_header(newskb);
 
-	netif_rx(newskb);
+	ivi_deliver(newskb);
 	return 0;
 }
 
@@ -554,72 +1197,474 @@ static inline bool port_in_range(u16 _port, u16 _ratio, u16 _adjacent, u16 _offs
 	}
 }
 
-int ivi_v6v4_xmit(struct sk_buff *skb) {
-	struct sk_buff *newskb;
-	struct ethhdr *eth6, *eth4;
-	struct iphdr *ip4h, *icmp_ip4h;
-	struct ipv6hdr *ip6h, *icmp_ip6h;
-	struct tcphdr *tcph, *icmp_tcph;
-	struct udphdr *udph, *icmp_udph;
+/*
+ * NAT44 reverse mapping of the IPv4 packet carried in a MAP-E tunnel,
+ * returns -1 when the packet has to be dropped.
+ */
+static int ivi_v6v4_decap_nat44(struct iphdr *ip4h, int plen) {
+	struct iphdr *icmp_ip4h;
+	struct tcphdr *tcph;
+	struct udphdr *udph;
 	struct icmphdr *icmph, *icmp_icmp4h;
-	struct frag_hdr *fragh;
 	__u8 *payload;
-	int hlen, plen;
-	__u8 poffset;
-	__u8 flag4;
-	__u16 off4;
 	__be32 oldaddr;
 	__be16 oldp;
-	u16 s_ratio, s_adj, s_offset, d_ratio, d_adj, d_offset;
-	u8 next_hdr, *ext_hdr;
 	u32 tempaddr;
-	
-	fragh = NULL;
-		
-	eth6 = eth_hdr(skb);
-	ip6h = ipv6_hdr(skb);
-	hlen = sizeof(struct iphdr);
-	plen = ntohs(ip6h->payload_len);
-	poffset = sizeof(struct ipv6hdr);  // Payload Offset
-	
-	// This should not happen since we are hooked on PF_INET6.
-	if (unlikely(eth6->h_proto != __constant_ntohs(ETH_P_IPV6))) {
-		return -EINVAL;  // Just accept.
-	}
-	
-	// By pass ipv6 multicast packet (for ND)
-	if (mc_v6_addr(&(ip6h->daddr))) {
-		return -EINVAL;
-	}
 
-	// leave the generation of ICMP packet to the protocol stack
-	if (ip6h->hop_limit <= 1) {
-		return -EINVAL;
-	}
+	payload = (__u8 *)ip4h + (ip4h->ihl << 2);
 	
-	// process extension headers
-	next_hdr = ip6h->nexthdr;
-	ext_hdr = (__u8 *)ip6h + sizeof(struct ipv6hdr);
-	while (next_hdr != IPPROTO_IPIP &&
-	       next_hdr != IPPROTO_TCP && 
-	       next_hdr != IPPROTO_UDP && 
-	       next_hdr != IPPROTO_ICMPV6) {
-	       
-		if (next_hdr == IPPROTO_FRAGMENT) {
-			printk(KERN_INFO "FRAGMENT header: frag_off is %x, identification is %x\n", \
-			                  ntohs(*((u16 *)ext_hdr + 1)), ntohl(*((u32 *)ext_hdr + 1)));
-			fragh = (struct frag_hdr *)ext_hdr;
-			plen -= sizeof(struct frag_hdr);
-			poffset += sizeof(struct frag_hdr);
-			next_hdr = fragh->nexthdr;
-			ext_hdr += sizeof(struct frag_hdr);
-		}
-		else if (next_hdr == IPPROTO_AH) {
-			printk(KERN_INFO "AH header, length is %d\n", *(ext_hdr + 1));
-			plen -= (*(ext_hdr + 1) << 2) + 8;
-			poffset += (*(ext_hdr + 1) << 2) + 8;
-			next_hdr = *ext_hdr;
-			ext_hdr += (*(ext_hdr + 1) << 2) + 8;
+	switch (ip4h->protocol) {
+		case IPPROTO_TCP:
+			tcph = (struct tcphdr *)payload;
+
+			if (!port_in_range(ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
+				//printk(KERN_INFO "ivi_v6v4_xmit: TCP dest port %d is not in range (r=%d, m=%d, o=%d)."
+				//                 "Drop packet.\n", ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
+				IVI_STATS_INC(IVI_STAT_DROP_PORT);
+				return -1;
+			}
+			
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(tcph->dest) < 1024)) {
+				oldaddr = ntohl(ip4h->daddr);
+				oldp = ntohs(tcph->dest);
+			}
+			
+			else if (get_inflow_tcp_map_port(ntohs(tcph->dest), ntohl(ip4h->saddr), ntohs(tcph->source), \
+			                            tcph, plen, &oldaddr, &oldp) == -1) {
+				//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (TCP).\n",
+				//	               ntohs(tcph->dest));
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+				return -1;
+			}
+					
+			csum_replace4(&tcph->check, ip4h->daddr, htonl(oldaddr));
+			csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
+			ip4h->daddr = htonl(oldaddr);
+					
+			csum_replace2(&tcph->check, tcph->dest, htons(oldp));
+			tcph->dest = htons(oldp);
+
+			if (tcph->syn && (tcph->doff > 5)) {
+				__u16 *option = (__u16*)tcph;
+				if (option[10] == htons(0x0204)) {
+					if (ntohs(option[11]) > mss_limit) {
+						csum_replace2(&tcph->check, option[11], htons(mss_limit));
+						option[11] = htons(mss_limit);
+					}
+				}
+			}
+
+			break;
+
+		case IPPROTO_UDP:
+			udph = (struct udphdr *)payload;
+
+			if (!port_in_range(ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
+				//printk(KERN_INFO "ivi_v6v4_xmit: UDP dest port %d is not in range (r=%d, m=%d, o=%d)."
+				//                 "Drop packet.\n", ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
+				IVI_STATS_INC(IVI_STAT_DROP_PORT);
+				return -1;
+			}
+			
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(udph->dest) < 1024)) {
+				oldaddr = ntohl(ip4h->daddr);
+				oldp = ntohs(udph->dest);
+			}
+			
+			else if (get_inflow_map_port(&udp_list,  ntohs(udph->dest), ntohl(ip4h->saddr), \
+			                        &oldaddr, &oldp) == -1) {
+				//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (UDP).\n",
+				//                 ntohs(udph->dest));	
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+				return -1;
+			}
+			
+			// If checksum of UDP inside IPv4 packet is 0, we MUST NOT update the checksum value.
+			if (udph->check != 0) {
+				csum_replace4(&udph->check, ip4h->daddr, htonl(oldaddr));
+				csum_replace2(&udph->check, udph->dest, htons(oldp));
+			}						
+			
+			csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
+			ip4h->daddr = htonl(oldaddr);
+			udph->dest = htons(oldp);
+
+			break;
+
+		case IPPROTO_ICMP:
+			icmph = (struct icmphdr *)payload;
+			if (icmph->type == ICMP_ECHOREPLY && !nat_conntrack) {
+				if (get_inflow_map_port(&icmp_list, ntohs(icmph->un.echo.id), ntohl(ip4h->saddr), \
+				                        &oldaddr, &oldp) == -1) {
+				    tempaddr = ntohl(ip4h->saddr);
+					printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for ( " NIP4_FMT \
+					                ", %d) (ICMP).\n", NIP4(tempaddr), ntohs(icmph->un.echo.id));
+					IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+					return -1;
+				} else {
+					csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
+					ip4h->daddr = htonl(oldaddr);
+						
+					csum_replace2(&icmph->checksum, icmph->un.echo.id, htons(oldp));
+					icmph->un.echo.id = htons(oldp);
+				}
+			}
+			else if (icmph->type == ICMP_ECHO) {
+				if (ivi_mode == IVI_MODE_HGW_NAT44) { 
+#ifdef IVI_DEBUG
+					printk(KERN_INFO "ivi_v6v4_xmit: you can't ping private address when CPE is working in NAT44 mode\n");
+#endif
+					IVI_STATS_INC(IVI_STAT_DROP_ICMP);
+					return -1; // silently drop
+				}
+			} 
+			else if (icmph->type == ICMP_TIME_EXCEEDED && !nat_conntrack) {
+				icmp_ip4h = (struct iphdr *)((__u8 *)icmph + 8);
+				if (icmp_ip4h->protocol == IPPROTO_ICMP) {
+					icmp_icmp4h = (struct icmphdr *)((__u8 *)icmp_ip4h + (icmp_ip4h->ihl << 2));
+					if (icmp_icmp4h->type == ICMP_ECHO) {
+						if (get_inflow_map_port(&icmp_list, ntohs(icmp_icmp4h->un.echo.id), \
+						                   ntohl(icmp_ip4h->daddr), &oldaddr, &oldp) == -1) {
+							printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (ICMP) "\
+							                "in IP packet.\n", ntohs(icmph->un.echo.id));
+							IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+							return -1;
+						} else {
+							csum_replace4(&icmp_ip4h->check, icmp_ip4h->saddr, htonl(oldaddr));
+							icmp_ip4h->saddr = htonl(oldaddr);					
+							csum_replace2(&icmp_icmp4h->checksum, icmp_icmp4h->un.echo.id, htons(oldp));
+							icmp_icmp4h->un.echo.id = htons(oldp);
+						}
+					}
+				}
+			}
+			break;
+
+		default:
+			IVI_STATS_INC(IVI_STAT_DROP_PROTO);
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * In-place counterpart of ivi_v6v4_xmit(): the IPv4 header is written over the tail of the
+ * IPv6 header chain, the payload is never copied. TCP and UDP fragments are translated one
+ * by one, the later ones as the first one was (see struct frag_tuple), without reassembly.
+ */
+static int ivi_v6v4_xlate_inplace(struct sk_buff *skb, struct frag_hdr *fragh, u8 next_hdr, int poffset, int plen) {
+	struct ipv6hdr *ip6h;
+	struct iphdr *ip4h, iph;
+	struct frag_tuple frag;
+	struct tcphdr *tcph;
+	struct udphdr *udph;
+	struct icmphdr *icmph;
+	__u8 *payload;
+	__be32 oldaddr;
+	__be16 oldp, type;
+	__sum16 *check;
+	__wsum csum;
+	u16 s_ratio, s_adj, s_offset, d_ratio, d_adj, d_offset;
+	__u8 mac[12];
+
+	ip6h = ipv6_hdr(skb);
+	payload = (__u8 *)ip6h + poffset;
+	memcpy(mac, eth_hdr(skb), 12);
+
+	if (next_hdr == IPPROTO_IPIP) { // Decapsulation
+		if (ivi_v6v4_decap_nat44((struct iphdr *)payload, plen) != 0)
+			return 0;
+
+		ip4h = (struct iphdr *)payload;
+		if (skb->ip_summed == CHECKSUM_PARTIAL && \
+		    (ip4h->protocol == IPPROTO_TCP || ip4h->protocol == IPPROTO_UDP)) {
+			// The NAT44 code above updated the checksum as a complete one, seed it again
+			if (ip4h->protocol == IPPROTO_TCP)
+				check = &((struct tcphdr *)(payload + (ip4h->ihl << 2)))->check;
+			else
+				check = &((struct udphdr *)(payload + (ip4h->ihl << 2)))->check;
+			*check = ~csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, ntohs(ip4h->tot_len) - (ip4h->ihl << 2), \
+			                            ip4h->protocol, 0);
+		}
+
+		skb_pull(skb, poffset);
+		return ivi_reinject(skb, __constant_htons(ETH_P_IP), mac);
+	}
+
+	// Translation, the IPv4 header is built aside since it overlaps the IPv6 one
+	*(__u16 *)&iph = __constant_htons(0x4500);
+	iph.tot_len = htons(sizeof(struct iphdr) + plen);
+	iph.ttl = ip6h->hop_limit;
+	iph.protocol = next_hdr; // ICMPv6 is translated below
+	if (fragh) {
+		// DF=0, MF and the offset are copied, the identification is truncated
+		iph.id = htons(ntohl(fragh->identification) & 0xffff);
+		iph.frag_off = htons(((ntohs(fragh->frag_off) & IP6_MF) ? IP_MF : 0) | \
+		                     ((ntohs(fragh->frag_off) & IP6_OFFSET) >> 3));
+	} else {
+		iph.id = 0;
+		iph.frag_off = htons(0x4000); // DF=1
+	}
+
+	if (fragh && (fragh->frag_off & htons(IP6_OFFSET))) {
+		// Later fragments only hold payload, neither the rules nor the sessions are looked up
+		if (ivi_frag_lookup(&(ip6h->saddr), &(ip6h->daddr), fragh->identification, &frag) != 0) {
+			IVI_STATS_INC(IVI_STAT_DROP_FRAG);
+			return 0;
+		}
+		iph.saddr = frag.saddr;
+		iph.daddr = frag.daddr;
+		iph.protocol = frag.protocol;
+
+		skb_pull(skb, poffset);
+		skb_reset_transport_header(skb);
+		ip4h = (struct iphdr *)skb_push(skb, sizeof(struct iphdr));
+		memcpy(ip4h, &iph, sizeof(struct iphdr));
+		ip4h->check = 0;
+		ip4h->check = ip_fast_csum((__u8 *)ip4h, ip4h->ihl);
+		return ivi_reinject(skb, __constant_htons(ETH_P_IP), mac);
+	}
+
+	if (ipaddr_6to4(&(ip6h->saddr), ADDR_DIR_SRC, &(iph.saddr), &s_ratio, &s_adj, &s_offset) < 0) {
+		return -EINVAL;  // Just accept.
+	}
+	if (ipaddr_6to4(&(ip6h->daddr), ADDR_DIR_DST, &(iph.daddr), &d_ratio, &d_adj, &d_offset) < 0) {
+		return -EINVAL;  // Just accept.
+	}
+
+	if (ivi_gso_xlate(skb, SKB_GSO_TCPV6, SKB_GSO_TCPV4, 0) != 0) {
+		IVI_STATS_INC(IVI_STAT_DROP_GSO);
+		return 0;
+	}
+
+	// The first fragment has to hold the whole transport header
+	if (fragh && plen < (next_hdr == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr))) {
+		IVI_STATS_INC(IVI_STAT_DROP_FRAG);
+		return 0;
+	}
+
+	switch (next_hdr) {
+		case IPPROTO_TCP:
+			tcph = (struct tcphdr *)payload;
+
+			if (!port_in_range(ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
+				IVI_STATS_INC(IVI_STAT_DROP_PORT);
+				return 0;
+			}
+
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(tcph->dest) < 1024)) {
+				oldaddr = ntohl(iph.daddr);
+				oldp = ntohs(tcph->dest);
+			}
+
+			else if (get_inflow_tcp_map_port(ntohs(tcph->dest), ntohl(iph.saddr), ntohs(tcph->source), \
+			                            tcph, plen, &oldaddr, &oldp) == -1) {
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+				return 0;
+			}
+
+			iph.daddr = htonl(oldaddr);
+			csum_replace2(&tcph->check, tcph->dest, htons(oldp));
+			tcph->dest = htons(oldp);
+
+			if (tcph->syn && (tcph->doff > 5)) {
+				__u16 *option = (__u16*)tcph;
+				if (option[10] == htons(0x0204)) {
+					if (ntohs(option[11]) > mss_limit) {
+						csum_replace2(&tcph->check, option[11], htons(mss_limit));
+						option[11] = htons(mss_limit);
+					}
+				}
+			}
+			break;
+
+		case IPPROTO_UDP:
+			udph = (struct udphdr *)payload;
+
+			if (!port_in_range(ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
+				IVI_STATS_INC(IVI_STAT_DROP_PORT);
+				return 0;
+			}
+
+			if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(udph->dest) < 1024)) {
+				oldaddr = ntohl(iph.daddr);
+				oldp = ntohs(udph->dest);
+			}
+
+			else if (get_inflow_map_port(&udp_list, ntohs(udph->dest), ntohl(iph.saddr), \
+			                        &oldaddr, &oldp) == -1) {
+				IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
+				return 0;
+			}
+
+			iph.daddr = htonl(oldaddr);
+			csum_replace2(&udph->check, udph->dest, htons(oldp));
+			udph->dest = htons(oldp);
+			break;
+
+		case IPPROTO_ICMPV6:
+			// Only echo request and reply make it here, see ivi_v6v4_xmit()
+			iph.protocol = IPPROTO_ICMP;
+			icmph = (struct icmphdr *)payload;
+			type = *(__be16 *)icmph;
+			icmph->type = (icmph->type == ICMPV6_ECHO_REQUEST) ? ICMP_ECHO : ICMP_ECHOREPLY;
+			csum_replace2(&icmph->checksum, type, *(__be16 *)icmph);
+
+			if (icmph->type == ICMP_ECHOREPLY && !nat_conntrack) {
+				if (get_inflow_map_port(&icmp_list, ntohs(icmph->un.echo.id), ntohl(iph.saddr), \
+				                        &oldaddr, &oldp) == 0) {
+					iph.daddr = htonl(oldaddr);
+					csum_replace2(&icmph->checksum, icmph->un.echo.id, htons(oldp));
+					icmph->un.echo.id = htons(oldp);
+				}
+			}
+			break;
+
+		default:
+			IVI_STATS_INC(IVI_STAT_DROP_PROTO);
+			return 0;
+	}
+
+	// The later fragments follow the mapping of the first one
+	if (fragh && (fragh->frag_off & htons(IP6_MF))) {
+		frag.saddr6 = ip6h->saddr;
+		frag.daddr6 = ip6h->daddr;
+		frag.id = fragh->identification;
+		frag.saddr = iph.saddr;
+		frag.daddr = iph.daddr;
+		frag.protocol = iph.protocol;
+		ivi_frag_learn(&frag);
+	}
+
+	/*
+	 * The pseudo-header sum has to be taken before the IPv6 header is overwritten. The length
+	 * of a first fragment is not the length of the datagram, but it is the same on both sides.
+	 */
+	csum = csum_pseudo6(&(ip6h->saddr), &(ip6h->daddr), plen, next_hdr);
+
+	skb_pull(skb, poffset);
+	skb_reset_transport_header(skb);
+	ip4h = (struct iphdr *)skb_push(skb, sizeof(struct iphdr));
+	memcpy(ip4h, &iph, sizeof(struct iphdr));
+	ip4h->check = 0;
+	ip4h->check = ip_fast_csum((__u8 *)ip4h, ip4h->ihl);
+
+	switch (ip4h->protocol) {
+		case IPPROTO_TCP:
+			tcph = tcp_hdr(skb);
+			if (skb->ip_summed == CHECKSUM_PARTIAL)
+				tcph->check = ~csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_TCP, 0);
+			else
+				tcph->check = csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_TCP, \
+				                                csum_sub(~csum_unfold(tcph->check), csum));
+			break;
+
+		case IPPROTO_UDP:
+			udph = udp_hdr(skb);
+			if (skb->ip_summed == CHECKSUM_PARTIAL)
+				udph->check = ~csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_UDP, 0);
+			else {
+				udph->check = csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_UDP, \
+				                                csum_sub(~csum_unfold(udph->check), csum));
+				if (udph->check == 0)
+					udph->check = CSUM_MANGLED_0;
+			}
+			break;
+
+		case IPPROTO_ICMP:
+			// ICMPv6 has a pseudo-header, ICMPv4 does not
+			icmph = icmp_hdr(skb);
+			icmph->checksum = csum_fold(csum_sub(~csum_unfold(icmph->checksum), csum));
+			break;
+	}
+
+	return ivi_reinject(skb, __constant_htons(ETH_P_IP), mac);
+}
+
+int ivi_v6v4_xmit(struct sk_buff *skb) {
+	struct sk_buff *newskb;
+	struct ethhdr *eth6, *eth4;
+	struct iphdr *ip4h, *icmp_ip4h;
+	struct ipv6hdr *ip6h, *icmp_ip6h;
+	struct tcphdr *tcph, *icmp_tcph;
+	struct udphdr *udph, *icmp_udph;
+	struct icmphdr *icmph, *icmp_icmp4h;
+	struct frag_hdr *fragh;
+	__u8 *payload;
+	int hlen, plen;
+	__u8 poffset;
+	__u8 flag4;
+	__u16 off4;
+	__be32 oldaddr;
+	__be16 oldp;
+	u16 s_ratio, s_adj, s_offset, d_ratio, d_adj, d_offset;
+	u8 next_hdr, *ext_hdr;
+	bool rewrite;
+	
+	fragh = NULL;
+		
+	eth6 = eth_hdr(skb);
+	ip6h = ipv6_hdr(skb);
+	hlen = sizeof(struct iphdr);
+	plen = ntohs(ip6h->payload_len);
+	poffset = sizeof(struct ipv6hdr);  // Payload Offset
+	
+	// This should not happen since we are hooked on PF_INET6.
+	if (unlikely(eth6->h_proto != __constant_ntohs(ETH_P_IPV6))) {
+		return -EINVAL;  // Just accept.
+	}
+	
+	// By pass ipv6 multicast packet (for ND)
+	if (mc_v6_addr(&(ip6h->daddr))) {
+		return -EINVAL;
+	}
+
+	// leave the generation of ICMP packet to the protocol stack
+	if (ip6h->hop_limit <= 1) {
+		return -EINVAL;
+	}
+
+	/*
+	 * GSO packets cannot be copied into a single buffer, they are always rewritten. So are
+	 * fragments: the copying path below cannot tell the ports of the later ones.
+	 */
+	rewrite = xlate_inplace || skb_is_gso(skb) || ip6h->nexthdr == IPPROTO_FRAGMENT;
+	if (rewrite) {
+		// Headers must be linear and ours alone before we rewrite them.
+		if (!pskb_may_pull(skb, min_t(unsigned int, skb->len, IVI_XLATE_PULL)) || skb_cow_head(skb, 0)) {
+			IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+			return 0;  // Drop packet on low memory
+		}
+		eth6 = eth_hdr(skb);
+		ip6h = ipv6_hdr(skb);
+	}
+	
+	// process extension headers
+	next_hdr = ip6h->nexthdr;
+	ext_hdr = (__u8 *)ip6h + sizeof(struct ipv6hdr);
+	while (next_hdr != IPPROTO_IPIP &&
+	       next_hdr != IPPROTO_TCP && 
+	       next_hdr != IPPROTO_UDP && 
+	       next_hdr != IPPROTO_ICMPV6) {
+	       
+		if (next_hdr == IPPROTO_FRAGMENT) {
+#ifdef IVI_DEBUG
+			printk(KERN_DEBUG "FRAGMENT header: frag_off is %x, identification is %x\n", \
+			                  ntohs(*((u16 *)ext_hdr + 1)), ntohl(*((u32 *)ext_hdr + 1)));
+#endif
+			fragh = (struct frag_hdr *)ext_hdr;
+			plen -= sizeof(struct frag_hdr);
+			poffset += sizeof(struct frag_hdr);
+			next_hdr = fragh->nexthdr;
+			ext_hdr += sizeof(struct frag_hdr);
+		}
+		else if (next_hdr == IPPROTO_AH) {
+			printk(KERN_INFO "AH header, length is %d\n", *(ext_hdr + 1));
+			plen -= (*(ext_hdr + 1) << 2) + 8;
+			poffset += (*(ext_hdr + 1) << 2) + 8;
+			next_hdr = *ext_hdr;
+			ext_hdr += (*(ext_hdr + 1) << 2) + 8;
 		}
 		else {
 			printk(KERN_INFO "other header type is %d, length is %d\n", next_hdr, *(ext_hdr + 1));
@@ -630,8 +1675,22 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 		}
 	}
 	
-	if (!(newskb = dev_alloc_skb(2 + ETH_HLEN + max(hlen + plen, 184) + 20))) {
+	if (fragh) {
+		// Only TCP and UDP checksums can be fixed up from the first fragment alone
+		if (rewrite && (next_hdr == IPPROTO_TCP || next_hdr == IPPROTO_UDP))
+			return ivi_v6v4_xlate_inplace(skb, fragh, next_hdr, poffset, plen);
+	} else if (rewrite) {
+		// ICMPv6 errors embed a whole packet to translate, leave them to the copying path below
+		icmph = (struct icmphdr *)((__u8 *)ip6h + poffset);
+		if (next_hdr != IPPROTO_ICMPV6 || icmph->type == ICMPV6_ECHO_REQUEST || \
+		    icmph->type == ICMPV6_ECHO_REPLY)
+			return ivi_v6v4_xlate_inplace(skb, NULL, next_hdr, poffset, plen);
+	}
+
+	if (!(newskb = ivi_alloc_skb(2 + ETH_HLEN + max(hlen + plen, 184) + 20))) {
 		printk(KERN_ERR "ivi_v6v4_xmit: failed to allocate new socket buffer.\n");
+		IVI_STATS_INC(IVI_STAT_ALLOC_FAIL);
+		IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
 		return 0;  // Drop packet on low memory
 	}
 	skb_reserve(newskb, 2);  // Align IP header on 16 byte boundary (ETH_LEN + 2)
@@ -643,138 +1702,9 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 	if (next_hdr == IPPROTO_IPIP) { // Decapsulation
 		payload = (__u8 *)skb_put(newskb, plen);
 		skb_copy_bits(skb, poffset, payload, plen);
-		ip4h = (struct iphdr *)payload;
-		payload += ip4h->ihl << 2;
-		
-		switch (ip4h->protocol) {
-			case IPPROTO_TCP:
-				tcph = (struct tcphdr *)payload;
-
-				if (!port_in_range(ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
-					//printk(KERN_INFO "ivi_v6v4_xmit: TCP dest port %d is not in range (r=%d, m=%d, o=%d)."
-					//                 "Drop packet.\n", ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
-					kfree_skb(newskb);
-					return 0;
-				}
-				
-				if (ivi_mode == IVI_MODE_HGW && ntohs(tcph->dest) < 1024) {
-					oldaddr = ntohl(ip4h->daddr);
-					oldp = ntohs(tcph->dest);
-				}
-				
-				else if (get_inflow_tcp_map_port(ntohs(tcph->dest), ntohl(ip4h->saddr), ntohs(tcph->source), \
-				                            tcph, plen, &oldaddr, &oldp) == -1) {
-					//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (TCP).\n",
-					//	               ntohs(tcph->dest));
-					kfree_skb(newskb);
-					return 0;
-				}
-						
-				csum_replace4(&tcph->check, ip4h->daddr, htonl(oldaddr));
-				csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
-				ip4h->daddr = htonl(oldaddr);
-						
-				csum_replace2(&tcph->check, tcph->dest, htons(oldp));
-				tcph->dest = htons(oldp);
-
-				if (tcph->syn && (tcph->doff > 5)) {
-					__u16 *option = (__u16*)tcph;
-					if (option[10] == htons(0x0204)) {
-						if (ntohs(option[11]) > mss_limit) {
-							csum_replace2(&tcph->check, option[11], htons(mss_limit));
-							option[11] = htons(mss_limit);
-						}
-					}
-				}
-
-				break;
-
-			case IPPROTO_UDP:
-				udph = (struct udphdr *)payload;
-
-				if (!port_in_range(ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset)) {
-					//printk(KERN_INFO "ivi_v6v4_xmit: UDP dest port %d is not in range (r=%d, m=%d, o=%d)."
-					//                 "Drop packet.\n", ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
-					kfree_skb(newskb);
-					return 0;
-				}
-				
-				if (ivi_mode == IVI_MODE_HGW && ntohs(udph->dest) < 1024) {
-					oldaddr = ntohl(ip4h->daddr);
-					oldp = ntohs(udph->dest);
-				}
-				
-				else if (get_inflow_map_port(&udp_list,  ntohs(udph->dest), ntohl(ip4h->saddr), \
-				                        &oldaddr, &oldp) == -1) {
-					//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (UDP).\n",
-					//                 ntohs(udph->dest));	
-					kfree_skb(newskb);
-					return 0;
-				}
-				
-				// If checksum of UDP inside IPv4 packet is 0, we MUST NOT update the checksum value.
-				if (udph->check != 0) {
-					csum_replace4(&udph->check, ip4h->daddr, htonl(oldaddr));
-					csum_replace2(&udph->check, udph->dest, htons(oldp));
-				}						
-				
-				csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
-				ip4h->daddr = htonl(oldaddr);
-				udph->dest = htons(oldp);
-
-				break;
-
-			case IPPROTO_ICMP:
-				icmph = (struct icmphdr *)payload;
-				if (icmph->type == ICMP_ECHOREPLY) {
-					if (get_inflow_map_port(&icmp_list, ntohs(icmph->un.echo.id), ntohl(ip4h->saddr), \
-					                        &oldaddr, &oldp) == -1) {
-					    tempaddr = ntohl(ip4h->saddr);
-						printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for ( " NIP4_FMT \
-						                ", %d) (ICMP).\n", NIP4(tempaddr), ntohs(icmph->un.echo.id));
-						kfree_skb(newskb);
-						return 0;
-					} else {
-						csum_replace4(&ip4h->check, ip4h->daddr, htonl(oldaddr));
-						ip4h->daddr = htonl(oldaddr);
-							
-						csum_replace2(&icmph->checksum, icmph->un.echo.id, htons(oldp));
-						icmph->un.echo.id = htons(oldp);
-					}
-				}
-				else if (icmph->type == ICMP_ECHO) {
-					if (ivi_mode == IVI_MODE_HGW_NAT44) { 
-#ifdef IVI_DEBUG
-						printk(KERN_INFO "ivi_v6v4_xmit: you can't ping private address when CPE is working in NAT44 mode\n");
-#endif
-						return 0; // silently drop
-					}
-				} 
-				else if (icmph->type == ICMP_TIME_EXCEEDED) {
-					icmp_ip4h = (struct iphdr *)((__u8 *)icmph + 8);
-					if (icmp_ip4h->protocol == IPPROTO_ICMP) {
-						icmp_icmp4h = (struct icmphdr *)((__u8 *)icmp_ip4h + (icmp_ip4h->ihl << 2));
-						if (icmp_icmp4h->type == ICMP_ECHO) {
-							if (get_inflow_map_port(&icmp_list, ntohs(icmp_icmp4h->un.echo.id), \
-							                   ntohl(icmp_ip4h->daddr), &oldaddr, &oldp) == -1) {
-								printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (ICMP) "\
-								                "in IP packet.\n", ntohs(icmph->un.echo.id));
-								kfree_skb(newskb);
-								return 0;
-							} else {
-								csum_replace4(&icmp_ip4h->check, icmp_ip4h->saddr, htonl(oldaddr));
-								icmp_ip4h->saddr = htonl(oldaddr);					
-								csum_replace2(&icmp_icmp4h->checksum, icmp_icmp4h->un.echo.id, htons(oldp));
-								icmp_icmp4h->un.echo.id = htons(oldp);
-							}
-						}
-					}
-				}
-				break;
-
-			default:
-				kfree_skb(newskb);
-				return 0;
+		if (ivi_v6v4_decap_nat44((struct iphdr *)payload, plen) != 0) {
+			kfree_skb(newskb);
+			return 0;
 		}
 	} 
 	
@@ -817,10 +1747,11 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					//printk(KERN_INFO "ivi_v6v4_xmit: TCP dest port %d is not in range (r=%d, m=%d, o=%d). "
 					//                 "Drop packet.\n", ntohs(tcph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
 					kfree_skb(newskb);
+					IVI_STATS_INC(IVI_STAT_DROP_PORT);
 					return 0;
 				}
 				
-				if (ivi_mode == IVI_MODE_HGW && ntohs(tcph->dest) < 1024) {
+				if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(tcph->dest) < 1024)) {
 					oldaddr = ntohl(ip4h->daddr);
 					oldp = ntohs(tcph->dest);
 				}
@@ -830,6 +1761,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (TCP).\n", 
 					//                 ntohs(tcph->dest));                 
 					kfree_skb(newskb);
+					IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
 					return 0;
 				} 
 					
@@ -847,7 +1779,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 
 				tcph->check = 0;
 				tcph->check = csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_TCP, \
-				                                csum_partial(payload, plen, 0));
+				                                ivi_csum_partial(payload, plen, IPPROTO_TCP));
 				break;
 
 			case IPPROTO_UDP:
@@ -858,10 +1790,11 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					//printk(KERN_INFO "ivi_v6v4_xmit: UDP dest port %d is not in range (r=%d, m=%d, o=%d)." 
 					//	                " Drop packet.\n", ntohs(udph->dest), hgw_ratio, hgw_adjacent, hgw_offset);
 					kfree_skb(newskb);
+					IVI_STATS_INC(IVI_STAT_DROP_PORT);
 					return 0;
 				}
 					
-				if (ivi_mode == IVI_MODE_HGW && ntohs(udph->dest) < 1024) {
+				if (nat_conntrack || (ivi_mode == IVI_MODE_HGW && ntohs(udph->dest) < 1024)) {
 					oldaddr = ntohl(ip4h->daddr);
 					oldp = ntohs(udph->dest);
 				}
@@ -870,6 +1803,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 				                        &oldaddr, &oldp) == -1) {
 					//printk(KERN_ERR "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (UDP).\n", ntohs(udph->dest));
 					kfree_skb(newskb);
+					IVI_STATS_INC(IVI_STAT_DROP_NOMAP);
 					return 0;
 				}
 
@@ -878,7 +1812,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 
 				udph->check = 0;
 				udph->check = csum_tcpudp_magic(ip4h->saddr, ip4h->daddr, plen, IPPROTO_UDP, \
-				                                csum_partial(payload, plen, 0));
+				                                ivi_csum_partial(payload, plen, IPPROTO_UDP));
 				break;
 
 			case IPPROTO_ICMPV6:  // indicating ICMPv4 packet			
@@ -890,7 +1824,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					skb_copy_bits(skb, poffset + 8, payload + 8, plen - 8);
 					icmph->type = (icmph->type == ICMPV6_ECHO_REQUEST) ? ICMP_ECHO : ICMP_ECHOREPLY;
 
-					if (icmph->type == ICMP_ECHOREPLY) {
+					if (icmph->type == ICMP_ECHOREPLY && !nat_conntrack) {
 						if (get_inflow_map_port(&icmp_list, ntohs(icmph->un.echo.id), ntohl(ip4h->saddr),\
 						                        &oldaddr, &oldp) == -1) {
 							//printk(KERN_INFO "ivi_v6v4_xmit: fail to perform nat44 mapping for %d (ICMP).\n", 
@@ -902,7 +1836,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					}
 
 					icmph->checksum = 0;
-					icmph->checksum = ip_compute_csum(icmph, plen);
+					icmph->checksum = csum_fold(ivi_csum_partial(icmph, plen, IPPROTO_ICMP));
 					
 				} else {
 					if (icmph->type == ICMPV6_TIME_EXCEED) {
@@ -917,6 +1851,8 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					}
 					else {
 						//printk(KERN_ERR "ivi_v6v4_xmit: unsupported ICMP type. Drop Packet now.\n");
+						kfree_skb(newskb);
+						IVI_STATS_INC(IVI_STAT_DROP_ICMP);
 						return 0;
 					}
 					
@@ -942,20 +1878,23 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 					skb_copy_bits(skb, poffset + sizeof(struct icmp6hdr) + sizeof(struct ipv6hdr), payload,\
 						              ntohs(icmp_ip6h->payload_len));
 
+					// With nat_conntrack, nf_nat reverts the quoted header of the related packet
 					switch (icmp_ip4h->protocol) {
 						case IPPROTO_TCP:
 							icmp_tcph = (struct tcphdr *)((__u8 *)icmp_ip4h + 20);
-							oldaddr = oldp = 0;
-							get_inflow_tcp_map_port(ntohs(icmp_tcph->source), ntohl(icmp_ip4h->daddr), 
-							    ntohs(icmp_tcph->dest), icmp_tcph, ntohs(icmp_ip4h->tot_len) - 20,&oldaddr, &oldp);
+							if (!nat_conntrack) {
+								oldaddr = oldp = 0;
+								get_inflow_tcp_map_port(ntohs(icmp_tcph->source), ntohl(icmp_ip4h->daddr), 
+								    ntohs(icmp_tcph->dest), icmp_tcph, ntohs(icmp_ip4h->tot_len) - 20,&oldaddr, &oldp);
 							    
-							if (oldaddr == 0 && oldp == 0) // Many ICMP packets have an uncomplete inside TCP structure:
-							                               // return value is -1 alone cannot imply a fail lookup. 
-								printk(KERN_ERR "ivi_v6v4_xmit: tcp-in-icmp reverse lookup failure.\n");
+								if (oldaddr == 0 && oldp == 0) // Many ICMP packets have an uncomplete inside TCP structure:
+								                               // return value is -1 alone cannot imply a fail lookup. 
+									printk(KERN_ERR "ivi_v6v4_xmit: tcp-in-icmp reverse lookup failure.\n");
 								
-							else {
-								icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
-								icmp_tcph->source = htons(oldp);
+								else {
+									icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
+									icmp_tcph->source = htons(oldp);
+								}
 							}
 							icmp_tcph->check = 0;
 							icmp_tcph->check = csum_tcpudp_magic(icmp_ip4h->saddr, icmp_ip4h->daddr, \
@@ -964,13 +1903,15 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 							break;
 						case IPPROTO_UDP:
 							icmp_udph = (struct udphdr *)((__u8 *)icmp_ip4h + 20);
-							if (get_inflow_map_port(&udp_list, ntohs(icmp_udph->source), ntohl(icmp_ip4h->daddr), \
-							                        &oldaddr, &oldp) == -1) {
-								printk(KERN_ERR "ivi_v6v4_xmit: udp-in-icmp reverse lookup failure.\n");
+							if (!nat_conntrack) {
+								if (get_inflow_map_port(&udp_list, ntohs(icmp_udph->source), ntohl(icmp_ip4h->daddr), \
+								                        &oldaddr, &oldp) == -1) {
+									printk(KERN_ERR "ivi_v6v4_xmit: udp-in-icmp reverse lookup failure.\n");
 								
-							} else {
-								icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
-								icmp_udph->source = htons(oldp);
+								} else {
+									icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
+									icmp_udph->source = htons(oldp);
+								}
 							}
 							icmp_udph->len = htons(ntohs(icmp_ip4h->tot_len) - 20);
 							icmp_udph->check = 0;
@@ -983,12 +1924,14 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 							icmp_icmp4h = (struct icmphdr *)((__u8 *)icmp_ip4h + 20);
 							if (icmp_icmp4h->type == ICMPV6_ECHO_REQUEST || icmp_icmp4h->type == ICMPV6_ECHO_REPLY) {
 								icmp_icmp4h->type=(icmp_icmp4h->type==ICMPV6_ECHO_REQUEST)?ICMP_ECHO:ICMPV6_ECHO_REPLY;
-								if (get_inflow_map_port(&icmp_list, ntohs(icmp_icmp4h->un.echo.id), \
-								                        ntohl(icmp_ip4h->daddr), &oldaddr, &oldp) == -1)
-									printk(KERN_ERR "ivi_v6v4_xmit: echo-in-icmp reverse lookup failure.\n");
-								else {
-									icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
-									icmp_icmp4h->un.echo.id = htons(oldp);
+								if (!nat_conntrack) {
+									if (get_inflow_map_port(&icmp_list, ntohs(icmp_icmp4h->un.echo.id), \
+									                        ntohl(icmp_ip4h->daddr), &oldaddr, &oldp) == -1)
+										printk(KERN_ERR "ivi_v6v4_xmit: echo-in-icmp reverse lookup failure.\n");
+									else {
+										icmp_ip4h->saddr = ip4h->daddr = htonl(oldaddr);
+										icmp_icmp4h->un.echo.id = htons(oldp);
+									}
 								}
 								icmp_icmp4h->checksum = 0;
 								icmp_icmp4h->checksum = ip_compute_csum(icmp_icmp4h, ntohs(icmp_ip4h->tot_len)-20);
@@ -1005,6 +1948,7 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 
 			default:
 				kfree_skb(newskb);
+				IVI_STATS_INC(IVI_STAT_DROP_PROTO);
 				return 0;
 		}
 		ip4h->check = 0;
@@ -1014,7 +1958,142 @@ int ivi_v6v4_xmit(struct sk_buff *skb) {
 	// Prepare to re-enter the protocol stack
 	newskb->protocol = eth_type_trans(newskb, skb->dev);
 	newskb->ip_summed = CHECKSUM_NONE;
+	skb_reset_network_header(newskb);
  
-	netif_rx(newskb);
+	ivi_deliver(newskb);
+	return 0;
+}
+
+/* Receive-side fast path, called from the rx_handler on v4_dev/v6_dev before the
+ * packet enters the IP layer. Only packets of already established TCP/UDP sessions
+ * are taken here; everything else returns -EINVAL and continues up the normal
+ * netfilter path, where new mappings get created. The header sanity checks done by
+ * ip_rcv()/ipv6_rcv() are repeated since we run ahead of them. */
+int ivi_v4v6_fastpath(struct sk_buff *skb) {
+	struct iphdr *ip4h;
+	struct tcphdr *tcph;
+	struct udphdr *udph;
+	unsigned int ihl, len;
+	int ret;
+
+	if (skb->pkt_type == PACKET_OTHERHOST || !pskb_may_pull(skb, sizeof(struct iphdr)))
+		return -EINVAL;
+
+	ip4h = ip_hdr(skb);
+	ihl = ip4h->ihl << 2;
+	len = ntohs(ip4h->tot_len);
+	if (ip4h->version != 4 || ihl < sizeof(struct iphdr) || len < ihl || skb->len < len)
+		return -EINVAL;
+
+	if (!pskb_may_pull(skb, ihl + sizeof(struct tcphdr)))
+		return -EINVAL;
+	ip4h = ip_hdr(skb);
+
+	if (unlikely(ip_fast_csum((__u8 *)ip4h, ip4h->ihl)))
+		return -EINVAL;
+
+	// Fragments, expiring and local packets are left to the stack
+	if (ip_is_fragment(ip4h) || ip4h->ttl <= 1)
+		return -EINVAL;
+
+	if (ipv4_is_multicast(ip4h->daddr) || ipv4_is_lbcast(ip4h->daddr) || \
+	    ipv4_is_loopback(ip4h->daddr) || addr_in_v4network(&(ip4h->daddr)))
+		return -EINVAL;
+
+	switch (ip4h->protocol) {
+		case IPPROTO_TCP:
+			tcph = (struct tcphdr *)((__u8 *)ip4h + ihl);
+			if (ivi_mode == IVI_MODE_HGW && ntohs(tcph->source) < 1024)
+				return -EINVAL;
+			// Cached flows are translated right here, without a look at the session tables
+			if (flow_cache && !nat_conntrack) {
+				if (pskb_trim_rcsum(skb, len) || \
+				    !pskb_may_pull(skb, min_t(unsigned int, skb->len, IVI_XLATE_PULL)) || \
+				    skb_cow_head(skb, ETH_HLEN + sizeof(struct ipv6hdr))) {
+					IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+					return 0;
+				}
+				if ((ret = ivi_v4v6_flow_xmit(skb)) != -EINVAL)
+					return ret;
+				ip4h = ip_hdr(skb);
+				tcph = (struct tcphdr *)((__u8 *)ip4h + ihl);
+			}
+			if (!ivi_map_tcp_established(ntohl(ip4h->saddr), ntohs(tcph->source), \
+			                             ntohl(ip4h->daddr), ntohs(tcph->dest)))
+				return -EINVAL;
+			break;
+
+		case IPPROTO_UDP:
+			udph = (struct udphdr *)((__u8 *)ip4h + ihl);
+			if (ivi_mode == IVI_MODE_HGW && ntohs(udph->source) < 1024)
+				return -EINVAL;
+			if (!ivi_map_established(&udp_list, ntohl(ip4h->saddr), ntohs(udph->source), \
+			                         ntohl(ip4h->daddr)))
+				return -EINVAL;
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	if (pskb_trim_rcsum(skb, len)) {
+		IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+		return 0;
+	}
+
+	ret = ivi_v4v6_xmit(skb);
+	// The source may already be rewritten at this point, so never hand it on to the stack
+	return (ret == -EINVAL) ? 0 : ret;
+}
+
+int ivi_v6v4_fastpath(struct sk_buff *skb) {
+	struct ipv6hdr *ip6h;
+	unsigned int len;
+
+	if (skb->pkt_type == PACKET_OTHERHOST || !pskb_may_pull(skb, sizeof(struct ipv6hdr)))
+		return -EINVAL;
+
+	ip6h = ipv6_hdr(skb);
+	len = ntohs(ip6h->payload_len) + sizeof(struct ipv6hdr);
+	if (ip6h->version != 6 || ip6h->payload_len == 0 || skb->len < len)
+		return -EINVAL;
+
+	// Extension headers and ICMPv6 (ND among others) go the long way
+	if (ip6h->nexthdr != IPPROTO_TCP && ip6h->nexthdr != IPPROTO_UDP && ip6h->nexthdr != IPPROTO_IPIP)
+		return -EINVAL;
+
+	if (mc_v6_addr(&(ip6h->daddr)) || ip6h->hop_limit <= 1)
+		return -EINVAL;
+
+	if (pskb_trim_rcsum(skb, len)) {
+		IVI_STATS_INC(IVI_STAT_DROP_NOMEM);
+		return 0;
+	}
+
+	// Inbound lookups never create mappings, so unknown sessions are simply dropped as before
+	return ivi_v6v4_xmit(skb);
+}
+
+int ivi_xmit_init(void) {
+	struct ivi_batch *batch;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		batch = &per_cpu(ivi_batch, cpu);
+		skb_queue_head_init(&batch->queue);
+		tasklet_init(&batch->flush, ivi_batch_flush, (unsigned long)batch);
+	}
 	return 0;
 }
+
+// called once the hooks are gone, so nothing can be queued any more
+void ivi_xmit_exit(void) {
+	struct ivi_batch *batch;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		batch = &per_cpu(ivi_batch, cpu);
+		tasklet_kill(&batch->flush);
+		skb_queue_purge(&batch->queue);
+	}
+}
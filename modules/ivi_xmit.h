@@ -55,12 +55,17 @@
 #include <linux/icmp.h>
 #include <net/ndisc.h>
 #include <net/route.h>
+#include <linux/skbuff.h>
+#include <linux/interrupt.h>
+#include <linux/percpu.h>
 
 #include "ivi_config.h"
 #include "ivi_rule.h"
 #include "ivi_rule6.h"
 #include "ivi_map.h"
 #include "ivi_map_tcp.h"
+#include "ivi_stats.h"
+#include "ivi_trace.h"
 #include "ivi_nf.h"
 
 extern __be32 v4address;
@@ -77,9 +82,17 @@ extern u8 hgw_transport;
 
 extern u16 mss_limit;
 
+/* ivi_v4v6_xmit() and ivi_v6v4_xmit() return 0 to drop the packet, -EINVAL to accept it,
+ * or IVI_XMIT_STOLEN when the packet was translated in place and handed back to the stack. */
+#define IVI_XMIT_STOLEN 1
+
 extern int ivi_v4v6_xmit(struct sk_buff *skb);
 extern int ivi_v6v4_xmit(struct sk_buff *skb);
+extern int ivi_v4v6_fastpath(struct sk_buff *skb);
+extern int ivi_v6v4_fastpath(struct sk_buff *skb);
 extern int ivi_v4_dev(struct net_device *dev);
+extern int ivi_xmit_init(void);
+extern void ivi_xmit_exit(void);
 extern int ivi_v6_dev(struct net_device *dev);
 
 
@@ -64,6 +64,7 @@ static const struct option longopts[] =
 	{"dev4", required_argument, NULL, 'i'},
 	{"dev6", required_argument, NULL, 'I'},
 	{"mssclamping", required_argument, NULL, 'c'},
+	{"hashsize", required_argument, NULL, 't'},
 	{NULL, no_argument, NULL, 0}
 };
 
@@ -76,6 +77,7 @@ static char psidoff;
 static char dev[IVI_IOCTL_LEN];
 static __u16 gma[2];  // Store R and PSID, M is stored in 'rule.adjacent'
 static __u16 mss_val;
+static unsigned int hash_size;
 static struct in_addr v4addr;
 static struct rule_info rule;
 
@@ -174,6 +176,8 @@ start_options:\n\
 		specify the name of ipv6 device\n\
 	-c --mssclamping MSS\n\
 		specify the reduced tcp mss value\n\
+	-t --hashsize SIZE\n\
+		specify the initial number of buckets in each session hash table\n\
 \n\
 	HGW mode:\n\
 		-H --hgw\n\
@@ -382,7 +386,7 @@ rule_opt:
 	goto out;
 
 start_opt:
-	while ((optc = getopt_long(argc, argv, "i:I:A:a:P:R:z:o:fc:HNXET", longopts, NULL)) != -1)
+	while ((optc = getopt_long(argc, argv, "i:I:A:a:P:R:z:o:fc:t:HNXET", longopts, NULL)) != -1)
 	{
 		switch(optc)
 		{
@@ -407,6 +411,13 @@ start_opt:
 					goto out;
 				}
 				break;
+			case 't':
+				hash_size = atoi(optarg);
+				if ((retval = ioctl(fd, IVI_IOC_HTABLE_SIZE, (void*)(&hash_size))) < 0) {
+					printf("\nError*****: failed to set session hash table size, code %d.\n\n", retval);
+					goto out;
+				}
+				break;
 			case 'H':
 				hgw = 1;
 				break;